@@ -41,6 +41,7 @@
 #include "byteorder.h"
 #include "crypto.h"
 #include "base64.h"
+#include "threadlocal.h"
 
 using namespace std;
 using namespace Crypto;
@@ -145,12 +146,26 @@ string Base64Key::printable_key( void ) const
   return string( base64 );
 }
 
+/* Scratch space for encrypt() and decrypt(), one set for each thread
+   rather than for each Session, of which a server may have thousands. */
+class SessionBuffers {
+public:
+  AlignedBuffer plaintext;
+  AlignedBuffer ciphertext;
+  AlignedBuffer nonce;
+
+  SessionBuffers()
+    : plaintext( Session::RECEIVE_MTU ),
+      ciphertext( Session::RECEIVE_MTU ),
+      nonce( Nonce::NONCE_LEN )
+  {}
+};
+
+static ThreadLocal< SessionBuffers > session_buffers;
+
 Session::Session( Base64Key s_key )
   : key( s_key ), ctx_buf( ae_ctx_sizeof() ),
-    ctx( (ae_ctx *)ctx_buf.data() ), blocks_encrypted( 0 ),
-    plaintext_buffer( RECEIVE_MTU ),
-    ciphertext_buffer( RECEIVE_MTU ),
-    nonce_buffer( Nonce::NONCE_LEN )
+    ctx( (ae_ctx *)ctx_buf.data() ), blocks_encrypted( 0 )
 {
   if ( AE_SUCCESS != ae_init( ctx, key.data(), 16, 12, 16 ) ) {
     throw CryptoException( "Could not initialize AES-OCB context." );
@@ -202,14 +217,30 @@ Message::Message( Nonce s_nonce, string s_text )
 
 string Session::encrypt( Message plaintext )
 {
-  const size_t pt_len = plaintext.text.size();
+  string ciphertext( plaintext.text.size() + ADDED_BYTES, '\0' );
+  ciphertext.resize( encrypt( plaintext.nonce, "", 0, plaintext.text,
+			      &ciphertext[ 0 ], ciphertext.size() ) );
+  return ciphertext;
+}
+
+size_t Session::encrypt( const Nonce &nonce, const char *head, size_t head_len,
+			 const string &body, char *out, size_t out_len )
+{
+  SessionBuffers &buffers = session_buffers.get();
+  AlignedBuffer &plaintext_buffer = buffers.plaintext;
+  AlignedBuffer &ciphertext_buffer = buffers.ciphertext;
+  AlignedBuffer &nonce_buffer = buffers.nonce;
+
+  const size_t pt_len = head_len + body.size();
   const int ciphertext_len = pt_len + 16;
 
   assert( (size_t)ciphertext_len <= ciphertext_buffer.len() );
   assert( pt_len <= plaintext_buffer.len() );
+  assert( pt_len + ADDED_BYTES <= out_len );
 
-  memcpy( plaintext_buffer.data(), plaintext.text.data(), pt_len );
-  memcpy( nonce_buffer.data(), plaintext.nonce.data(), Nonce::NONCE_LEN );
+  memcpy( plaintext_buffer.data(), head, head_len );
+  memcpy( plaintext_buffer.data() + head_len, body.data(), body.size() );
+  memcpy( nonce_buffer.data(), nonce.data(), Nonce::NONCE_LEN );
 
   if ( ciphertext_len != ae_encrypt( ctx,                                     /* ctx */
 				     nonce_buffer.data(),                     /* nonce */
@@ -245,9 +276,10 @@ string Session::encrypt( Message plaintext )
     throw CryptoException( "Encrypted 2^47 blocks.", true );
   }
 
-  string text( ciphertext_buffer.data(), ciphertext_len );
+  memcpy( out, nonce.data() + 4, 8 );
+  memcpy( out + 8, ciphertext_buffer.data(), ciphertext_len );
 
-  return plaintext.nonce.cc_str() + text;
+  return 8 + ciphertext_len;
 }
 
 Message Session::decrypt( string ciphertext )
@@ -258,6 +290,11 @@ Message Session::decrypt( string ciphertext )
 
   char *str = (char *)ciphertext.data();
 
+  SessionBuffers &buffers = session_buffers.get();
+  AlignedBuffer &plaintext_buffer = buffers.plaintext;
+  AlignedBuffer &ciphertext_buffer = buffers.ciphertext;
+  AlignedBuffer &nonce_buffer = buffers.nonce;
+
   int body_len = ciphertext.size() - 8;
   int pt_len = body_len - 16;
 
@@ -119,17 +119,20 @@ namespace Crypto {
     ae_ctx *ctx;
     uint64_t blocks_encrypted;
 
-    AlignedBuffer plaintext_buffer;
-    AlignedBuffer ciphertext_buffer;
-    AlignedBuffer nonce_buffer;
-    
   public:
     static const int RECEIVE_MTU = 2048;
+    /* the nonce's low octets ahead of the ciphertext, and the tag */
+    static const int ADDED_BYTES = 8 + 16;
 
     Session( Base64Key s_key );
     ~Session();
     
     string encrypt( Message plaintext );
+    /* Encrypt the text that is head followed by body straight into
+       out, which must have room for ADDED_BYTES more than that.
+       Returns the length written. */
+    size_t encrypt( const Nonce &nonce, const char *head, size_t head_len,
+		    const string &body, char *out, size_t out_len );
     Message decrypt( string ciphertext );
     
     Session( const Session & );
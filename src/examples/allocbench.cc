@@ -0,0 +1,192 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Counts heap allocations in a client and a server Transport talking
+   over loopback in this process, to check that the transport hands
+   states around rather than copying them: what one command costs end
+   to end and how much of that the server's get_remote_diff() takes;
+   what reading the remote state and ticking cost when nothing is new;
+   and what restoring the server's sender costs when it is handed over
+   to another process with states still unacknowledged.
+
+   Usage: allocbench [COMMANDS] */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <new>
+
+#include "commandstream.h"
+#include "fatal_assert.h"
+#include "select.h"
+#include "networktransport.cc"
+
+using namespace Network;
+
+typedef Transport<Term::CommandStream, Term::CommandStream> CommandTransport;
+
+static const int IDLE_CALLS = 10000;
+static const int HANDOFF_STATES = 16;
+
+static size_t allocations = 0;
+
+#if __cplusplus >= 201103L
+void *operator new( size_t size )
+#else
+void *operator new( size_t size ) throw( std::bad_alloc )
+#endif
+{
+  allocations++;
+  void *p = malloc( size ? size : 1 );
+  if ( p == NULL ) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete( void *p ) throw()
+{
+  free( p );
+}
+
+/* Wait until the server has a new remote state, then read it. */
+static void deliver( CommandTransport &client, CommandTransport &server,
+                     Term::CommandStream &commands, size_t &read_allocations )
+{
+  Select &sel = Select::get_instance();
+  uint64_t last_remote_num = server.get_remote_state_num();
+
+  while ( server.get_remote_state_num() == last_remote_num ) {
+    sel.clear_fds();
+    std::vector< int > client_fds( client.fds() );
+    int server_fd = server.fds().back();
+    sel.add_fd( client_fds.back() );
+    sel.add_fd( server_fd );
+
+    int timeout = std::min( client.wait_time(), server.wait_time() );
+    fatal_assert( sel.select( timeout ) >= 0 );
+
+    if ( sel.read( server_fd ) ) {
+      server.recv();
+    }
+    if ( sel.read( client_fds.back() ) ) {
+      client.recv();
+    }
+
+    server.tick();
+    client.tick();
+  }
+
+  size_t before = allocations;
+  std::string diff( server.get_remote_diff() );
+  read_allocations += allocations - before;
+
+  commands.apply_string( diff );
+}
+
+int main( int argc, char *argv[] )
+{
+  int count = argc > 1 ? atoi( argv[ 1 ] ) : 200;
+  fatal_assert( count > 0 );
+
+  /* separate blanks for each end, since copies of a stream share its
+     repeat cache */
+  Term::CommandStream blank_client, blank_server, remote_client, remote_server;
+  CommandTransport server( blank_server, remote_client, "127.0.0.1", NULL );
+  CommandTransport client( blank_client, remote_server, server.get_key().c_str(),
+                           "127.0.0.1", server.port() );
+  client.set_send_delay( 1 );
+
+  /* one command at a time, each its own state */
+  Term::CommandStream commands;
+  size_t read_allocations = 0;
+  size_t start = allocations;
+  for ( int i = 0; i < count; i++ ) {
+    client.get_current_state().push_back( Term::DataType, "DEADBEEF" );
+    deliver( client, server, commands, read_allocations );
+  }
+  size_t total = allocations - start;
+  fatal_assert( commands.get_end_num() == uint64_t( count ) );
+
+  /* nothing new */
+  start = allocations;
+  for ( int i = 0; i < IDLE_CALLS; i++ ) {
+    fatal_assert( server.get_remote_diff().empty() );
+  }
+  size_t idle_reads = allocations - start;
+
+  freeze_timestamp();
+  start = allocations;
+  for ( int i = 0; i < IDLE_CALLS; i++ ) {
+    server.wait_time();
+    server.tick();
+  }
+  size_t idle_ticks = allocations - start;
+
+  /* the client stops listening; the server piles up sent states */
+  for ( int i = 0; i < HANDOFF_STATES; i++ ) {
+    for ( int j = 0; j < count / HANDOFF_STATES; j++ ) {
+      server.get_current_state().push_back( Term::DataType, "DEADBEEF" );
+    }
+
+    struct timespec req;
+    req.tv_sec = 0;
+    req.tv_nsec = 1000000 * (SEND_INTERVAL_MIN + 10);
+    nanosleep( &req, NULL );
+    freeze_timestamp();
+    server.tick();
+  }
+
+  HandoffBuffers::Transport saved;
+  server.save( saved );
+  int fd = dup( server.fds().back() );
+  fatal_assert( fd >= 0 );
+  Connection connection( saved.connection(), fd );
+  start = allocations;
+  {
+    TransportSender<Term::CommandStream> restored( &connection, saved.sender() );
+  }
+  size_t handoff = allocations - start;
+
+  printf( "%d commands\n", count );
+  printf( "per command, end to end:     %8.2f allocations\n", double( total ) / count );
+  printf( "  of which get_remote_diff(): %7.2f\n", double( read_allocations ) / count );
+  printf( "idle get_remote_diff():      %8.2f per call\n", double( idle_reads ) / IDLE_CALLS );
+  printf( "idle wait_time() and tick(): %8.2f per call\n", double( idle_ticks ) / IDLE_CALLS );
+  printf( "restoring a sender, %d sent states: %zu allocations\n",
+          saved.sender().sent_state_size(), handoff );
+
+  return 0;
+}
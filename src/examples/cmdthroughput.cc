@@ -0,0 +1,177 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Measures bulk command throughput. First the CommandStream encoder and
+   decoder on their own, then end to end between a client and a server
+   Transport talking over loopback in this process, the way mmclient
+   and mmserver do: once with every command different, and once with
+   the same few commands over and over.
+
+   Usage: cmdthroughput [MEGABYTES [COMMAND_SIZE]] */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "commandstream.h"
+#include "fatal_assert.h"
+#include "select.h"
+#include "networktransport.cc"
+
+using namespace Network;
+
+typedef Transport<Term::CommandStream, Term::CommandStream> CommandTransport;
+
+/* keep the sender from building one enormous diff */
+static const size_t MAX_UNACKED = 256;
+
+static double now_sec( void )
+{
+  struct timespec tp;
+  clock_gettime( CLOCK_MONOTONIC, &tp );
+  return tp.tv_sec + tp.tv_nsec / 1e9;
+}
+
+/* the i-th of distinct commands, or all different if distinct is 0 */
+static std::string make_payload( size_t i, size_t command_size, size_t distinct )
+{
+  std::string payload( command_size, 'x' );
+  char id[ 32 ];
+  snprintf( id, sizeof( id ), "%zu", distinct ? i % distinct : i );
+  payload.replace( 0, std::min( strlen( id ), command_size ), id, std::min( strlen( id ), command_size ) );
+  return payload;
+}
+
+static void codec( size_t total, size_t command_size )
+{
+  const size_t count = total / command_size;
+
+  Term::CommandStream empty, sent;
+  for ( size_t i = 0; i < count; i++ ) {
+    sent.push_back( Term::DataType, make_payload( i, command_size, 0 ) );
+  }
+
+  double start = now_sec();
+  std::string diff = sent.diff_from( empty );
+  double encoded = now_sec();
+
+  Term::CommandStream received;
+  received.apply_string( diff );
+  double decoded = now_sec();
+
+  fatal_assert( received.size() == count );
+
+  printf( "codec:   encode %8.1f MB/s, decode %8.1f MB/s, %zu bytes on the wire\n",
+          total / (encoded - start) / 1e6, total / (decoded - encoded) / 1e6,
+          diff.size() );
+}
+
+static void transport( size_t total, size_t command_size, size_t distinct )
+{
+  /* separate blanks for each end, since copies of a stream share its
+     repeat cache */
+  Term::CommandStream blank_client, blank_server, remote_client, remote_server;
+  CommandTransport server( blank_server, remote_client, "127.0.0.1", NULL );
+  CommandTransport client( blank_client, remote_server, server.get_key().c_str(),
+                           "127.0.0.1", server.port() );
+  client.set_send_delay( 1 );
+
+  size_t pushed = 0, received = 0, count = 0;
+  uint64_t last_remote_num = server.get_remote_state_num();
+  Select &sel = Select::get_instance();
+
+  double start = now_sec();
+  while ( received < total ) {
+    Term::CommandStream &outgoing = client.get_current_state();
+    while ( pushed < total && outgoing.size() < MAX_UNACKED ) {
+      outgoing.push_back( Term::DataType, make_payload( count++, command_size, distinct ) );
+      pushed += command_size;
+    }
+
+    sel.clear_fds();
+    std::vector< int > client_fds( client.fds() );
+    int server_fd = server.fds().back();
+    sel.add_fd( client_fds.back() );
+    sel.add_fd( server_fd );
+
+    int timeout = std::min( client.wait_time(), server.wait_time() );
+    fatal_assert( sel.select( timeout ) >= 0 );
+
+    if ( sel.read( server_fd ) ) {
+      server.recv();
+      if ( server.get_remote_state_num() != last_remote_num ) {
+        last_remote_num = server.get_remote_state_num();
+        Term::CommandStream commands;
+        commands.apply_string( server.get_remote_diff() );
+        for ( size_t i = 0; i < commands.size(); i++ ) {
+          received += commands.get_action( i )->size();
+        }
+      }
+    }
+    if ( sel.read( client_fds.back() ) ) {
+      client.recv();
+    }
+
+    server.tick();
+    client.tick();
+  }
+  double elapsed = now_sec() - start;
+
+  printf( "network: %8.1f MB/s, %8.0f commands/s", total / elapsed / 1e6, total / command_size / elapsed );
+  if ( distinct ) {
+    const Term::RepeatCache::Stats &stats = server.get_latest_remote_state().state->get_repeat_stats();
+    printf( " (%zu distinct: %.1f%% sent as repeats, %.1f MB saved)",
+            distinct, stats.lookups ? 100.0 * stats.hits / stats.lookups : 0.0,
+            stats.bytes_saved / 1e6 );
+  }
+  printf( "\n" );
+}
+
+int main( int argc, char *argv[] )
+{
+  size_t megabytes = argc > 1 ? atoi( argv[ 1 ] ) : 16;
+  size_t command_size = argc > 2 ? atoi( argv[ 2 ] ) : 1024;
+  fatal_assert( megabytes > 0 && command_size > 0 );
+
+  size_t total = megabytes * 1000 * 1000;
+
+  printf( "%zu MB in %zu-byte commands\n", megabytes, command_size );
+
+  codec( total, command_size );
+  transport( total, command_size, 0 );
+  transport( total, command_size, 16 );
+
+  return 0;
+}
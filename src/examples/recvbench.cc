@@ -0,0 +1,194 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Measures how fast a server Connection takes in bursts of datagrams
+   over loopback, read two ways: as the frontends used to, waking once
+   per datagram and reading it with recvmsg(), and as they do now,
+   waking once and taking every datagram waiting with recv(), which
+   reads them RECV_BATCH at a time with recvmmsg(). Only the receiving
+   side is timed, including decryption, which is also timed alone.
+
+   Usage: recvbench [DATAGRAMS [BURST [SIZE]]] */
+
+#include "config.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <vector>
+
+#include "network.h"
+#include "fatal_assert.h"
+
+using namespace Network;
+
+static double now_sec( void )
+{
+  struct timespec tp;
+  clock_gettime( CLOCK_MONOTONIC, &tp );
+  return tp.tv_sec + tp.tv_nsec / 1e9;
+}
+
+/* false if nothing came for a while, as when a burst overflowed the
+   socket's buffer */
+static bool wait_readable( int fd )
+{
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  int ready = poll( &pfd, 1, 1000 );
+  fatal_assert( ready >= 0 );
+  return ready == 1;
+}
+
+/* one datagram the old way, with its address and ECN mark */
+static Datagram recv_one( int fd )
+{
+  Datagram datagram;
+  char payload[ Session::RECEIVE_MTU ];
+  char control[ 64 ];
+
+  struct iovec iov;
+  iov.iov_base = payload;
+  iov.iov_len = sizeof( payload );
+
+  struct msghdr header;
+  memset( &header, 0, sizeof( header ) );
+  header.msg_name = &datagram.from;
+  header.msg_namelen = sizeof( datagram.from );
+  header.msg_iov = &iov;
+  header.msg_iovlen = 1;
+  header.msg_control = control;
+  header.msg_controllen = sizeof( control );
+
+  ssize_t len = recvmsg( fd, &header, 0 );
+  fatal_assert( len >= 0 );
+
+  struct cmsghdr *ecn_hdr = CMSG_FIRSTHDR( &header );
+  if ( ecn_hdr && ecn_hdr->cmsg_level == IPPROTO_IP && ecn_hdr->cmsg_type == IP_TOS ) {
+    datagram.congestion_experienced = (*(uint8_t *)CMSG_DATA( ecn_hdr ) & 0x03) == 0x03;
+  }
+  datagram.payload.assign( payload, len );
+  return datagram;
+}
+
+enum Mode { ONE_PER_WAKEUP, BATCHED, DECRYPT_ONLY };
+
+class Result {
+public:
+  double seconds;
+  size_t received;
+  size_t wakeups;
+
+  Result() : seconds( 0 ), received( 0 ), wakeups( 0 ) {}
+};
+
+/* Send datagrams in bursts of burst, and time taking each burst in. */
+static Result run( Mode mode, size_t datagrams, size_t burst, size_t size )
+{
+  Connection server( "127.0.0.1", NULL );
+  Connection client( server.get_key().c_str(), "127.0.0.1", server.port() );
+  const int fd = server.fds().front();
+  const std::string payload( size, 'x' );
+
+  /* room for the largest burst */
+  int buffer = 4 * 1024 * 1024;
+  setsockopt( fd, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof( buffer ) );
+
+  Result result;
+  for ( size_t sent = 0; sent < datagrams; sent += burst ) {
+    for ( size_t i = 0; i < burst; i++ ) {
+      client.send( payload );
+    }
+
+    std::vector< Datagram > read;
+    if ( mode == DECRYPT_ONLY ) {
+      for ( size_t i = 0; i < burst && wait_readable( fd ); i++ ) {
+        read.push_back( recv_one( fd ) );
+      }
+    }
+
+    const double start = now_sec();
+    size_t received = 0;
+    if ( mode == DECRYPT_ONLY ) {
+      for ( size_t i = 0; i < read.size(); i++ ) {
+        fatal_assert( server.recv( read[ i ] ).size() == size );
+        received++;
+      }
+    }
+    while ( mode != DECRYPT_ONLY && received < burst && wait_readable( fd ) ) {
+      result.wakeups++;
+      if ( mode == BATCHED ) {
+        do {
+          fatal_assert( server.recv().size() == size );
+          received++;
+        } while ( server.pending() );
+      } else {
+        fatal_assert( server.recv( recv_one( fd ) ).size() == size );
+        received++;
+      }
+    }
+    result.seconds += now_sec() - start;
+    result.received += received;
+  }
+  return result;
+}
+
+static void report( const char *what, const Result &result )
+{
+  printf( "%-30s %9.0f datagrams/s  %6.2f us/datagram", what,
+          result.received / result.seconds, 1e6 * result.seconds / result.received );
+  if ( result.wakeups ) {
+    printf( "  %6.2f datagrams/wakeup", double( result.received ) / result.wakeups );
+  }
+  printf( "\n" );
+}
+
+int main( int argc, char *argv[] )
+{
+  size_t burst = argc > 2 ? atoi( argv[ 2 ] ) : 32;
+  size_t datagrams = argc > 1 ? atoi( argv[ 1 ] ) : 200000;
+  size_t size = argc > 3 ? atoi( argv[ 3 ] ) : 1000;
+  fatal_assert( burst > 0 && size > 0 );
+  datagrams -= datagrams % burst;
+
+  printf( "%zu datagrams of %zu bytes in bursts of %zu, batches of up to %d\n\n",
+          datagrams, size, burst, Connection::RECV_BATCH );
+
+  report( "one recvmsg() per wakeup:", run( ONE_PER_WAKEUP, datagrams, burst, size ) );
+  report( "all waiting, by recvmmsg():", run( BATCHED, datagrams, burst, size ) );
+  report( "decryption alone:", run( DECRYPT_ONLY, datagrams, burst, size ) );
+
+  return 0;
+}
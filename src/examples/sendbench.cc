@@ -0,0 +1,132 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Measures how fast a Connection sends the fragments of an instruction
+   over loopback, two ways: as TransportSender used to, one send() and
+   so one sendto() per fragment, and as it does now, all of them
+   encrypted into one set of buffers and handed to send() at once,
+   which flushes them with one sendmmsg(). Only the sending side is
+   timed; what arrives is thrown away between instructions.
+
+   Usage: sendbench [INSTRUCTIONS [FRAGMENTS [SIZE]]] */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <vector>
+
+#include "network.h"
+#include "fatal_assert.h"
+
+using namespace Network;
+
+static double now_sec( void )
+{
+  struct timespec tp;
+  clock_gettime( CLOCK_MONOTONIC, &tp );
+  return tp.tv_sec + tp.tv_nsec / 1e9;
+}
+
+/* throw away whatever has arrived, and say how much it was */
+static size_t drain( int fd )
+{
+  char buffer[ Session::RECEIVE_MTU ];
+  size_t count = 0;
+  while ( recv( fd, buffer, sizeof( buffer ), MSG_DONTWAIT ) >= 0 ) {
+    count++;
+  }
+  return count;
+}
+
+class Result {
+public:
+  double seconds;
+  size_t sent;
+  size_t arrived;
+
+  Result() : seconds( 0 ), sent( 0 ), arrived( 0 ) {}
+};
+
+static Result run( bool batched, size_t instructions, size_t fragments, size_t size )
+{
+  Connection server( "127.0.0.1", NULL );
+  Connection client( server.get_key().c_str(), "127.0.0.1", server.port() );
+  const int fd = server.fds().front();
+  const std::vector< std::string > payloads( fragments, std::string( size, 'x' ) );
+
+  /* room for a whole instruction */
+  int buffer = 4 * 1024 * 1024;
+  setsockopt( fd, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof( buffer ) );
+
+  Result result;
+  for ( size_t i = 0; i < instructions; i++ ) {
+    const double start = now_sec();
+    if ( batched ) {
+      client.send( payloads );
+    } else {
+      for ( size_t j = 0; j < fragments; j++ ) {
+        client.send( payloads[ j ] );
+      }
+    }
+    result.seconds += now_sec() - start;
+    fatal_assert( client.get_send_exception() == NULL );
+    result.sent += fragments;
+    result.arrived += drain( fd );
+  }
+  return result;
+}
+
+static void report( const char *what, const Result &result )
+{
+  printf( "%-30s %9.0f datagrams/s  %6.2f us/datagram  (%zu of %zu arrived)\n", what,
+          result.sent / result.seconds, 1e6 * result.seconds / result.sent,
+          result.arrived, result.sent );
+}
+
+int main( int argc, char *argv[] )
+{
+  size_t instructions = argc > 1 ? atoi( argv[ 1 ] ) : 20000;
+  size_t fragments = argc > 2 ? atoi( argv[ 2 ] ) : 8;
+  size_t size = argc > 3 ? atoi( argv[ 3 ] ) : 1000;
+  fatal_assert( fragments > 0 && size > 0 );
+
+  printf( "%zu instructions of %zu fragments of %zu bytes, batches of up to %d\n\n",
+          instructions, fragments, size, Connection::SEND_BATCH );
+
+  report( "one sendto() per fragment:", run( false, instructions, fragments, size ) );
+  report( "all at once, by sendmmsg():", run( true, instructions, fragments, size ) );
+
+  return 0;
+}
@@ -0,0 +1,388 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+
+/* Measures what each session costs a multi-session mmserver. A child
+   process hosts SESSIONS sessions in one SessionHost, and this process
+   connects a client to each over loopback. Each client has COMMANDS
+   small commands echoed back, and then all of them sit idle for a few
+   seconds. The child's resident memory and CPU time are read from
+   /proc before the sessions exist, once they exist, after the
+   commands, and after the idle time. Then every client sends one
+   more command, and the time until its result comes back is the
+   latency of waking a session. With -u the sessions share one port
+   instead of having a socket each, with -t they are served on THREADS
+   threads, and with -H they hibernate after MS ms idle.
+
+   Usage: sessionbench [-u] [-t THREADS] [-H MS] [SESSIONS [COMMANDS]] */
+
+#include "config.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <limits.h>
+#include <vector>
+
+#include "commandstream.h"
+#include "terminalresults.h"
+#include "eventloop.h"
+#include "fatal_assert.h"
+#include "mmsession.h"
+#include "shardedhost.h"
+#include "networktransport.cc"
+
+using namespace Network;
+
+typedef Transport<Term::CommandStream, Term::TerminalResults> ClientTransport;
+
+static const int IDLE_SECONDS = 5;
+static const size_t COMMAND_SIZE = 100;
+
+static double now_sec( void )
+{
+  struct timespec tp;
+  clock_gettime( CLOCK_MONOTONIC, &tp );
+  return tp.tv_sec + tp.tv_nsec / 1e9;
+}
+
+/* resident set size of pid in kB, or -1 */
+static long resident_kb( pid_t pid )
+{
+  char path[ 64 ];
+  snprintf( path, sizeof( path ), "/proc/%d/statm", int( pid ) );
+  FILE *statm = fopen( path, "r" );
+  if ( !statm ) {
+    return -1;
+  }
+  long size, resident;
+  int fields = fscanf( statm, "%ld %ld", &size, &resident );
+  fclose( statm );
+  return fields == 2 ? resident * (sysconf( _SC_PAGESIZE ) / 1024) : -1;
+}
+
+/* user and system CPU time of pid in seconds, or -1 */
+static double cpu_seconds( pid_t pid )
+{
+  char path[ 64 ];
+  snprintf( path, sizeof( path ), "/proc/%d/stat", int( pid ) );
+  FILE *stat = fopen( path, "r" );
+  if ( !stat ) {
+    return -1;
+  }
+  char buf[ 1024 ];
+  size_t len = fread( buf, 1, sizeof( buf ) - 1, stat );
+  fclose( stat );
+  buf[ len ] = '\0';
+
+  /* skip pid and (comm), which may contain spaces */
+  const char *fields = strrchr( buf, ')' );
+  unsigned long utime, stime;
+  if ( !fields || sscanf( fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                          &utime, &stime ) != 2 ) {
+    return -1;
+  }
+  return double( utime + stime ) / sysconf( _SC_CLK_TCK );
+}
+
+/* number of open file descriptors of pid */
+static int open_fds( pid_t pid )
+{
+  char path[ 64 ];
+  snprintf( path, sizeof( path ), "/proc/%d/fd", int( pid ) );
+  DIR *dir = opendir( path );
+  if ( !dir ) {
+    return -1;
+  }
+  int count = 0;
+  struct dirent *entry;
+  while ( (entry = readdir( dir )) != NULL ) {
+    if ( entry->d_name[ 0 ] != '.' ) {
+      count++;
+    }
+  }
+  closedir( dir );
+  return count;
+}
+
+/* Host the sessions, telling the parent where they are on out. */
+template <class Host>
+static void host( Host &sessionhost, int sessions, bool share_port, int hibernate_after, FILE *out )
+{
+  if ( hibernate_after >= 0 ) {
+    sessionhost.set_hibernate_after( hibernate_after );
+  }
+  if ( share_port ) {
+    sessionhost.share_port( "127.0.0.1", "20000:59999" );
+  }
+
+  fprintf( out, "ready\n" );
+  fflush( out );
+  /* the parent measures us while we wait */
+  char go;
+  fatal_assert( fread( &go, 1, 1, stdin ) == 1 );
+
+  for ( int i = 0; i < sessions; i++ ) {
+    MMSession *session = sessionhost.add_session( "127.0.0.1", "20000:59999" );
+    fprintf( out, "%d %s %llx\n", session->get_network().port(),
+             session->get_network().get_key().c_str(),
+             share_port ? (unsigned long long)session->get_id() : 0ULL );
+  }
+  fclose( out );
+
+  sessionhost.run();
+}
+
+class Measurement {
+public:
+  long rss_kb;
+  double cpu;
+  double when;
+
+  Measurement( pid_t pid ) : rss_kb( resident_kb( pid ) ), cpu( cpu_seconds( pid ) ), when( now_sec() ) {}
+};
+
+/* Run the clients until done() or the deadline, counting each one's
+   finished commands and noting when the last of them came back. */
+template <class Done>
+static void serve_clients( std::vector< ClientTransport * > &clients,
+                           std::vector< size_t > &finished, std::vector< double > &finished_at,
+                           double deadline, Done done )
+{
+  EventLoop loop;
+  std::vector< uint64_t > last_remote_num( clients.size() );
+  for ( size_t i = 0; i < clients.size(); i++ ) {
+    last_remote_num[ i ] = clients[ i ]->get_remote_state_num();
+  }
+
+  while ( now_sec() < deadline && !done() ) {
+    std::map< int, size_t > by_fd;
+    int timeout = INT_MAX;
+    for ( size_t i = 0; i < clients.size(); i++ ) {
+      std::vector< int > fds( clients[ i ]->fds() );
+      for ( std::vector< int >::const_iterator fd = fds.begin(); fd != fds.end(); fd++ ) {
+        loop.add_fd( *fd );
+        by_fd[ *fd ] = i;
+      }
+      timeout = std::min( timeout, clients[ i ]->wait_time() );
+    }
+
+    fatal_assert( loop.wait( std::min( timeout, 100 ) ) >= 0 );
+
+    std::vector< int > active( loop.active() );
+    for ( std::vector< int >::const_iterator fd = active.begin(); fd != active.end(); fd++ ) {
+      size_t i = by_fd[ *fd ];
+      clients[ i ]->recv();
+      if ( clients[ i ]->get_remote_state_num() != last_remote_num[ i ] ) {
+        last_remote_num[ i ] = clients[ i ]->get_remote_state_num();
+        Term::TerminalResults results;
+        results.apply_string( clients[ i ]->get_remote_diff() );
+        for ( size_t e = 0; e < results.size(); e++ ) {
+          if ( results.get_event( e )->finished ) {
+            finished[ i ]++;
+            finished_at[ i ] = now_sec();
+          }
+        }
+      }
+    }
+
+    for ( size_t i = 0; i < clients.size(); i++ ) {
+      clients[ i ]->tick();
+    }
+  }
+}
+
+class AllFinished {
+  const std::vector< size_t > &finished;
+  size_t target;
+
+public:
+  AllFinished( const std::vector< size_t > &s_finished, size_t s_target )
+    : finished( s_finished ), target( s_target ) {}
+
+  bool operator()( void ) const {
+    for ( size_t i = 0; i < finished.size(); i++ ) {
+      if ( finished[ i ] < target ) {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+class Never {
+public:
+  bool operator()( void ) const { return false; }
+};
+
+static void print_step( const char *what, const Measurement &from, const Measurement &to, int sessions )
+{
+  double cpu_ms = 1000 * (to.cpu - from.cpu);
+  printf( "%-28s %+9ld kB (%8.1f kB/session)  %9.1f ms CPU (%8.3f ms/session)\n",
+          what, to.rss_kb - from.rss_kb, double( to.rss_kb - from.rss_kb ) / sessions,
+          cpu_ms, cpu_ms / sessions );
+}
+
+int main( int argc, char *argv[] )
+{
+  bool share_port = false;
+  int threads = 1;
+  int hibernate_after = -1;
+  int opt;
+  while ( (opt = getopt( argc, argv, "ut:H:" )) != -1 ) {
+    switch ( opt ) {
+    case 'u':
+      share_port = true;
+      break;
+    case 't':
+      threads = atoi( optarg );
+      break;
+    case 'H':
+      hibernate_after = atoi( optarg );
+      break;
+    default:
+      fprintf( stderr, "Usage: %s [-u] [-t THREADS] [-H MS] [SESSIONS [COMMANDS]]\n", argv[ 0 ] );
+      return 1;
+    }
+  }
+  int sessions = argc > optind ? atoi( argv[ optind ] ) : 100;
+  size_t commands = argc > optind + 1 ? atoi( argv[ optind + 1 ] ) : 10;
+  fatal_assert( sessions > 0 && threads > 0 );
+
+  int to_child[ 2 ], from_child[ 2 ];
+  fatal_assert( pipe( to_child ) == 0 && pipe( from_child ) == 0 );
+
+  pid_t child = fork();
+  fatal_assert( child >= 0 );
+  if ( child == 0 ) {
+    dup2( to_child[ 0 ], STDIN_FILENO );
+    close( to_child[ 1 ] );
+    close( from_child[ 0 ] );
+    /* the sessions' chatter would drown out our results */
+    fatal_assert( freopen( "/dev/null", "w", stderr ) );
+    FILE *out = fdopen( from_child[ 1 ], "w" );
+    if ( threads > 1 ) {
+      ShardedHost sessionhost( threads, threads );
+      host( sessionhost, sessions, share_port, hibernate_after, out );
+    } else {
+      SessionHost sessionhost( 1 );
+      host( sessionhost, sessions, share_port, hibernate_after, out );
+    }
+    _exit( 0 );
+  }
+  close( to_child[ 0 ] );
+  close( from_child[ 1 ] );
+  FILE *in = fdopen( from_child[ 0 ], "r" );
+
+  char line[ 256 ];
+  fatal_assert( fgets( line, sizeof( line ), in ) && strcmp( line, "ready\n" ) == 0 );
+  Measurement empty( child );
+
+  fatal_assert( write( to_child[ 1 ], "g", 1 ) == 1 );
+  std::vector< ClientTransport * > clients;
+  Term::CommandStream blank_stream;
+  Term::TerminalResults blank_results;
+  int port;
+  char key[ 64 ];
+  unsigned long long id;
+  while ( fgets( line, sizeof( line ), in ) && sscanf( line, "%d %63s %llx", &port, key, &id ) == 3 ) {
+    Term::CommandStream stream( blank_stream );
+    Term::TerminalResults results( blank_results );
+    clients.push_back( new ClientTransport( stream, results, key, "127.0.0.1", port, id ) );
+  }
+  fclose( in );
+  fatal_assert( clients.size() == size_t( sessions ) );
+  Measurement created( child );
+
+  printf( "%d sessions in one server process (%s, %s, %d %s), %zu commands each",
+          sessions, EventLoop().backend(), share_port ? "one shared port" : "a port each",
+          threads, threads == 1 ? "thread" : "threads", commands );
+  if ( hibernate_after >= 0 ) {
+    printf( ", hibernating after %d ms", hibernate_after );
+  }
+  printf( "\n\n" );
+  printf( "server file descriptors:     %9d\n", open_fds( child ) );
+  printf( "server before any session:   %9ld kB, %9.1f ms CPU\n", empty.rss_kb, 1000 * empty.cpu );
+  print_step( "creating the sessions:", empty, created, sessions );
+
+  /* every client has its commands echoed */
+  for ( size_t i = 0; i < clients.size(); i++ ) {
+    for ( size_t c = 0; c < commands; c++ ) {
+      clients[ i ]->get_current_state().push_back( Term::DataType, std::string( COMMAND_SIZE, 'x' ) );
+    }
+  }
+  std::vector< size_t > finished( clients.size(), 0 );
+  std::vector< double > finished_at( clients.size(), 0 );
+  serve_clients( clients, finished, finished_at, now_sec() + 60, AllFinished( finished, commands ) );
+  Measurement active( child );
+  fatal_assert( AllFinished( finished, commands )() );
+  print_step( "connecting and echoing:", created, active, sessions );
+  printf( "%-28s %9.1f ms\n", "  wall time:", 1000 * (active.when - created.when) );
+
+  /* heartbeats only */
+  serve_clients( clients, finished, finished_at, now_sec() + IDLE_SECONDS, Never() );
+  Measurement idle( child );
+  print_step( "idle:", active, idle, sessions );
+  printf( "%-28s %9.3f %% of a CPU per 1000 sessions\n", "  idle load:",
+          100 * (idle.cpu - active.cpu) / (idle.when - active.when) * 1000 / sessions );
+
+  /* one more command each, after the idle time */
+  for ( size_t i = 0; i < clients.size(); i++ ) {
+    clients[ i ]->get_current_state().push_back( Term::DataType, std::string( COMMAND_SIZE, 'y' ) );
+  }
+  const double woken = now_sec();
+  serve_clients( clients, finished, finished_at, woken + 60, AllFinished( finished, commands + 1 ) );
+  Measurement awake( child );
+  fatal_assert( AllFinished( finished, commands + 1 )() );
+  print_step( "one command after idling:", idle, awake, sessions );
+  double total = 0, slowest = 0;
+  for ( size_t i = 0; i < clients.size(); i++ ) {
+    total += finished_at[ i ] - woken;
+    slowest = std::max( slowest, finished_at[ i ] - woken );
+  }
+  printf( "%-28s %9.1f ms mean, %.1f ms max\n", "  latency:",
+          1000 * total / clients.size(), 1000 * slowest );
+
+  kill( child, SIGKILL );
+  waitpid( child, NULL, 0 );
+  for ( size_t i = 0; i < clients.size(); i++ ) {
+    delete clients[ i ];
+  }
+
+  return 0;
+}
@@ -0,0 +1,304 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Measures how long a new session takes to start: from running the
+   server, as ssh would, until it says where the session is, and until
+   the first state comes back to a client that connects there and
+   sends a command. Each session starts cold, with the server doing
+   everything from scratch, and then warm, taken from a pool of spare
+   servers made ahead of time (mosh-server pool), taking turns so that
+   both see the machine alike. Sessions start one at a time, with a
+   pause between them for the pool to refill. With -b,
+   BUSY ports at the bottom of the server's range are taken first, as
+   on a host that already has as many sessions, so that each server
+   has to search past them for a free one.
+
+   Usage: startupbench [-n RUNS] [-w SPARES] [-b BUSY] [MOSH_SERVER] */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "commandstream.h"
+#include "terminalresults.h"
+#include "eventloop.h"
+#include "fatal_assert.h"
+#include "networktransport.cc"
+
+using namespace Network;
+
+typedef Transport<Term::CommandStream, Term::TerminalResults> ClientTransport;
+
+/* between sessions, as between logins */
+static const int PAUSE_MS = 100;
+/* where a server looks for a port, as in Connection */
+static const int FIRST_PORT = 60001;
+
+static double now_sec( void )
+{
+  struct timespec tp;
+  clock_gettime( CLOCK_MONOTONIC, &tp );
+  return tp.tv_sec + tp.tv_nsec / 1e9;
+}
+
+/* Run server with args, its stdout on out and its chatter discarded. */
+static pid_t start( const char *server, const std::vector< std::string > &args, FILE **out )
+{
+  int pipe_fds[ 2 ];
+  fatal_assert( pipe( pipe_fds ) == 0 );
+
+  pid_t child = fork();
+  fatal_assert( child >= 0 );
+  if ( child == 0 ) {
+    close( pipe_fds[ 0 ] );
+    dup2( pipe_fds[ 1 ], STDOUT_FILENO );
+    int null_fd = open( "/dev/null", O_WRONLY );
+    dup2( null_fd, STDERR_FILENO );
+
+    std::vector< char * > argv;
+    argv.push_back( const_cast< char * >( server ) );
+    for ( size_t i = 0; i < args.size(); i++ ) {
+      argv.push_back( const_cast< char * >( args[ i ].c_str() ) );
+    }
+    argv.push_back( NULL );
+    execv( server, &argv[ 0 ] );
+    _exit( 127 );
+  }
+
+  close( pipe_fds[ 1 ] );
+  if ( out ) {
+    *out = fdopen( pipe_fds[ 0 ], "r" );
+  } else {
+    close( pipe_fds[ 0 ] );
+  }
+  return child;
+}
+
+/* Tick the client until done() or the deadline. */
+template <class Done>
+static bool serve_client( ClientTransport &client, double deadline, Done done )
+{
+  EventLoop loop;
+  std::vector< int > fds( client.fds() );
+  for ( std::vector< int >::const_iterator fd = fds.begin(); fd != fds.end(); fd++ ) {
+    loop.add_fd( *fd );
+  }
+
+  while ( !done( client ) ) {
+    if ( now_sec() >= deadline ) {
+      return false;
+    }
+    fatal_assert( loop.wait( std::min( client.wait_time(), 100 ) ) >= 0 );
+    if ( !loop.active().empty() ) {
+      client.recv();
+    }
+    client.tick();
+  }
+  return true;
+}
+
+/* Take the first busy ports a server would look at. */
+static std::vector< int > occupy( int busy )
+{
+  std::vector< int > socks;
+  for ( int port = FIRST_PORT; int( socks.size() ) < busy && port < 65536; port++ ) {
+    int sock = socket( AF_INET, SOCK_DGRAM, 0 );
+    fatal_assert( sock >= 0 );
+    struct sockaddr_in addr;
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr( "127.0.0.1" );
+    addr.sin_port = htons( port );
+    if ( bind( sock, (const sockaddr *)&addr, sizeof( addr ) ) == 0 ) {
+      socks.push_back( sock );
+    } else {
+      close( sock );
+    }
+  }
+  return socks;
+}
+
+static bool has_state( const ClientTransport &client ) { return client.get_remote_state_num() > 0; }
+static bool shut_down( const ClientTransport &client ) { return client.shutdown_acknowledged(); }
+
+class Startup {
+public:
+  double connect_ms;
+  double frame_ms;
+
+  Startup() : connect_ms( 0 ), frame_ms( 0 ) {}
+};
+
+/* Start one session, from scratch or from the pool at pool_path, and
+   end it again. */
+static Startup start_session( const char *server, const char *pool_path )
+{
+  std::vector< std::string > args;
+  args.push_back( "new" );
+  args.push_back( "-i" );
+  args.push_back( "127.0.0.1" );
+  if ( pool_path ) {
+    args.push_back( "-P" );
+    args.push_back( pool_path );
+  }
+
+  Startup result;
+  const double began = now_sec();
+  FILE *out;
+  pid_t child = start( server, args, &out );
+
+  char line[ 256 ];
+  int port = 0;
+  char key[ 64 ];
+  while ( fgets( line, sizeof( line ), out ) ) {
+    if ( sscanf( line, "MOSH CONNECT %d %63s", &port, key ) == 2 ) {
+      break;
+    }
+  }
+  fatal_assert( port > 0 );
+  result.connect_ms = 1000 * (now_sec() - began);
+
+  Term::CommandStream stream;
+  Term::TerminalResults results;
+  ClientTransport client( stream, results, key, "127.0.0.1", port );
+  client.get_current_state().push_back( Term::DataType, "x" );
+  fatal_assert( serve_client( client, now_sec() + 10, has_state ) );
+  result.frame_ms = 1000 * (now_sec() - began);
+
+  client.start_shutdown();
+  serve_client( client, now_sec() + 2, shut_down );
+  fclose( out );
+  waitpid( child, NULL, 0 );
+  return result;
+}
+
+static void report( const char *what, std::vector< Startup > &runs )
+{
+  std::vector< double > connect, frame;
+  for ( size_t i = 0; i < runs.size(); i++ ) {
+    connect.push_back( runs[ i ].connect_ms );
+    frame.push_back( runs[ i ].frame_ms );
+  }
+  std::sort( connect.begin(), connect.end() );
+  std::sort( frame.begin(), frame.end() );
+
+  printf( "%-6s to MOSH CONNECT: %7.2f ms median, %7.2f ms max\n",
+          what, connect[ connect.size() / 2 ], connect.back() );
+  printf( "%-6s to first state:  %7.2f ms median, %7.2f ms max\n",
+          "", frame[ frame.size() / 2 ], frame.back() );
+}
+
+int main( int argc, char *argv[] )
+{
+  int runs = 20;
+  int spares = 4;
+  int busy = 0;
+  int opt;
+  while ( (opt = getopt( argc, argv, "n:w:b:" )) != -1 ) {
+    switch ( opt ) {
+    case 'n':
+      runs = atoi( optarg );
+      break;
+    case 'w':
+      spares = atoi( optarg );
+      break;
+    case 'b':
+      busy = atoi( optarg );
+      break;
+    default:
+      fprintf( stderr, "Usage: %s [-n RUNS] [-w SPARES] [-b BUSY] [MOSH_SERVER]\n", argv[ 0 ] );
+      return 1;
+    }
+  }
+  const char *server = argc > optind ? argv[ optind ] : "../frontend/mosh-server";
+  fatal_assert( runs > 0 && spares > 0 && busy >= 0 );
+  if ( access( server, X_OK ) < 0 ) {
+    perror( server );
+    return 1;
+  }
+
+  std::vector< int > busy_socks( occupy( busy ) );
+
+  char pool_path[ 64 ];
+  snprintf( pool_path, sizeof( pool_path ), "/tmp/startupbench.%d.sock", int( getpid() ) );
+  std::vector< std::string > args;
+  args.push_back( "pool" );
+  args.push_back( "-P" );
+  args.push_back( pool_path );
+  args.push_back( "-i" );
+  args.push_back( "127.0.0.1" );
+  args.push_back( "-w" );
+  char spares_arg[ 16 ];
+  snprintf( spares_arg, sizeof( spares_arg ), "%d", spares );
+  args.push_back( spares_arg );
+  pid_t pool = start( server, args, NULL );
+
+  /* for the pool to listen, and its spares to get ready */
+  struct stat buf;
+  for ( int i = 0; i < 100 && stat( pool_path, &buf ) < 0; i++ ) {
+    usleep( 10000 );
+  }
+  usleep( 500000 );
+
+  std::vector< Startup > cold, warm;
+  for ( int i = 0; i < runs; i++ ) {
+    cold.push_back( start_session( server, NULL ) );
+    usleep( PAUSE_MS * 1000 );
+    warm.push_back( start_session( server, pool_path ) );
+    usleep( PAUSE_MS * 1000 );
+  }
+
+  kill( pool, SIGTERM );
+  waitpid( pool, NULL, 0 );
+
+  printf( "%d sessions each, one at a time, %d ms apart; the pool keeps %d spares; %d ports busy\n\n",
+          runs, PAUSE_MS, spares, int( busy_socks.size() ) );
+  report( "cold:", cold );
+  report( "warm:", warm );
+
+  return 0;
+}
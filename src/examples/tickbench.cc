@@ -0,0 +1,139 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Measures the cost of TransportSender::wait_time() and tick() with a
+   growing backlog of unacknowledged commands. The receiver is a bound
+   socket that never reads, so nothing is ever acknowledged. Cost per
+   call should stay flat as the backlog grows. */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "commandstream.h"
+#include "fatal_assert.h"
+#include "timestamp.h"
+#include "networktransport.cc"
+
+using namespace Network;
+
+typedef Transport<Term::CommandStream, Term::CommandStream> CommandTransport;
+
+static const int BATCHES = 16; /* sent states to build the backlog over */
+static const int CALLS = 20000;
+
+static double now_usec( void )
+{
+  struct timespec tp;
+  clock_gettime( CLOCK_MONOTONIC, &tp );
+  return tp.tv_sec * 1e6 + tp.tv_nsec / 1e3;
+}
+
+static int bind_sink( void )
+{
+  int fd = socket( AF_INET, SOCK_DGRAM, 0 );
+  if ( fd < 0 ) {
+    perror( "socket" );
+    exit( 1 );
+  }
+
+  struct sockaddr_in addr;
+  addr.sin_family = AF_INET;
+  addr.sin_port = 0;
+  addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+  socklen_t len = sizeof( addr );
+  if ( bind( fd, (sockaddr *)&addr, len ) < 0
+       || getsockname( fd, (sockaddr *)&addr, &len ) < 0 ) {
+    perror( "bind" );
+    exit( 1 );
+  }
+
+  return fd;
+}
+
+static void run( const char *key, int port, int backlog )
+{
+  Term::CommandStream blank_stream, blank_remote;
+  CommandTransport network( blank_stream, blank_remote, key, "127.0.0.1", port );
+
+  /* build up the backlog over several sent states; the last pass
+     sends everything, so current_state equals the last sent state */
+  for ( int batch = 0; batch <= BATCHES; batch++ ) {
+    for ( int i = 0; batch < BATCHES && i < backlog / BATCHES; i++ ) {
+      network.get_current_state().push_back( std::string( "DEADBEEF" ) );
+    }
+
+    struct timespec req;
+    req.tv_sec = 0;
+    req.tv_nsec = 1000000 * (SEND_INTERVAL_MAX + 10);
+    nanosleep( &req, NULL );
+    freeze_timestamp();
+    network.tick();
+  }
+
+  double start = now_usec();
+  for ( int i = 0; i < CALLS; i++ ) {
+    network.wait_time();
+    network.tick();
+  }
+  double elapsed = now_usec() - start;
+
+  printf( "%10d %10d %12.3f\n", backlog, (int)network.get_sent_state_last(),
+          elapsed / CALLS );
+}
+
+int main( void )
+{
+  int sink = bind_sink();
+  struct sockaddr_in addr;
+  socklen_t len = sizeof( addr );
+  fatal_assert( getsockname( sink, (sockaddr *)&addr, &len ) == 0 );
+
+  Base64Key key;
+
+  printf( "%10s %10s %12s\n", "backlog", "states", "usec/tick" );
+
+  const int backlogs[] = { 1000, 4000, 16000, 32000, 64000 };
+  for ( size_t i = 0; i < sizeof( backlogs ) / sizeof( backlogs[ 0 ] ); i++ ) {
+    run( key.printable_key().c_str(), ntohs( addr.sin_port ), backlogs[ i ] );
+  }
+
+  close( sink );
+
+  return 0;
+}
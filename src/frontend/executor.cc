@@ -0,0 +1,390 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+
+#ifdef HAVE_PATHS_H
+#include <paths.h>
+#endif
+
+#include "executor.h"
+#include "fatal_assert.h"
+
+#ifndef _PATH_BSHELL
+#define _PATH_BSHELL "/bin/sh"
+#endif
+
+static const size_t READ_SIZE = 65536;
+
+/* Held from creating a command's pipe until it has been forked, so
+   that no other worker's child inherits the pipe and keeps it open. */
+static pthread_mutex_t spawn_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void set_flags( int fd, int fd_flags, int fl_flags )
+{
+  fatal_assert( fcntl( fd, F_SETFD, fcntl( fd, F_GETFD ) | fd_flags ) == 0 );
+  fatal_assert( fcntl( fd, F_SETFL, fcntl( fd, F_GETFL ) | fl_flags ) == 0 );
+}
+
+Executor::Executor( int num_workers )
+  : lock(), job_ready(), output_room(), jobs(), running(), budgets(), stopping( false ),
+    workers(), results()
+{
+  fatal_assert( num_workers > 0 );
+  fatal_assert( pthread_mutex_init( &lock, NULL ) == 0 );
+  fatal_assert( pthread_cond_init( &job_ready, NULL ) == 0 );
+  fatal_assert( pthread_cond_init( &output_room, NULL ) == 0 );
+
+  fatal_assert( pipe( notify_pipe ) == 0 );
+  set_flags( notify_pipe[ 0 ], FD_CLOEXEC, O_NONBLOCK );
+  set_flags( notify_pipe[ 1 ], FD_CLOEXEC, O_NONBLOCK );
+
+  for ( int i = 0; i < num_workers; i++ ) {
+    pthread_t thread;
+    fatal_assert( pthread_create( &thread, NULL, worker_main, this ) == 0 );
+    workers.push_back( thread );
+  }
+}
+
+Executor::~Executor()
+{
+  pthread_mutex_lock( &lock );
+  stopping = true;
+  for ( std::map< pid_t, uint64_t >::const_iterator i = running.begin(); i != running.end(); i++ ) {
+    kill( -i->first, SIGKILL );
+  }
+  pthread_cond_broadcast( &job_ready );
+  pthread_cond_broadcast( &output_room );
+  pthread_mutex_unlock( &lock );
+
+  for ( std::vector< pthread_t >::const_iterator i = workers.begin(); i != workers.end(); i++ ) {
+    pthread_join( *i, NULL );
+  }
+
+  close( notify_pipe[ 0 ] );
+  close( notify_pipe[ 1 ] );
+  pthread_cond_destroy( &job_ready );
+  pthread_cond_destroy( &output_room );
+  pthread_mutex_destroy( &lock );
+}
+
+void Executor::submit( uint64_t session, uint64_t command, const std::string &line, bool urgent )
+{
+  pthread_mutex_lock( &lock );
+  if ( urgent ) {
+    jobs.push_front( Job( session, command, line ) );
+  } else {
+    jobs.push_back( Job( session, command, line ) );
+  }
+  pthread_cond_signal( &job_ready );
+  pthread_mutex_unlock( &lock );
+}
+
+void Executor::signal( uint64_t session, int signum )
+{
+  pthread_mutex_lock( &lock );
+  for ( std::map< pid_t, uint64_t >::const_iterator i = running.begin(); i != running.end(); i++ ) {
+    if ( i->second == session ) {
+      kill( -i->first, signum );
+    }
+  }
+  pthread_mutex_unlock( &lock );
+}
+
+void Executor::cancel( uint64_t session )
+{
+  pthread_mutex_lock( &lock );
+  for ( std::deque< Job >::iterator i = jobs.begin(); i != jobs.end(); ) {
+    if ( i->session == session ) {
+      i = jobs.erase( i );
+    } else {
+      i++;
+    }
+  }
+  for ( std::map< pid_t, uint64_t >::const_iterator i = running.begin(); i != running.end(); i++ ) {
+    if ( i->second == session ) {
+      kill( -i->first, SIGKILL );
+    }
+  }
+
+  /* No one will acknowledge its output now. A command a worker has
+     taken but not yet started is killed once it has. */
+  std::map< uint64_t, OutputBudget >::iterator budget = budgets.find( session );
+  if ( budget != budgets.end() ) {
+    budget->second.cancelled = true;
+    prune_budget( budget );
+    pthread_cond_broadcast( &output_room );
+  }
+  pthread_mutex_unlock( &lock );
+}
+
+bool Executor::collect( Result &result )
+{
+  if ( results.pop( result ) ) {
+    return true;
+  }
+
+  /* Nothing left, so clear the notifications. Anything pushed from
+     here on will notify again. */
+  char buf[ 256 ];
+  while ( read( notify_pipe[ 0 ], buf, sizeof( buf ) ) > 0 ) {}
+
+  return results.pop( result );
+}
+
+void Executor::account( uint64_t session, size_t collected, size_t unacknowledged )
+{
+  pthread_mutex_lock( &lock );
+  std::map< uint64_t, OutputBudget >::iterator budget = budgets.find( session );
+  if ( budget == budgets.end() ) {
+    if ( unacknowledged == 0 ) {
+      pthread_mutex_unlock( &lock );
+      return; /* nothing to hold anyone back */
+    }
+    budget = budgets.insert( std::make_pair( session, OutputBudget() ) ).first;
+  }
+
+  OutputBudget &b = budget->second;
+  b.in_flight -= std::min( b.in_flight, collected );
+  b.unacknowledged = unacknowledged;
+  prune_budget( budget );
+  pthread_cond_broadcast( &output_room );
+  pthread_mutex_unlock( &lock );
+}
+
+/* Forget a budget that holds nothing back. Called with lock held. */
+void Executor::prune_budget( std::map< uint64_t, OutputBudget >::iterator budget )
+{
+  const OutputBudget &b = budget->second;
+  if ( b.commands == 0
+       && (b.cancelled || (b.in_flight == 0 && b.unacknowledged == 0)) ) {
+    budgets.erase( budget );
+  }
+}
+
+/* Block until session may have more output read. */
+void Executor::wait_for_output_room( uint64_t session )
+{
+  pthread_mutex_lock( &lock );
+  while ( !stopping ) {
+    const OutputBudget &b = budgets[ session ];
+    if ( b.cancelled || b.in_flight + b.unacknowledged < OUTPUT_WINDOW ) {
+      break;
+    }
+    pthread_cond_wait( &output_room, &lock );
+  }
+  pthread_mutex_unlock( &lock );
+}
+
+void *Executor::worker_main( void *executor )
+{
+  /* leave signals to the event loop */
+  sigset_t all;
+  sigfillset( &all );
+  pthread_sigmask( SIG_BLOCK, &all, NULL );
+
+  static_cast< Executor * >( executor )->work();
+  return NULL;
+}
+
+void Executor::work( void )
+{
+  while ( true ) {
+    pthread_mutex_lock( &lock );
+    while ( jobs.empty() && !stopping ) {
+      pthread_cond_wait( &job_ready, &lock );
+    }
+    if ( stopping ) {
+      pthread_mutex_unlock( &lock );
+      return;
+    }
+    Job job = jobs.front();
+    jobs.pop_front();
+    /* counted as the session's from here, so cancel() can't miss it */
+    budgets[ job.session ].commands++;
+    pthread_mutex_unlock( &lock );
+
+    run( job );
+  }
+}
+
+void Executor::post( const Result &result )
+{
+  results.push( result );
+
+  char wake = 0;
+  if ( write( notify_pipe[ 1 ], &wake, 1 ) < 0 ) {
+    /* pipe is full, so the consumer will wake anyway */
+  }
+}
+
+/* Fork /bin/sh -c line, in its own process group, with stdout and
+   stderr on a new pipe whose read end is returned in output_fd. */
+pid_t Executor::spawn( const std::string &line, int &output_fd )
+{
+  const char *command = line.c_str();
+  int output[ 2 ];
+
+  pthread_mutex_lock( &spawn_lock );
+  if ( pipe( output ) < 0 ) {
+    pthread_mutex_unlock( &spawn_lock );
+    return -1;
+  }
+  set_flags( output[ 0 ], FD_CLOEXEC, 0 );
+  set_flags( output[ 1 ], FD_CLOEXEC, 0 );
+
+  pid_t pid = fork();
+  if ( pid == 0 ) {
+    /* child: only async-signal-safe calls from here on */
+    dup2( output[ 1 ], STDOUT_FILENO );
+    dup2( output[ 1 ], STDERR_FILENO );
+    int null_fd = open( "/dev/null", O_RDONLY );
+    if ( null_fd >= 0 ) {
+      dup2( null_fd, STDIN_FILENO );
+    }
+    setpgid( 0, 0 );
+
+    /* undo what mosh-server did to itself */
+    struct sigaction sa;
+    sa.sa_handler = SIG_DFL;
+    sa.sa_flags = 0;
+    sigemptyset( &sa.sa_mask );
+    sigaction( SIGPIPE, &sa, NULL );
+    sigaction( SIGHUP, &sa, NULL );
+    sigset_t none;
+    sigemptyset( &none );
+    sigprocmask( SIG_SETMASK, &none, NULL );
+
+    execl( _PATH_BSHELL, "sh", "-c", command, (char *)NULL );
+    _exit( 127 );
+  }
+  int saved_errno = errno;
+  pthread_mutex_unlock( &spawn_lock );
+
+  /* as the child does, so that signal() can reach it at once */
+  if ( pid > 0 ) {
+    setpgid( pid, pid );
+  }
+
+  close( output[ 1 ] );
+  if ( pid < 0 ) {
+    close( output[ 0 ] );
+    errno = saved_errno;
+    return -1;
+  }
+
+  output_fd = output[ 0 ];
+  return pid;
+}
+
+/* Forget a command of session's that has ended or never started. */
+void Executor::release( uint64_t session )
+{
+  pthread_mutex_lock( &lock );
+  std::map< uint64_t, OutputBudget >::iterator budget = budgets.find( session );
+  budget->second.commands--;
+  prune_budget( budget );
+  pthread_mutex_unlock( &lock );
+}
+
+void Executor::run( const Job &job )
+{
+  Result result;
+  result.session = job.session;
+  result.command = job.command;
+
+  int output_fd;
+  pid_t pid = spawn( job.line, output_fd );
+  if ( pid < 0 ) {
+    release( job.session );
+    result.output = std::string( "mosh-server: cannot run command: " ) + strerror( errno ) + "\n";
+    post( result );
+    result.output.clear();
+    result.finished = true;
+    result.exit_status = -1;
+    post( result );
+    return;
+  }
+
+  pthread_mutex_lock( &lock );
+  running[ pid ] = job.session;
+  if ( stopping || budgets[ job.session ].cancelled ) {
+    kill( -pid, SIGKILL );
+  }
+  pthread_mutex_unlock( &lock );
+
+  char buf[ READ_SIZE ];
+  while ( true ) {
+    wait_for_output_room( job.session );
+    ssize_t bytes_read = read( output_fd, buf, sizeof( buf ) );
+    if ( bytes_read > 0 ) {
+      pthread_mutex_lock( &lock );
+      budgets[ job.session ].in_flight += bytes_read;
+      pthread_mutex_unlock( &lock );
+
+      result.output.assign( buf, bytes_read );
+      post( result );
+    } else if ( bytes_read < 0 && errno == EINTR ) {
+      continue;
+    } else {
+      break;
+    }
+  }
+  close( output_fd );
+
+  int status = 0;
+  while ( waitpid( pid, &status, 0 ) < 0 && errno == EINTR ) {}
+
+  pthread_mutex_lock( &lock );
+  running.erase( pid );
+  pthread_mutex_unlock( &lock );
+  release( job.session );
+
+  result.output.clear();
+  result.finished = true;
+  if ( WIFEXITED( status ) ) {
+    result.exit_status = WEXITSTATUS( status );
+  } else if ( WIFSIGNALED( status ) ) {
+    result.exit_status = 128 + WTERMSIG( status );
+  } else {
+    result.exit_status = -1;
+  }
+  post( result );
+}
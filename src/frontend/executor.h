@@ -0,0 +1,155 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+#ifndef EXECUTOR_HPP
+#define EXECUTOR_HPP
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "mpscqueue.h"
+
+/* Runs shell commands on a fixed pool of worker threads.
+
+   Each command runs under /bin/sh -c with its stdout and stderr on a
+   pipe, which its worker reads until the command exits. Output and exit
+   statuses are handed back through a lock-free queue; fd() becomes
+   readable when there is something to collect, so the caller's event
+   loop never waits on a command.
+
+   Every command belongs to a session, an opaque number of the
+   caller's, so that one pool can serve many sessions.
+
+   A session's output is under flow control. Workers stop reading its
+   commands' pipes while OUTPUT_WINDOW bytes of it are either waiting
+   to be collected or collected but, by the caller's account(), not
+   yet acknowledged by the client. A command that writes without end
+   then blocks on its pipe instead of growing the server. */
+class Executor {
+public:
+  class Result {
+  public:
+    uint64_t session;
+    uint64_t command;
+    std::string output;
+    bool finished;
+    int exit_status; /* as in the shell; -1 if the command never started */
+
+    Result() : session( 0 ), command( 0 ), output(), finished( false ), exit_status( 0 ) {}
+  };
+
+private:
+  class Job {
+  public:
+    uint64_t session;
+    uint64_t command;
+    std::string line;
+
+    Job( uint64_t s_session, uint64_t s_command, const std::string &s_line )
+      : session( s_session ), command( s_command ), line( s_line ) {}
+  };
+
+  /* a session's output read and not yet acknowledged */
+  class OutputBudget {
+  public:
+    size_t in_flight; /* posted and not yet account()ed as collected */
+    size_t unacknowledged;
+    int commands; /* taken off the queue and not yet reaped */
+    bool cancelled; /* kill what starts, and read on until it dies */
+
+    OutputBudget() : in_flight( 0 ), unacknowledged( 0 ), commands( 0 ), cancelled( false ) {}
+  };
+
+  /* protected by lock */
+  pthread_mutex_t lock;
+  pthread_cond_t job_ready;
+  pthread_cond_t output_room;
+  std::deque< Job > jobs;
+  std::map< pid_t, uint64_t > running; /* process group to session */
+  std::map< uint64_t, OutputBudget > budgets;
+  bool stopping;
+
+  std::vector< pthread_t > workers;
+
+  MPSCQueue< Result > results;
+  int notify_pipe[ 2 ];
+
+  static void *worker_main( void *executor );
+  void work( void );
+  void run( const Job &job );
+  void release( uint64_t session );
+  pid_t spawn( const std::string &line, int &output_fd );
+  void post( const Result &result );
+  void wait_for_output_room( uint64_t session );
+  void prune_budget( std::map< uint64_t, OutputBudget >::iterator budget );
+
+  /* not implemented */
+  Executor( const Executor & );
+  Executor &operator=( const Executor & );
+
+public:
+  /* most output of a session read ahead of the client's acknowledgment */
+  static const size_t OUTPUT_WINDOW = 1024 * 1024;
+
+  Executor( int num_workers );
+  ~Executor();
+
+  /* Queue a command line to be run as soon as a worker is free, or,
+     if urgent, ahead of everything already waiting. */
+  void submit( uint64_t session, uint64_t command, const std::string &line,
+               bool urgent = false );
+
+  /* Send signum to every command of session that is running. */
+  void signal( uint64_t session, int signum );
+
+  /* Forget session's queued commands and kill its running ones. The
+     results those still post should be ignored. */
+  void cancel( uint64_t session );
+
+  /* readable when collect() may return something */
+  int fd( void ) const { return notify_pipe[ 0 ]; }
+
+  /* Takes the oldest unreported result. Returns false if there is none. */
+  bool collect( Result &result );
+
+  /* For flow control: session has taken collected bytes of output from
+     collect() and holds unacknowledged bytes the client has yet to
+     acknowledge, counting any it just took. */
+  void account( uint64_t session, size_t collected, size_t unacknowledged );
+};
+
+#endif
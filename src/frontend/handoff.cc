@@ -0,0 +1,335 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <algorithm>
+
+#include "handoff.h"
+#include "byteorder.h"
+#include "network.h"
+#include "timestamp.h"
+
+using namespace std;
+
+/* Handing off takes a moment; waiting for the other side, a deadline */
+static const int DEFAULT_TIMEOUT = 5000;
+
+static uint64_t now( void )
+{
+  freeze_timestamp();
+  return frozen_timestamp();
+}
+
+/* Close what a failed recv() had received so far. */
+static void close_all( vector< int > &fds )
+{
+  for ( vector< int >::const_iterator i = fds.begin(); i != fds.end(); i++ ) {
+    close( *i );
+  }
+  fds.clear();
+}
+
+static bool make_address( const char *path, struct sockaddr_un &addr )
+{
+  memset( &addr, 0, sizeof( addr ) );
+  addr.sun_family = AF_UNIX;
+  if ( strlen( path ) >= sizeof( addr.sun_path ) ) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+  strcpy( addr.sun_path, path );
+  return true;
+}
+
+int HandoffChannel::listen( const char *path, int backlog )
+{
+  struct sockaddr_un addr;
+  if ( !make_address( path, addr ) ) {
+    return -1;
+  }
+
+  int sock = socket( AF_UNIX, SOCK_STREAM, 0 );
+  if ( sock < 0 ) {
+    return -1;
+  }
+
+  /* no one else may even connect */
+  unlink( path );
+  mode_t saved_umask = umask( 077 );
+  int bound = bind( sock, (const sockaddr *)&addr, sizeof( addr ) );
+  umask( saved_umask );
+
+  if ( bound < 0
+       || ::listen( sock, backlog ) < 0
+       || fcntl( sock, F_SETFD, FD_CLOEXEC ) < 0
+       || fcntl( sock, F_SETFL, O_NONBLOCK ) < 0 ) {
+    int saved_errno = errno;
+    close( sock );
+    errno = saved_errno;
+    return -1;
+  }
+  return sock;
+}
+
+HandoffChannel *HandoffChannel::accept( int listen_fd )
+{
+  int sock = ::accept( listen_fd, NULL, NULL );
+  if ( sock < 0 ) {
+    return NULL;
+  }
+
+#ifdef SO_PEERCRED
+  struct ucred cred;
+  socklen_t len = sizeof( cred );
+  if ( getsockopt( sock, SOL_SOCKET, SO_PEERCRED, &cred, &len ) < 0
+       || cred.uid != geteuid() ) {
+    close( sock );
+    return NULL;
+  }
+#endif
+
+  return new HandoffChannel( sock );
+}
+
+HandoffChannel *HandoffChannel::connect( const char *path )
+{
+  struct sockaddr_un addr;
+  if ( !make_address( path, addr ) ) {
+    throw Network::NetworkException( "handoff socket path", errno );
+  }
+
+  int sock = socket( AF_UNIX, SOCK_STREAM, 0 );
+  if ( sock < 0 ) {
+    throw Network::NetworkException( "socket", errno );
+  }
+
+  if ( ::connect( sock, (const sockaddr *)&addr, sizeof( addr ) ) < 0 ) {
+    int saved_errno = errno;
+    close( sock );
+    if ( saved_errno == ENOENT || saved_errno == ECONNREFUSED ) {
+      return NULL; /* no one is there */
+    }
+    throw Network::NetworkException( "connect", saved_errno );
+  }
+
+  return new HandoffChannel( sock );
+}
+
+HandoffChannel::HandoffChannel( int s_fd )
+  : fd( s_fd ), deadline( 0 )
+{
+  if ( fcntl( fd, F_SETFD, FD_CLOEXEC ) < 0
+       || fcntl( fd, F_SETFL, O_NONBLOCK ) < 0 ) {
+    perror( "fcntl" );
+  }
+  set_timeout( DEFAULT_TIMEOUT );
+}
+
+HandoffChannel::~HandoffChannel()
+{
+  close( fd );
+}
+
+void HandoffChannel::set_timeout( int ms )
+{
+  deadline = now() + ms;
+}
+
+/* Wait for the socket to be ready for events, until the deadline. */
+bool HandoffChannel::wait( short events )
+{
+  while ( true ) {
+    uint64_t time = now();
+    if ( time >= deadline ) {
+      return false;
+    }
+
+    struct pollfd pfd = { fd, events, 0 };
+    int ready = poll( &pfd, 1, deadline - time );
+    if ( ready > 0 ) {
+      return true;
+    } else if ( ready < 0 && errno != EINTR ) {
+      return false;
+    }
+  }
+}
+
+bool HandoffChannel::write_all( const char *data, size_t len )
+{
+  while ( len > 0 ) {
+    ssize_t written = ::send( fd, data, len, MSG_NOSIGNAL );
+    if ( written < 0 ) {
+      if ( (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) && wait( POLLOUT ) ) {
+        continue;
+      }
+      return false;
+    }
+    data += written;
+    len -= written;
+  }
+  return true;
+}
+
+bool HandoffChannel::read_all( char *data, size_t len )
+{
+  while ( len > 0 ) {
+    ssize_t bytes_read = read( fd, data, len );
+    if ( bytes_read < 0 ) {
+      if ( (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) && wait( POLLIN ) ) {
+        continue;
+      }
+      return false;
+    } else if ( bytes_read == 0 ) {
+      return false; /* the other side gave up */
+    }
+    data += bytes_read;
+    len -= bytes_read;
+  }
+  return true;
+}
+
+/* The lengths of the message and of the list of fds; the fds, a batch
+   at a time with one byte each; then the message. */
+bool HandoffChannel::send( const string &message, const vector< int > &fds )
+{
+  uint64_t message_len = htobe64( message.size() );
+  uint32_t fd_count = htobe32( fds.size() );
+  if ( !write_all( (const char *)&message_len, sizeof( message_len ) )
+       || !write_all( (const char *)&fd_count, sizeof( fd_count ) ) ) {
+    return false;
+  }
+
+  for ( size_t sent = 0; sent < fds.size(); ) {
+    size_t count = min( fds.size() - sent, size_t( FDS_PER_MESSAGE ) );
+
+    char byte = 0;
+    struct iovec iov = { &byte, 1 };
+    vector< char > control( CMSG_SPACE( count * sizeof( int ) ) );
+    struct msghdr header;
+    memset( &header, 0, sizeof( header ) );
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    header.msg_control = &control[ 0 ];
+    header.msg_controllen = control.size();
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR( &header );
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN( count * sizeof( int ) );
+    memcpy( CMSG_DATA( cmsg ), &fds[ sent ], count * sizeof( int ) );
+
+    ssize_t written = sendmsg( fd, &header, MSG_NOSIGNAL );
+    if ( written < 0 ) {
+      if ( (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) && wait( POLLOUT ) ) {
+        continue;
+      }
+      return false;
+    }
+    sent += count;
+  }
+
+  return write_all( message.data(), message.size() );
+}
+
+bool HandoffChannel::recv( string &message, vector< int > &fds )
+{
+  fds.clear();
+
+  uint64_t message_len;
+  uint32_t fd_count;
+  if ( !read_all( (char *)&message_len, sizeof( message_len ) )
+       || !read_all( (char *)&fd_count, sizeof( fd_count ) ) ) {
+    return false;
+  }
+  message_len = be64toh( message_len );
+  fd_count = be32toh( fd_count );
+  if ( message_len > MAX_MESSAGE || fd_count > MAX_FDS ) {
+    return false;
+  }
+
+  vector< char > control( CMSG_SPACE( FDS_PER_MESSAGE * sizeof( int ) ) );
+  while ( fds.size() < fd_count ) {
+    char byte;
+    struct iovec iov = { &byte, 1 };
+    struct msghdr header;
+    memset( &header, 0, sizeof( header ) );
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    header.msg_control = &control[ 0 ];
+    header.msg_controllen = control.size();
+
+    ssize_t bytes_read = recvmsg( fd, &header, MSG_CMSG_CLOEXEC );
+    if ( bytes_read < 0 ) {
+      if ( (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) && wait( POLLIN ) ) {
+        continue;
+      }
+      close_all( fds );
+      return false;
+    } else if ( bytes_read == 0 ) {
+      close_all( fds );
+      return false;
+    }
+
+    /* a truncated batch still brings the fds that fit */
+    for ( struct cmsghdr *cmsg = CMSG_FIRSTHDR( &header );
+          cmsg != NULL;
+          cmsg = CMSG_NXTHDR( &header, cmsg ) ) {
+      if ( cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS ) {
+        size_t count = (cmsg->cmsg_len - CMSG_LEN( 0 )) / sizeof( int );
+        size_t first = fds.size();
+        fds.resize( first + count );
+        memcpy( &fds[ first ], CMSG_DATA( cmsg ), count * sizeof( int ) );
+      }
+    }
+    if ( header.msg_flags & MSG_CTRUNC ) {
+      close_all( fds );
+      return false;
+    }
+  }
+
+  message.resize( message_len );
+  if ( message_len > 0 && !read_all( &message[ 0 ], message_len ) ) {
+    close_all( fds );
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,103 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+
+#ifndef HANDOFF_HPP
+#define HANDOFF_HPP
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/* One end of the Unix socket over which an mmserver hands its sessions
+   to a process that takes over from it, as for an upgrade: a message,
+   and file descriptors passed with SCM_RIGHTS alongside it.
+
+   Only a process of our own user is let in, as what passes is every
+   session's key. Every call gives up and returns false once the
+   deadline set by set_timeout() has passed, so that neither side can
+   keep the other waiting for long. */
+class HandoffChannel {
+private:
+  /* passed per sendmsg(); the kernel takes at most SCM_MAX_FD, 253 */
+  static const int FDS_PER_MESSAGE = 200;
+  /* limits on what we accept */
+  static const uint64_t MAX_MESSAGE = 1 << 30;
+  static const uint32_t MAX_FDS = 1 << 20;
+
+  int fd;
+  uint64_t deadline;
+
+  bool wait( short events );
+  bool write_all( const char *data, size_t len );
+  bool read_all( char *data, size_t len );
+
+  /* not implemented */
+  HandoffChannel( const HandoffChannel & );
+  HandoffChannel &operator=( const HandoffChannel & );
+
+public:
+  /* what the taking-over side sends once it has every session set up,
+     the answer that leaves them to it, and its word that it kept them */
+  static const char READY = 'R';
+  static const char GO = 'G';
+  static const char DONE = 'D';
+
+  /* Listen at path, in place of any socket left there. Returns the
+     socket, or -1 with errno set. */
+  static int listen( const char *path, int backlog = 1 );
+
+  /* A connection waiting on listen_fd, or NULL if there is none or it
+     is from another user. */
+  static HandoffChannel *accept( int listen_fd );
+
+  /* Connect to the process listening at path, or return NULL if there
+     is none. Throws NetworkException on other errors. */
+  static HandoffChannel *connect( const char *path );
+
+  /* takes over s_fd */
+  HandoffChannel( int s_fd );
+  ~HandoffChannel();
+
+  void set_timeout( int ms );
+
+  /* fds are only lent, and stay open here; received ones are the
+     caller's to close, but on failure recv() closes any that came
+     before it and leaves fds empty */
+  bool send( const std::string &message, const std::vector< int > &fds );
+  bool recv( std::string &message, std::vector< int > &fds );
+
+  bool send_byte( char byte ) { return write_all( &byte, 1 ); }
+  bool recv_byte( char &byte ) { return read_all( &byte, 1 ); }
+};
+
+#endif
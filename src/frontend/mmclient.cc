@@ -2,65 +2,254 @@
 
 #include "mmclient.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
-#include "select.h"
+#include "eventloop.h"
+#include "fatal_assert.h"
 #include "networktransport.cc"
 
+/* stdin is read in chunks of this size, at most this many per loop */
+static const size_t READ_SIZE = 65536;
+static const int READS_PER_LOOP = 16;
+
 void MMClient::init() {
-  
+  /* read stdin without blocking, so the network is never starved */
+  saved_stdin_flags = fcntl(STDIN_FILENO, F_GETFL);
+  if (saved_stdin_flags < 0
+      || fcntl(STDIN_FILENO, F_SETFL, saved_stdin_flags | O_NONBLOCK) < 0) {
+    throw Network::NetworkException("fcntl", errno);
+  }
 }
 
 void MMClient::shutdown() {
-  
+  /* stdin may be shared with our parent */
+  if (saved_stdin_flags >= 0) {
+    fcntl(STDIN_FILENO, F_SETFL, saved_stdin_flags);
+  }
+}
+
+/* Write all of iov to fd, which may be non-blocking if it shares its
+   file description with stdin. */
+static void write_all(int fd, std::vector<struct iovec> &iov) {
+  size_t done = 0;
+  while (done < iov.size()) {
+    int count = std::min(iov.size() - done, size_t(IOV_MAX));
+    ssize_t written = writev(fd, &iov[done], count);
+    if (written < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        struct pollfd pfd = { fd, POLLOUT, 0 };
+        poll(&pfd, 1, -1);
+        continue;
+      } else if (errno == EINTR) {
+        continue;
+      }
+      perror("writev");
+      break;
+    }
+
+    /* skip what was written, including part of an iovec */
+    while (done < iov.size() && size_t(written) >= iov[done].iov_len) {
+      written -= iov[done].iov_len;
+      done++;
+    }
+    if (written > 0) {
+      iov[done].iov_base = static_cast<char *>(iov[done].iov_base) + written;
+      iov[done].iov_len -= written;
+    }
+  }
+  iov.clear();
+}
+
+/* Copy new output to stdout, all of it in as few writes as possible,
+   and report commands that failed. */
+void MMClient::render(const Term::TerminalResults &results) {
+  std::vector<struct iovec> pending;
+
+  for (size_t i = 0; i < results.size(); i++) {
+    const Term::ResultEvent *event = results.get_event(i);
+    if (!event->finished) {
+      if (event->size() > 0) {
+        struct iovec chunk = { const_cast<char *>(event->data()), event->size() };
+        pending.push_back(chunk);
+      }
+      continue;
+    }
+
+    finished_commands++;
+    if (event->exit_status != 0) {
+      write_all(STDOUT_FILENO, pending);
+      fprintf(stderr, "[command %llu exited with status %d]\n",
+              (unsigned long long)event->command, event->exit_status);
+    }
+  }
+
+  write_all(STDOUT_FILENO, pending);
+}
+
+/* Queue input as data or, in line mode, as one command per line. */
+void MMClient::push_input(const char *buf, size_t len) {
+  Term::CommandStream &outgoing = network->get_current_state();
+
+  if (!line_mode) {
+    outgoing.push_back(Term::DataType, std::string(buf, len));
+    return;
+  }
+
+  const char *end = buf + len;
+  const char *newline;
+  while ((newline = static_cast<const char *>(memchr(buf, '\n', end - buf))) != NULL) {
+    partial_line.append(buf, newline);
+    if (!partial_line.empty()) {
+      outgoing.push_back(Term::GeneralType, partial_line);
+    }
+    partial_line.clear();
+    buf = newline + 1;
+  }
+  partial_line.append(buf, end);
+
+  /* don't let one endless line take all of memory */
+  if (stdin_eof || partial_line.size() >= outbound_budget) {
+    if (!partial_line.empty()) {
+      outgoing.push_back(Term::GeneralType, partial_line);
+    }
+    partial_line.clear();
+  }
+}
+
+/* Send an interrupt for the running commands in the high-priority
+   lane, past any input still queued. If the last one has not even been
+   acknowledged yet, shut down instead, or, if we already are, return
+   false to quit at once. */
+bool MMClient::interrupt() {
+  Term::CommandStream &outgoing = network->get_current_state();
+
+  if (outgoing.get_bytes(Term::HighPriority) > 0) {
+    if (network->shutdown_in_progress()) {
+      return false;
+    }
+    network->start_shutdown();
+    return true;
+  }
+
+  char signum[16];
+  snprintf(signum, sizeof(signum), "%d", SIGINT);
+  outgoing.push_back(Term::SignalType, signum, Term::HighPriority);
+  return true;
+}
+
+/* How many more bytes of input we may send now: limited both by our
+   own budget for unacknowledged bytes and by the server's credit. */
+size_t MMClient::input_allowance() {
+  const Term::CommandStream &outgoing = network->get_current_state();
+  uint64_t credit = network->get_latest_remote_state().state->get_credit();
+
+  if (outgoing.get_bytes() >= outbound_budget || outgoing.get_end_bytes() >= credit) {
+    return 0;
+  }
+  return std::min(outbound_budget - outgoing.get_bytes(), credit - outgoing.get_end_bytes());
+}
+
+/* Push whatever stdin has ready onto the outgoing stream, stopping
+   when input_allowance() runs out. */
+void MMClient::read_stdin() {
+  char buf[READ_SIZE];
+
+  size_t allowance;
+  for (int i = 0; i < READS_PER_LOOP && (allowance = input_allowance()) > 0; i++) {
+    size_t want = std::min(sizeof(buf), allowance);
+    ssize_t bytes_read = read(STDIN_FILENO, buf, want);
+    if (bytes_read == 0) {
+      stdin_eof = true;
+      push_input(buf, 0);
+      return;
+    } else if (bytes_read < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        return;
+      }
+      perror("read");
+      stdin_eof = true;
+      push_input(buf, 0);
+      return;
+    }
+
+    push_input(buf, bytes_read);
+  }
 }
 
 void MMClient::main() {
   Term::CommandStream blank_stream;
-  Term::CommandStream blank_results;
+  Term::TerminalResults blank_results;
 
   network =
-    new Network::Transport<Term::CommandStream, Term::CommandStream>(
-      blank_stream, blank_results, key.c_str(), ip.c_str(), port
+    new Network::Transport<Term::CommandStream, Term::TerminalResults>(
+      blank_stream, blank_results, key.c_str(), ip.c_str(), port, session_id
     );
   network->set_send_delay(1);
 
   uint64_t last_remote_num = network->get_remote_state_num();
 
-  Select &sel = Select::get_instance();
+  /* Ctrl-C interrupts the server's commands rather than us */
+  EventLoop loop;
+  loop.add_signal(SIGINT);
+
+  /* the network's fds as registered with loop; they change when it hops */
+  std::vector<int> watched_fds;
+
   while (1) {
     try {
       if (network->get_remote_state_num() != last_remote_num) {
           last_remote_num = network->get_remote_state_num();
           
-          Term::CommandStream command_stream;
-          command_stream.apply_string(network->get_remote_diff());
-          for (size_t i = 0; i < command_stream.size(); i++) {
-            const string *action = command_stream.get_action(i);
-            fprintf(stderr, "Received: %s\n", action->c_str());
-          }
+          Term::TerminalResults results;
+          results.apply_string(network->get_remote_diff());
+          render(results);
         }
 
-      sel.clear_fds();
-      sel.add_fd(STDIN_FILENO);
+      /* once the budget or the credit is used up, leave stdin alone
+         until acks or more credit come back */
+      bool want_input = !stdin_eof && !network->shutdown_in_progress()
+        && input_allowance() > 0;
+
+      if (want_input) {
+        loop.add_fd(STDIN_FILENO);
+      } else {
+        loop.remove_fd(STDIN_FILENO);
+      }
       std::vector<int> fd_list = network->fds();
-      for (std::vector<int>::const_iterator it = fd_list.begin();
-        it != fd_list.end();
-        it++) {
-        sel.add_fd(*it);
+      if (fd_list != watched_fds) {
+        /* re-add them all, in case a closed one's number came back */
+        for (std::vector<int>::const_iterator it = watched_fds.begin();
+          it != watched_fds.end();
+          it++) {
+          loop.remove_fd(*it);
+        }
+        for (std::vector<int>::const_iterator it = fd_list.begin();
+          it != fd_list.end();
+          it++) {
+          loop.add_fd(*it);
+        }
+        watched_fds = fd_list;
       }
 
-      int active_fds = sel.select(250);
+      /* datagrams left over from a batch that threw don't wake us */
+      int active_fds = loop.wait(network->pending() ? 0 : std::min(network->wait_time(), 250));
       if (active_fds < 0) {
         fprintf(stderr, "active fds error\n");
         break;
       }
 
-      bool read_from_network = false;
+      bool read_from_network = network->pending();
       for (std::vector<int>::const_iterator it = fd_list.begin();
         it != fd_list.end();
         it++) {
-        if (sel.read(*it)) {
+        if (loop.read(*it)) {
           read_from_network = true;
         }
       }
@@ -69,13 +258,31 @@ void MMClient::main() {
         network->recv();
       }
 
-      if (sel.read(STDIN_FILENO)) {
-        // For now just send a string of "DEADBEEF" as the message but we should
-        // actually be reading stdin and sending messages based on that.
-        network->get_current_state().push_back(std::string("DEADBEEF"));
+      if (want_input && loop.read(STDIN_FILENO)) {
+        read_stdin();
+      }
+
+      if (loop.signal(SIGINT) && !interrupt()) {
+        break;
+      }
+
+      /* after end of input, shut down once every command has finished */
+      if (stdin_eof && !network->shutdown_in_progress()
+          && network->get_current_state().get_bytes() == 0
+          && finished_commands == network->get_current_state().get_end_num()) {
+        network->start_shutdown();
       }
 
       network->tick();
+
+      if (network->shutdown_in_progress()
+          && (network->shutdown_acknowledged() || network->shutdown_ack_timed_out())) {
+        break;
+      }
+
+      if (network->counterparty_shutdown_ack_sent()) {
+        break;
+      }
     } catch (...) {
 
     }
@@ -8,6 +8,7 @@
 #include <networktransport.h>
 
 #include "commandstream.h"
+#include "terminalresults.h"
 
 class MMClient {
 	private:
@@ -15,13 +16,43 @@ class MMClient {
 		int port;
 		std::string key;
 
-    // TODO: Use a different data structure for the remote side.
-    // Maybe a TerminalResults?
-		Network::Transport<Term::CommandStream, Term::CommandStream> *network;
+		/* sent ahead of each datagram when the server shares its
+		   port among sessions, else 0 */
+		uint64_t session_id;
+
+		/* stop reading stdin while this many bytes are unacknowledged */
+		size_t outbound_budget;
+		bool stdin_eof;
+		int saved_stdin_flags;
+
+		/* send each line of stdin as a command to run, not as data */
+		bool line_mode;
+		std::string partial_line;
+
+		/* commands the server has reported as finished */
+		uint64_t finished_commands;
+
+		Network::Transport<Term::CommandStream, Term::TerminalResults> *network;
+
+		size_t input_allowance();
+		void read_stdin();
+		void push_input(const char *buf, size_t len);
+		bool interrupt();
+		void render(const Term::TerminalResults &results);
 
 	public:
-		MMClient(const char *ip, int port, const char *key)
-			: ip(ip), port(port), key(key) { }
+		/* Everything unacknowledged may go out again in one burst of
+		   datagrams, so much more than this overruns the receiving
+		   socket buffer and the transfer stalls on retransmissions. */
+		static const size_t DEFAULT_OUTBOUND_BUDGET = 64 * 1024;
+
+		MMClient(const char *ip, int port, const char *key,
+			 size_t outbound_budget = DEFAULT_OUTBOUND_BUDGET,
+			 bool line_mode = false, uint64_t session_id = 0)
+			: ip(ip), port(port), key(key), session_id(session_id),
+			  outbound_budget(outbound_budget),
+			  stdin_eof(false), saved_stdin_flags(-1), line_mode(line_mode),
+			  partial_line(), finished_commands(0), network(NULL) { }
 		void init();
 		void shutdown();
 		void main();
@@ -35,6 +35,7 @@
 #include <errno.h>
 #include <locale.h>
 #include <string.h>
+#include <map>
 #include <sstream>
 #include <termios.h>
 #include <unistd.h>
@@ -79,29 +80,30 @@
 #include "fatal_assert.h"
 #include "locale_utils.h"
 #include "pty_compat.h"
-#include "select.h"
 #include "timestamp.h"
 #include "fatal_assert.h"
 #include "commandstream.h"
+#include "terminalresults.h"
+#include "mmsession.h"
+#include "shardedhost.h"
+#include "warmpool.h"
 
 #ifndef _PATH_BSHELL
 #define _PATH_BSHELL "/bin/sh"
 #endif
 
-#include "networktransport.cc"
-
-void serve(Term::CommandStream &terminal,
-  Network::Transport<Term::CommandStream, Term::CommandStream> &network);
-
 int run_server( const char *desired_ip, const char *desired_port,
                 const string &command_path, char *command_argv[],
-                const int colors, bool verbose, bool with_motd );
+                const int colors, bool verbose, bool with_motd, int workers,
+                int sessions, bool share_port, int threads, const char *upgrade_path,
+                bool pool_mode, const char *pool_path, int spares );
 
 using namespace std;
 
 void print_usage( const char *argv0 )
 {
-  fprintf( stderr, "Usage: %s new [-s] [-v] [-i LOCALADDR] [-p PORT[:PORT2]] [-c COLORS] [-l NAME=VALUE] [-- COMMAND...]\n", argv0 );
+  fprintf( stderr, "Usage: %s new [-s] [-v] [-i LOCALADDR] [-p PORT[:PORT2]] [-c COLORS] [-j JOBS] [-m SESSIONS [-u] [-t THREADS]] [-U SOCKET | -P SOCKET] [-l NAME=VALUE] [-- COMMAND...]\n", argv0 );
+  fprintf( stderr, "       %s pool -P SOCKET [-w SPARES] [-s] [-v] [-i LOCALADDR] [-p PORT[:PORT2]] [-j JOBS]\n", argv0 );
 }
 
 void print_motd( void );
@@ -109,21 +111,6 @@ void chdir_homedir( void );
 bool motd_hushed( void );
 void warn_unattached( const string & ignore_entry );
 
-/* Simple spinloop */
-void spin( void )
-{
-  static unsigned int spincount = 0;
-  spincount++;
-
-  if ( spincount > 10 ) {
-    struct timespec req;
-    req.tv_sec = 0;
-    req.tv_nsec = 100000000; /* 0.1 sec */
-    nanosleep( &req, NULL );
-    freeze_timestamp();
-  }
-}
-
 string get_SSH_IP( void )
 {
   const char *SSH_CONNECTION = getenv( "SSH_CONNECTION" );
@@ -164,6 +151,21 @@ int main( int argc, char *argv[] )
   string command_path;
   char **command_argv = NULL;
   int colors = 0;
+  /* commands run at once; by default one per processor */
+  int workers = std::max( 1L, sysconf( _SC_NPROCESSORS_ONLN ) );
+  /* sessions hosted by this process */
+  int sessions = 1;
+  /* serve them all from one port */
+  bool share_port = false;
+  /* serve them on this many threads */
+  int threads = 1;
+  /* take over from the server listening here, and listen for the next */
+  const char *upgrade_path = NULL;
+  /* run a pool of spare servers here, or take a session from it */
+  bool pool_mode = false;
+  const char *pool_path = NULL;
+  /* spare servers the pool keeps ready */
+  int spares = 4;
   bool verbose = false; /* don't close stdin/stdout/stderr */
   /* Will cause mosh-server not to correctly detach on old versions of sshd. */
   list<string> locale_vars;
@@ -181,10 +183,11 @@ int main( int argc, char *argv[] )
 
   /* Parse new command-line syntax */
   if ( (argc >= 2)
-       && (strcmp( argv[ 1 ], "new" ) == 0) ) {
+       && (strcmp( argv[ 1 ], "new" ) == 0 || strcmp( argv[ 1 ], "pool" ) == 0) ) {
     /* new option syntax */
+    pool_mode = strcmp( argv[ 1 ], "pool" ) == 0;
     int opt;
-    while ( (opt = getopt( argc - 1, argv + 1, "i:p:c:svl:" )) != -1 ) {
+    while ( (opt = getopt( argc - 1, argv + 1, "i:p:c:j:m:ut:U:P:w:svl:" )) != -1 ) {
       switch ( opt ) {
       case 'i':
         desired_ip = optarg;
@@ -200,6 +203,47 @@ int main( int argc, char *argv[] )
       case 'c':
         colors = myatoi( optarg );
         break;
+      case 'j':
+        workers = myatoi( optarg );
+        if ( workers <= 0 ) {
+          fprintf( stderr, "%s: Bad number of jobs (%s)\n", argv[ 0 ], optarg );
+          print_usage( argv[ 0 ] );
+          exit( 1 );
+        }
+        break;
+      case 'm':
+        sessions = myatoi( optarg );
+        if ( sessions <= 0 ) {
+          fprintf( stderr, "%s: Bad number of sessions (%s)\n", argv[ 0 ], optarg );
+          print_usage( argv[ 0 ] );
+          exit( 1 );
+        }
+        break;
+      case 'u':
+        share_port = true;
+        break;
+      case 't':
+        threads = myatoi( optarg );
+        if ( threads <= 0 ) {
+          fprintf( stderr, "%s: Bad number of threads (%s)\n", argv[ 0 ], optarg );
+          print_usage( argv[ 0 ] );
+          exit( 1 );
+        }
+        break;
+      case 'U':
+        upgrade_path = optarg;
+        break;
+      case 'P':
+        pool_path = optarg;
+        break;
+      case 'w':
+        spares = myatoi( optarg );
+        if ( spares <= 0 ) {
+          fprintf( stderr, "%s: Bad number of spares (%s)\n", argv[ 0 ], optarg );
+          print_usage( argv[ 0 ] );
+          exit( 1 );
+        }
+        break;
       case 'v':
         verbose = true;
         break;
@@ -233,16 +277,28 @@ int main( int argc, char *argv[] )
   }
 
   int dpl, dph;
-  if ( desired_port && ! Connection::parse_portrange( desired_port, dpl, dph ) ) {
+  if ( desired_port && ! Network::Connection::parse_portrange( desired_port, dpl, dph ) ) {
     fprintf( stderr, "%s: Bad UDP port range (%s)\n", argv[ 0 ], desired_port );
     print_usage( argv[ 0 ] );
     exit( 1 );
   }
 
+  /* a pool's spares are each one session on a port of its own */
+  if ( pool_mode && !pool_path ) {
+    fprintf( stderr, "%s: A pool needs a socket (-P)\n", argv[ 0 ] );
+    print_usage( argv[ 0 ] );
+    exit( 1 );
+  }
+  if ( pool_path && (sessions > 1 || share_port || threads > 1 || upgrade_path) ) {
+    fprintf( stderr, "%s: A pool (-P) serves one session per process\n", argv[ 0 ] );
+    print_usage( argv[ 0 ] );
+    exit( 1 );
+  }
+
   bool with_motd = false;
 
   try {
-    return run_server( desired_ip, desired_port, command_path, command_argv, colors, verbose, with_motd );
+    return run_server( desired_ip, desired_port, command_path, command_argv, colors, verbose, with_motd, workers, sessions, share_port, threads, upgrade_path, pool_mode, pool_path, spares );
   } catch ( const Network::NetworkException& e ) {
     fprintf( stderr, "Network exception: %s: %s\n",
              e.function.c_str(), strerror( e.the_errno ) );
@@ -254,168 +310,166 @@ int main( int argc, char *argv[] )
   }
 }
 
-int run_server( const char *desired_ip, const char *desired_port,
-                const string &command_path, char *command_argv[],
-                const int colors, bool verbose, bool with_motd ) {
-  Term::CommandStream blank_stream;
-  Term::CommandStream blank_terminal;
-  Network::Transport<Term::CommandStream, Term::CommandStream> *network =
-    new Network::Transport<Term::CommandStream, Term::CommandStream>(
-      blank_terminal, blank_stream, desired_ip, desired_port
-    );
-
+/* Start a session, and note where its client is to find it. */
+template <class Host>
+static MMSession *add_session( Host &host, const char *desired_ip, const char *desired_port,
+                               bool verbose, string &announcement )
+{
+  MMSession *session = host.add_session( desired_ip, desired_port );
   if ( verbose ) {
-    network->set_verbose();
+    session->get_network().set_verbose();
   }
 
-  printf( "\nMOSH CONNECT %d %s\n", network->port(), network->get_key().c_str() );
-  fflush( stdout );
+  char connect[ 128 ];
+  if ( host.sharing_port() ) {
+    snprintf( connect, sizeof( connect ), "\nMOSH CONNECT %d %s %016llx\n",
+              session->get_network().port(), session->get_network().get_key().c_str(),
+              (unsigned long long)session->get_id() );
+  } else {
+    snprintf( connect, sizeof( connect ), "\nMOSH CONNECT %d %s\n",
+              session->get_network().port(), session->get_network().get_key().c_str() );
+  }
+  announcement = connect;
+  return session;
+}
 
-  /* don't let signals kill us */
+/* don't let signals kill us */
+static void ignore_signals( void )
+{
   struct sigaction sa;
   sa.sa_handler = SIG_IGN;
   sa.sa_flags = 0;
   fatal_assert( 0 == sigfillset( &sa.sa_mask ) );
   fatal_assert( 0 == sigaction( SIGHUP, &sa, NULL ) );
   fatal_assert( 0 == sigaction( SIGPIPE, &sa, NULL ) );
+}
 
+static void print_banner( pid_t server )
+{
   fprintf( stderr, "\nmosh-server (%s)\n", PACKAGE_STRING );
   fprintf( stderr, "Copyright 2012 Keith Winstein <mosh-devel@mit.edu>\n" );
   fprintf( stderr, "License GPLv3+: GNU GPL version 3 or later <http://gnu.org/licenses/gpl.html>.\nThis is free software: you are free to change and redistribute it.\nThere is NO WARRANTY, to the extent permitted by law.\n\n" );
 
-  fprintf( stderr, "[mosh-server detached, pid = %d]\n", (int)getpid() );
+  fprintf( stderr, "[mosh-server detached, pid = %d]\n", (int)server );
+}
 
-  try {
-    serve( blank_terminal, *network );
-  } catch ( const Network::NetworkException& e ) {
-    fprintf( stderr, "Network exception: %s: %s\n",
-             e.function.c_str(), strerror( e.the_errno ) );
-  } catch ( const Crypto::CryptoException& e ) {
-    fprintf( stderr, "Crypto exception: %s\n",
-             e.text.c_str() );
+/* Start the sessions, announce them, and serve them until they end. */
+template <class Host>
+static void serve( Host &host, const char *desired_ip, const char *desired_port,
+                   bool verbose, int sessions, bool share_port )
+{
+  if ( share_port ) {
+    host.share_port( desired_ip, desired_port );
   }
 
-  delete network;
+  for ( int i = 0; i < sessions; i++ ) {
+    string announcement;
+    add_session( host, desired_ip, desired_port, verbose, announcement );
+    fputs( announcement.c_str(), stdout );
+  }
+  fflush( stdout );
 
-  printf( "\n[mosh-server is exiting.]\n" );
+  ignore_signals();
+  print_banner( getpid() );
 
-  return 0;
+  host.run();
 }
 
-void serve(Term::CommandStream &terminal,
-  Network::Transport<Term::CommandStream, Term::CommandStream> &network)
-{
-  /* prepare to poll for events */
-  Select &sel = Select::get_instance();
-  sel.add_signal( SIGTERM );
-  sel.add_signal( SIGINT );
-
-  uint64_t last_remote_num = network.get_remote_state_num();
+/* A spare of a WarmPool: a server with its one session made before
+   any client asks for it. */
+class SpareServer : public WarmPool::Spare {
+private:
+  const char *desired_ip;
+  const char *desired_port;
+  int workers;
+  bool verbose;
+
+  SessionHost *host;
+  MMSession *session;
+
+  /* not implemented */
+  SpareServer( const SpareServer & );
+  SpareServer &operator=( const SpareServer & );
+
+public:
+  SpareServer( const char *s_desired_ip, const char *s_desired_port, int s_workers, bool s_verbose )
+    : desired_ip( s_desired_ip ), desired_port( s_desired_port ), workers( s_workers ),
+      verbose( s_verbose ), host( NULL ), session( NULL )
+  {}
+
+  ~SpareServer() { delete host; }
+
+  string prepare( void )
+  {
+    ignore_signals();
+    host = new SessionHost( workers );
+    string announcement;
+    session = add_session( *host, desired_ip, desired_port, verbose, announcement );
+    return announcement;
+  }
 
-  #ifdef HAVE_UTEMPTER
-  bool connected_utmp = false;
+  void serve( void )
+  {
+    /* the client only now learns of us */
+    freeze_timestamp();
+    session->start_waiting();
+    host->run();
+  }
+};
 
-  struct in_addr saved_addr;
-  saved_addr.s_addr = 0;
-  #endif
+int run_server( const char *desired_ip, const char *desired_port,
+                const string &command_path, char *command_argv[],
+                const int colors, bool verbose, bool with_motd, int workers,
+                int sessions, bool share_port, int threads, const char *upgrade_path,
+                bool pool_mode, const char *pool_path, int spares ) {
+  if ( pool_mode ) {
+    SpareServer spare( desired_ip, desired_port, workers, verbose );
+    WarmPool pool( pool_path, spares, spare );
+    ignore_signals();
+    fprintf( stderr, "mmserver: keeping %d spare sessions ready at %s\n", spares, pool_path );
+    pool.run();
+    return 0;
+  }
 
-  while ( 1 ) {
+  if ( pool_path ) {
+    /* one that is ready and waiting, if the pool there has one */
+    string announcement;
+    pid_t server;
     try {
-      uint64_t now = Network::timestamp();
-
-      const int timeout_if_no_client = 60000;
-      int timeout = network.wait_time();
-      if ( (!network.get_remote_state_num())
-           || network.shutdown_in_progress() ) {
-        timeout = min( timeout, 5000 );
-      }
-
-      /* poll for events */
-      sel.clear_fds();
-      std::vector< int > fd_list( network.fds() );
-      assert( fd_list.size() == 1 ); /* servers don't hop */
-      int network_fd = fd_list.back();
-      sel.add_fd( network_fd );
-
-      int active_fds = sel.select( timeout );
-      if ( active_fds < 0 ) {
-        perror( "select" );
-        break;
-      }
-
-      now = Network::timestamp();
-      uint64_t time_since_remote_state = now - network.get_latest_remote_state().timestamp;
-
-      if ( sel.read( network_fd ) ) {
-        /* packet received from the network */
-        network.recv();
-        
-        /* is new user input available for the terminal? */
-        if ( network.get_remote_state_num() != last_remote_num ) {
-          last_remote_num = network.get_remote_state_num();
-          
-          Term::CommandStream command_stream;
-          command_stream.apply_string(network.get_remote_diff());
-          for (size_t i = 0; i < command_stream.size(); i++) {
-            const string *action = command_stream.get_action(i);
-            terminal.push_back(*action);
-          }
-
-          /* update client with new state of terminal */
-          if ( !network.shutdown_in_progress() ) {
-            network.set_current_state( terminal );
-          }
-        }
-      }
-
-      if ( sel.any_signal() ) {
-        /* shutdown signal */
-        if ( network.has_remote_addr() && (!network.shutdown_in_progress()) ) {
-          network.start_shutdown();
-        } else {
-          break;
-        }
-      }
-      
-      if ( sel.error( network_fd ) ) {
-        /* network problem */
-        break;
-      }
-
-      /* quit if our shutdown has been acknowledged */
-      if ( network.shutdown_in_progress() && network.shutdown_acknowledged() ) {
-        break;
-      }
-
-      /* quit after shutdown acknowledgement timeout */
-      if ( network.shutdown_in_progress() && network.shutdown_ack_timed_out() ) {
-        break;
+      if ( WarmPool::take( pool_path, announcement, server ) ) {
+        fputs( announcement.c_str(), stdout );
+        fflush( stdout );
+        print_banner( server );
+        return 0;
       }
+    } catch ( const Network::NetworkException &e ) {
+      fprintf( stderr, "Not using the pool at %s: %s: %s\n", pool_path,
+               e.function.c_str(), strerror( e.the_errno ) );
+    }
+  }
 
-      /* quit if we received and acknowledged a shutdown request */
-      if ( network.counterparty_shutdown_ack_sent() ) {
-        break;
-      }
+  if ( threads > 1 ) {
+    ShardedHost host( threads, workers );
+    serve( host, desired_ip, desired_port, verbose, sessions, share_port );
+  } else {
+    SessionHost host( workers );
 
-      if ( !network.get_remote_state_num()
-           && time_since_remote_state >= uint64_t( timeout_if_no_client ) ) {
-        fprintf( stderr, "No connection within %d seconds.\n",
-                 timeout_if_no_client / 1000 );
-        break;
-      }
+    /* an upgrade: carry on with the sessions of the server there */
+    bool took_over = upgrade_path && host.take_over( upgrade_path ) >= 0;
+    if ( upgrade_path && !host.listen_for_successor( upgrade_path ) ) {
+      fprintf( stderr, "Not listening for upgrades at %s: %s\n", upgrade_path, strerror( errno ) );
+    }
 
-      network.tick();
-    } catch ( const Network::NetworkException& e ) {
-      fprintf( stderr, "%s: %s\n", e.function.c_str(), strerror( e.the_errno ) );
-      spin();
-    } catch ( const Crypto::CryptoException& e ) {
-      if ( e.fatal ) {
-        throw;
-      } else {
-        fprintf( stderr, "Crypto exception: %s\n", e.text.c_str() );
-      }
+    if ( took_over ) {
+      serve( host, desired_ip, desired_port, verbose, 0, false );
+    } else {
+      serve( host, desired_ip, desired_port, verbose, sessions, share_port );
     }
   }
+
+  printf( "\n[mosh-server is exiting.]\n" );
+
+  return 0;
 }
 
 /* OpenSSH prints the motd on startup, so we will too */
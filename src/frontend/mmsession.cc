@@ -0,0 +1,968 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+
+#include "config.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/resource.h>
+#ifdef HAVE_MALLOC_TRIM
+#include <malloc.h>
+#endif
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "mmsession.h"
+#include "fatal_assert.h"
+#include "timestamp.h"
+
+#include "networktransport.cc"
+#include "handoff.pb.h"
+
+using namespace std;
+
+/* Simple spinloop */
+static void spin( void )
+{
+  static __thread unsigned int spincount = 0;
+  spincount++;
+
+  if ( spincount > 10 ) {
+    struct timespec req;
+    req.tv_sec = 0;
+    req.tv_nsec = 100000000; /* 0.1 sec */
+    nanosleep( &req, NULL );
+    freeze_timestamp();
+  }
+}
+
+/* The signal number a SignalType command carries, or 0 if it is not one. */
+static int parse_signal( const string &payload )
+{
+  char *end;
+  errno = 0;
+  long signum = strtol( payload.c_str(), &end, 10 );
+  if ( errno != 0 || payload.empty() || *end != '\0' || signum <= 0 || signum >= NSIG ) {
+    return 0;
+  }
+  return signum;
+}
+
+MMSession::MMSession( uint64_t s_id, Executor &s_executor,
+                      const char *desired_ip, const char *desired_port )
+  : id( s_id ), executor( s_executor ), network( NULL ), failed( false ),
+    last_remote_num( 0 ), next_command( 0 ), absorbed_bytes( 0 ), running_bytes(),
+    reported_output( 0 ),
+    timer( this ), last_active( Network::timestamp() ), holding( false ), held()
+{
+  Term::TerminalResults blank_terminal;
+  Term::CommandStream blank_stream;
+  network = new ServerTransport( blank_terminal, blank_stream, desired_ip, desired_port );
+  last_remote_num = network->get_remote_state_num();
+}
+
+MMSession::MMSession( uint64_t s_id, Executor &s_executor, Network::SharedPort &port )
+  : id( s_id ), executor( s_executor ), network( NULL ), failed( false ),
+    last_remote_num( 0 ), next_command( 0 ), absorbed_bytes( 0 ), running_bytes(),
+    reported_output( 0 ),
+    timer( this ), last_active( Network::timestamp() ), holding( false ), held()
+{
+  Term::TerminalResults blank_terminal;
+  Term::CommandStream blank_stream;
+  network = new ServerTransport( blank_terminal, blank_stream, port );
+  last_remote_num = network->get_remote_state_num();
+}
+
+MMSession::MMSession( const HandoffBuffers::Session &saved, Executor &s_executor, int fd )
+  : id( saved.id() ), executor( s_executor ), network( NULL ), failed( false ),
+    last_remote_num( 0 ), next_command( 0 ), absorbed_bytes( 0 ), running_bytes(),
+    reported_output( 0 ),
+    timer( this ), last_active( 0 ), holding( true ), held()
+{
+  network = new ServerTransport( saved.transport(), fd );
+  restore( saved );
+}
+
+MMSession::MMSession( const HandoffBuffers::Session &saved, Executor &s_executor,
+                      Network::SharedPort &port )
+  : id( saved.id() ), executor( s_executor ), network( NULL ), failed( false ),
+    last_remote_num( 0 ), next_command( 0 ), absorbed_bytes( 0 ), running_bytes(),
+    reported_output( 0 ),
+    timer( this ), last_active( 0 ), holding( true ), held()
+{
+  network = new ServerTransport( saved.transport(), port );
+  restore( saved );
+}
+
+void MMSession::restore( const HandoffBuffers::Session &saved )
+{
+  /* the other process had taken every command it received */
+  last_remote_num = network->get_remote_state_num();
+  next_command = saved.next_command();
+  absorbed_bytes = saved.absorbed_bytes();
+  last_active = saved.last_active();
+
+  for ( int i = 0; i < saved.held_size(); i++ ) {
+    const HandoffBuffers::HeldCommand &command = saved.held( i );
+    held.push_back( HeldCommand( command.command(), command.line(), command.urgent() ) );
+    running_bytes[ command.command() ] = command.counted_bytes();
+  }
+}
+
+void MMSession::save( HandoffBuffers::Session &saved ) const
+{
+  assert( !running() );
+
+  saved.set_id( id );
+  saved.set_next_command( next_command );
+  saved.set_absorbed_bytes( absorbed_bytes );
+  saved.set_last_active( last_active );
+
+  for ( vector< HeldCommand >::const_iterator i = held.begin(); i != held.end(); i++ ) {
+    HandoffBuffers::HeldCommand *command = saved.add_held();
+    command->set_command( i->command );
+    command->set_line( i->line );
+    command->set_urgent( i->urgent );
+    command->set_counted_bytes( running_bytes.find( i->command )->second );
+  }
+
+  network->save( *saved.mutable_transport() );
+}
+
+MMSession::~MMSession()
+{
+  executor.cancel( id );
+  delete network;
+}
+
+int MMSession::fd( void ) const
+{
+  std::vector< int > fd_list( network->fds() );
+  if ( fd_list.empty() ) {
+    return -1;
+  }
+  assert( fd_list.size() == 1 ); /* servers don't hop */
+  return fd_list.back();
+}
+
+void MMSession::failure( const Network::NetworkException &e )
+{
+  fprintf( stderr, "%s: %s\n", e.function.c_str(), strerror( e.the_errno ) );
+  spin();
+}
+
+void MMSession::failure( const Crypto::CryptoException &e )
+{
+  fprintf( stderr, "Crypto exception: %s\n", e.text.c_str() );
+  if ( e.fatal ) {
+    failed = true;
+  }
+}
+
+void MMSession::recv( const Network::Datagram *datagram )
+{
+  /* our own socket: every datagram waiting, even past a bad one */
+  do {
+    try {
+      /* packet received from the network */
+      if ( datagram ) {
+        network->recv( *datagram );
+      } else {
+        network->recv();
+      }
+
+      /* are there new commands? */
+      if ( network->get_remote_state_num() != last_remote_num ) {
+        last_remote_num = network->get_remote_state_num();
+        take_commands();
+      }
+    } catch ( const Network::NetworkException &e ) {
+      failure( e );
+    } catch ( const Crypto::CryptoException &e ) {
+      failure( e );
+    }
+  } while ( !datagram && !failed && network->pending() );
+}
+
+void MMSession::take_commands( void )
+{
+  Term::CommandStream command_stream;
+  command_stream.apply_string( network->get_remote_diff() );
+
+  /* a new state with nothing in it is only a keepalive */
+  for ( int p = 0; p < Term::NUM_PRIORITIES; p++ ) {
+    if ( !command_stream.empty( Term::Priority( p ) ) ) {
+      wake();
+      break;
+    }
+  }
+
+  /* high-priority commands first, and ahead of whatever the
+     workers have queued */
+  for ( int p = Term::NUM_PRIORITIES - 1; p >= 0; p-- ) {
+    const Term::Priority priority = Term::Priority( p );
+    const bool urgent = priority != Term::NormalPriority;
+
+    for ( size_t i = 0; i < command_stream.size( priority ); i++ ) {
+      const Term::Command *action = command_stream.get_action( i, priority );
+      if ( action->type == Term::SignalType ) {
+        int signum = parse_signal( action->str() );
+        if ( signum ) {
+          executor.signal( id, signum );
+        }
+        continue;
+      }
+
+      /* only the normal lane is under flow control */
+      size_t counted_bytes = urgent ? 0 : action->size();
+
+      /* command lines go to the workers; data is just echoed */
+      if ( action->type == Term::GeneralType ) {
+        running_bytes[ next_command ] = counted_bytes;
+        submit( next_command, action->str(), urgent );
+      } else {
+        absorbed_bytes += counted_bytes;
+        if ( !network->shutdown_in_progress() ) {
+          Term::TerminalResults &results = network->get_current_state();
+          results.append_output( next_command, action->str() );
+          results.finish( next_command, 0 );
+        }
+      }
+      next_command++;
+    }
+  }
+}
+
+void MMSession::submit( uint64_t command, const string &line, bool urgent )
+{
+  if ( holding ) {
+    held.push_back( HeldCommand( command, line, urgent ) );
+  } else {
+    executor.submit( id, command, line, urgent );
+  }
+}
+
+void MMSession::release( void )
+{
+  holding = false;
+  for ( vector< HeldCommand >::const_iterator i = held.begin(); i != held.end(); i++ ) {
+    executor.submit( id, i->command, i->line, i->urgent );
+  }
+  held.clear();
+}
+
+void MMSession::collect( const Executor::Result &result )
+{
+  assert( result.session == id );
+  wake();
+
+  if ( result.finished ) {
+    map< uint64_t, size_t >::iterator i = running_bytes.find( result.command );
+    assert( i != running_bytes.end() );
+    absorbed_bytes += i->second;
+    running_bytes.erase( i );
+  }
+  if ( network->shutdown_in_progress() ) {
+    account_output( result.output.size() );
+    return;
+  }
+
+  /* appending in place lets the transport drop the results once
+     they are acknowledged */
+  Term::TerminalResults &results = network->get_current_state();
+  if ( result.finished ) {
+    results.finish( result.command, result.exit_status );
+  } else {
+    results.append_output( result.command, result.output );
+  }
+  account_output( result.output.size() );
+}
+
+/* Tell the executor that we took in collected more bytes of output
+   and how much of it the client has yet to acknowledge. Once shutting
+   down we send no more output, so none of it holds the workers back. */
+void MMSession::account_output( size_t collected )
+{
+  size_t unacknowledged = 0;
+  if ( !network->shutdown_in_progress() ) {
+    unacknowledged = network->get_current_state().get_bytes();
+  }
+  if ( collected > 0 || unacknowledged != reported_output ) {
+    executor.account( id, collected, unacknowledged );
+    reported_output = unacknowledged;
+  }
+}
+
+int MMSession::wait_time( void )
+{
+  int timeout = network->wait_time();
+  if ( (!network->get_remote_state_num())
+       || network->shutdown_in_progress() ) {
+    timeout = min( timeout, 5000 );
+  }
+  return timeout;
+}
+
+void MMSession::tick( void )
+{
+  const uint64_t command_window = Term::TerminalResults::INITIAL_CREDIT;
+  Term::TerminalResults &results = network->get_current_state();
+  if ( !network->shutdown_in_progress()
+       && absorbed_bytes + command_window > results.get_credit() ) {
+    results.set_credit( absorbed_bytes + command_window );
+  }
+
+  try {
+    network->tick();
+  } catch ( const Network::NetworkException &e ) {
+    failure( e );
+  } catch ( const Crypto::CryptoException &e ) {
+    failure( e );
+  }
+
+  /* tick() drops what the client has acknowledged */
+  account_output( 0 );
+}
+
+bool MMSession::hibernate( int idle_ms )
+{
+  if ( network->hibernating()
+       || failed
+       || (!network->get_remote_state_num())
+       || (!network->has_remote_addr())
+       || Network::timestamp() - last_active < uint64_t( idle_ms )
+       || (!running_bytes.empty())
+       || (!network->quiescent()) ) {
+    return false;
+  }
+
+  network->hibernate();
+  return true;
+}
+
+void MMSession::wake( void )
+{
+  last_active = Network::timestamp();
+  network->wake();
+}
+
+bool MMSession::stop( void )
+{
+  wake();
+  if ( network->has_remote_addr() && (!network->shutdown_in_progress()) ) {
+    network->start_shutdown();
+    return true;
+  }
+  return false;
+}
+
+bool MMSession::finished( void )
+{
+  if ( failed ) {
+    return true;
+  }
+
+  /* our shutdown has been acknowledged, or never will be */
+  if ( network->shutdown_in_progress()
+       && (network->shutdown_acknowledged() || network->shutdown_ack_timed_out()) ) {
+    return true;
+  }
+
+  /* we received and acknowledged a shutdown request */
+  if ( network->counterparty_shutdown_ack_sent() ) {
+    return true;
+  }
+
+  uint64_t time_since_remote_state = Network::timestamp() - network->get_latest_remote_state().timestamp;
+  if ( !network->get_remote_state_num()
+       && time_since_remote_state >= uint64_t( TIMEOUT_IF_NO_CLIENT ) ) {
+    fprintf( stderr, "No connection within %d seconds.\n",
+             TIMEOUT_IF_NO_CLIENT / 1000 );
+    return true;
+  }
+
+  return false;
+}
+
+SessionHost::SessionHost( int workers )
+  : loop(), executor( NULL ), shard( 0 ), shards( 1 ), control_fd( -1 ),
+    by_fd(), by_id(), prng(), shared_port( NULL ),
+    timers( Network::timestamp() ), due(),
+    hibernate_after( HIBERNATE_AFTER ), trim_pending( false ), last_trim( 0 ),
+    next_port( 0 ), upgrade_fd( -1 ), successor( NULL ), drain_start( 0 ),
+    base_rss_kb( resident_kb() ), base_cpu_seconds( cpu_seconds() )
+{
+  /* prepare to poll for events */
+  loop.add_signal( SIGTERM );
+  loop.add_signal( SIGINT );
+  loop.add_signal( SIGUSR1 );
+
+  /* started after the signals are blocked, so its threads never take them */
+  executor = new Executor( workers );
+  loop.add_fd( executor->fd(), true ); /* collect() empties it */
+}
+
+SessionHost::SessionHost( int workers, int s_shard, int s_shards, int s_control_fd )
+  : loop(), executor( NULL ), shard( s_shard ), shards( s_shards ), control_fd( s_control_fd ),
+    by_fd(), by_id(), prng(), shared_port( NULL ),
+    timers( Network::timestamp() ), due(),
+    hibernate_after( HIBERNATE_AFTER ), trim_pending( false ), last_trim( 0 ),
+    next_port( 0 ), upgrade_fd( -1 ), successor( NULL ), drain_start( 0 ),
+    base_rss_kb( resident_kb() ), base_cpu_seconds( cpu_seconds() )
+{
+  assert( shard >= 0 && shard < shards );
+
+  /* the ShardedHost has already blocked the signals */
+  executor = new Executor( workers );
+  loop.add_fd( executor->fd(), true );
+  loop.add_fd( control_fd );
+}
+
+SessionHost::~SessionHost()
+{
+  while ( !by_id.empty() ) {
+    remove( by_id.begin()->second );
+  }
+  delete successor;
+  if ( upgrade_fd >= 0 ) {
+    close( upgrade_fd );
+  }
+  delete shared_port;
+  delete executor;
+}
+
+uint64_t SessionHost::new_id( void )
+{
+  uint64_t id;
+  do {
+    id = prng.uint64();
+  } while ( id == 0 /* no id to a client */
+            || by_id.count( id )
+            || Network::SharedPort::steer( id, shards ) != shard );
+  return id;
+}
+
+void SessionHost::share_port( const char *desired_ip, const char *desired_port )
+{
+  share_port( new Network::SharedPort( desired_ip, desired_port ) );
+}
+
+void SessionHost::share_port( Network::SharedPort *port )
+{
+  assert( !shared_port );
+  shared_port = port;
+  loop.add_fd( shared_port->fd() );
+}
+
+MMSession *SessionHost::add_session( const char *desired_ip, const char *desired_port )
+{
+  if ( shared_port ) {
+    MMSession *session = new MMSession( new_id(), *executor, *shared_port );
+    add( session );
+    return session;
+  }
+
+  /* Given a range, start looking where the last session's port was,
+     rather than trying every port that is already taken. */
+  int low, high;
+  string from_next_port;
+  const char *port = desired_port;
+  if ( desired_port
+       && Network::Connection::parse_portrange( desired_port, low, high )
+       && next_port > low && next_port <= high ) {
+    char range[ 32 ];
+    snprintf( range, sizeof( range ), "%d:%d", next_port, high );
+    from_next_port = range;
+    port = from_next_port.c_str();
+  }
+
+  const uint64_t id = new_id();
+  MMSession *session;
+  try {
+    session = new MMSession( id, *executor, desired_ip, port );
+  } catch ( const Network::NetworkException & ) {
+    if ( port == desired_port ) {
+      throw;
+    }
+    /* maybe a port below next_port is free again */
+    session = new MMSession( id, *executor, desired_ip, desired_port );
+  }
+  next_port = session->get_network().port() + 1;
+
+  add( session );
+  return session;
+}
+
+void SessionHost::add( MMSession *session )
+{
+  by_id[ session->get_id() ] = session;
+  if ( session->fd() >= 0 ) {
+    by_fd[ session->fd() ] = session;
+    loop.add_fd( session->fd() );
+  }
+  due.push_back( session );
+}
+
+void SessionHost::remove( MMSession *session )
+{
+  if ( session->fd() >= 0 ) {
+    loop.remove_fd( session->fd() );
+    by_fd.erase( session->fd() );
+  }
+  by_id.erase( session->get_id() );
+  delete session;
+}
+
+/* Hand each datagram waiting on the shared port to its session. */
+void SessionHost::recv_shared( void )
+{
+  Network::Datagram datagram;
+  try {
+    while ( shared_port->recv( datagram ) ) {
+      map< uint64_t, MMSession * >::const_iterator session = by_id.find( datagram.session_id );
+      if ( session != by_id.end() ) {
+        session->second->recv( &datagram );
+        due.push_back( session->second );
+      }
+    }
+  } catch ( const Network::NetworkException &e ) {
+    /* whatever is left is still there for the next wait */
+    fprintf( stderr, "%s: %s\n", e.function.c_str(), strerror( e.the_errno ) );
+  }
+}
+
+void SessionHost::run( void )
+{
+  while ( !by_id.empty() ) {
+    /* sleep until the first deadline, if nothing is due already */
+    int timeout = 0;
+    if ( due.empty() ) {
+      uint64_t next = timers.next_deadline();
+      if ( successor ) {
+        next = min( next, drain_start + HANDOFF_DRAIN );
+      }
+      const uint64_t now = Network::timestamp();
+      timeout = next == uint64_t( -1 ) ? INT_MAX
+        : next > now ? int( min( next - now, uint64_t( INT_MAX ) ) ) : 0;
+    }
+
+    /* poll for events */
+    if ( loop.wait( timeout ) < 0 ) {
+      perror( loop.backend() );
+      break;
+    }
+
+    if ( shared_port && loop.read( shared_port->fd() ) ) {
+      recv_shared();
+    }
+
+    std::vector< int > active( loop.active() );
+    for ( std::vector< int >::const_iterator i = active.begin(); i != active.end(); i++ ) {
+      map< int, MMSession * >::const_iterator session = by_fd.find( *i );
+      if ( session == by_fd.end() ) {
+        continue;
+      }
+      if ( loop.error( *i ) ) {
+        /* network problem */
+        session->second->fail();
+      } else if ( loop.read( *i ) ) {
+        session->second->recv();
+      }
+      due.push_back( session->second );
+    }
+
+    if ( loop.read( executor->fd() ) ) {
+      Executor::Result result;
+      while ( executor->collect( result ) ) {
+        map< uint64_t, MMSession * >::const_iterator session = by_id.find( result.session );
+        if ( session != by_id.end() ) {
+          session->second->collect( result );
+          due.push_back( session->second );
+        }
+      }
+    }
+
+    if ( control_fd >= 0 && loop.read( control_fd ) ) {
+      recv_control();
+    }
+
+    if ( loop.signal( SIGUSR1 ) ) {
+      report( stderr );
+    }
+
+    if ( loop.signal( SIGTERM ) || loop.signal( SIGINT ) ) {
+      if ( successor ) {
+        abandon_handoff( "shutting down" );
+      }
+      stop_all();
+    }
+
+    if ( upgrade_fd >= 0 && loop.read( upgrade_fd ) ) {
+      accept_successor();
+    }
+
+    timers.advance( Network::timestamp(), due );
+    visit_due();
+
+    if ( successor ) {
+      continue_handoff();
+    }
+  }
+}
+
+/* Tick each session that is due, or remove it if it has finished,
+   and put it back in the wheel for its next deadline. The rest are
+   left alone: nothing has happened to them, and their deadlines are
+   not up. */
+void SessionHost::visit_due( void )
+{
+  /* a session may have had several datagrams and results */
+  sort( due.begin(), due.end() );
+  due.erase( unique( due.begin(), due.end() ), due.end() );
+
+  const uint64_t now = Network::timestamp();
+  for ( vector< MMSession * >::const_iterator i = due.begin(); i != due.end(); i++ ) {
+    MMSession *session = *i;
+    if ( !session->finished() ) {
+      session->tick();
+    }
+    if ( session->finished() ) {
+      remove( session );
+      continue;
+    }
+
+    if ( hibernate_after > 0 && session->hibernate( hibernate_after ) ) {
+      trim_pending = true;
+    }
+
+    int wait = session->wait_time();
+    if ( wait == INT_MAX ) {
+      /* not until the client is heard from again */
+      timers.cancel( session->get_timer() );
+    } else {
+      timers.schedule( session->get_timer(), now + wait );
+    }
+  }
+  due.clear();
+
+  trim();
+}
+
+/* Give the memory hibernating sessions let go of back to the system,
+   at most once a second, as it means a walk over the whole heap. */
+void SessionHost::trim( void )
+{
+  const uint64_t TRIM_INTERVAL = 1000;
+  if ( !trim_pending || Network::timestamp() - last_trim < TRIM_INTERVAL ) {
+    return;
+  }
+#ifdef HAVE_MALLOC_TRIM
+  malloc_trim( 0 );
+#endif
+  trim_pending = false;
+  last_trim = Network::timestamp();
+}
+
+/* shutdown signal */
+void SessionHost::stop_all( void )
+{
+  for ( map< uint64_t, MMSession * >::const_iterator i = by_id.begin(); i != by_id.end(); i++ ) {
+    if ( !i->second->stop() ) {
+      i->second->fail();
+    }
+    due.push_back( i->second );
+  }
+}
+
+bool SessionHost::listen_for_successor( const char *path )
+{
+  assert( upgrade_fd < 0 && control_fd < 0 );
+  upgrade_fd = HandoffChannel::listen( path );
+  if ( upgrade_fd < 0 ) {
+    return false;
+  }
+  loop.add_fd( upgrade_fd );
+  return true;
+}
+
+/* A successor has come to take over: until our sessions have finished
+   the commands they are running, they hold new ones back. */
+void SessionHost::accept_successor( void )
+{
+  HandoffChannel *channel = HandoffChannel::accept( upgrade_fd );
+  if ( !channel ) {
+    return;
+  }
+  if ( successor ) {
+    delete channel; /* one at a time */
+    return;
+  }
+
+  successor = channel;
+  drain_start = Network::timestamp();
+  for ( map< uint64_t, MMSession * >::const_iterator i = by_id.begin(); i != by_id.end(); i++ ) {
+    i->second->hold();
+  }
+}
+
+void SessionHost::continue_handoff( void )
+{
+  for ( map< uint64_t, MMSession * >::const_iterator i = by_id.begin(); i != by_id.end(); i++ ) {
+    if ( i->second->running() ) {
+      if ( Network::timestamp() - drain_start >= uint64_t( HANDOFF_DRAIN ) ) {
+        abandon_handoff( "commands still running" );
+      }
+      return;
+    }
+  }
+
+  hand_off();
+}
+
+/* Pass the sockets and every session to the successor, and once it
+   has set them up, leave them to it. The sockets keep the datagrams
+   that arrive meanwhile, so the clients see at most a pause. */
+void SessionHost::hand_off( void )
+{
+  freeze_timestamp();
+  const uint64_t paused_at = Network::timestamp();
+  successor->set_timeout( HANDOFF_PAUSE );
+
+  HandoffBuffers::Handoff handoff;
+  vector< int > fds;
+  handoff.set_pid( getpid() );
+  if ( shared_port ) {
+    handoff.set_shared_port( true );
+    fds.push_back( shared_port->fd() );
+  }
+  for ( map< uint64_t, MMSession * >::const_iterator i = by_id.begin(); i != by_id.end(); i++ ) {
+    MMSession *session = i->second;
+    if ( session->finished() ) {
+      continue;
+    }
+    session->save( *handoff.add_session() );
+    if ( !shared_port ) {
+      fds.push_back( session->fd() );
+    }
+  }
+
+  char ready;
+  if ( !successor->send( handoff.SerializeAsString(), fds )
+       || !successor->recv_byte( ready ) || ready != HandoffChannel::READY
+       || !successor->send_byte( HandoffChannel::GO ) ) {
+    abandon_handoff( "no answer from the new process" );
+    return;
+  }
+
+  /* It may have given up waiting just as we said go. Then it hangs up
+     without keeping the sessions, and they are still ours. */
+  char done;
+  successor->set_timeout( HANDOFF_PAUSE );
+  if ( !successor->recv_byte( done ) || done != HandoffChannel::DONE ) {
+    abandon_handoff( "the new process gave up" );
+    return;
+  }
+
+  freeze_timestamp();
+  fprintf( stderr, "mmserver: handed over %d sessions; drained in %d ms, paused %d ms\n",
+           handoff.session_size(), int( paused_at - drain_start ),
+           int( Network::timestamp() - paused_at ) );
+
+  /* the successor serves them now; let go without a word to the clients */
+  delete successor;
+  successor = NULL;
+  while ( !by_id.empty() ) {
+    remove( by_id.begin()->second );
+  }
+}
+
+void SessionHost::abandon_handoff( const char *why )
+{
+  fprintf( stderr, "mmserver: not handing over: %s\n", why );
+  delete successor;
+  successor = NULL;
+
+  for ( map< uint64_t, MMSession * >::const_iterator i = by_id.begin(); i != by_id.end(); i++ ) {
+    i->second->release();
+    due.push_back( i->second );
+  }
+}
+
+int SessionHost::take_over( const char *path )
+{
+  assert( by_id.empty() && !shared_port );
+
+  HandoffChannel *predecessor = HandoffChannel::connect( path );
+  if ( !predecessor ) {
+    return -1;
+  }
+  predecessor->set_timeout( HANDOFF_DRAIN + HANDOFF_PAUSE );
+
+  string message;
+  vector< int > fds;
+  HandoffBuffers::Handoff handoff;
+  bool received = predecessor->recv( message, fds ) && handoff.ParseFromString( message );
+  if ( received ) {
+    size_t expected = handoff.shared_port() ? 1 : handoff.session_size();
+    received = fds.size() == expected;
+  }
+  if ( !received ) {
+    for ( vector< int >::const_iterator i = fds.begin(); i != fds.end(); i++ ) {
+      close( *i );
+    }
+    delete predecessor;
+    throw Network::NetworkException( string( "take over from " ) + path, ECONNABORTED );
+  }
+
+  freeze_timestamp();
+  const uint64_t start = Network::timestamp();
+  predecessor->set_timeout( HANDOFF_PAUSE );
+
+  if ( handoff.shared_port() ) {
+    share_port( new Network::SharedPort( fds[ 0 ] ) );
+  }
+  for ( int i = 0; i < handoff.session_size(); i++ ) {
+    const HandoffBuffers::Session &saved = handoff.session( i );
+    if ( shared_port ) {
+      add( new MMSession( saved, *executor, *shared_port ) );
+    } else {
+      add( new MMSession( saved, *executor, fds[ i ] ) );
+    }
+  }
+
+  /* until it says go and hears that we kept them, the sessions are
+     still the other process's */
+  char go;
+  bool taken = predecessor->send_byte( HandoffChannel::READY )
+    && predecessor->recv_byte( go ) && go == HandoffChannel::GO
+    && predecessor->send_byte( HandoffChannel::DONE );
+  delete predecessor;
+  if ( !taken ) {
+    while ( !by_id.empty() ) {
+      remove( by_id.begin()->second );
+    }
+    throw Network::NetworkException( string( "take over from " ) + path, ECONNABORTED );
+  }
+
+  for ( map< uint64_t, MMSession * >::const_iterator i = by_id.begin(); i != by_id.end(); i++ ) {
+    i->second->release();
+  }
+
+  freeze_timestamp();
+  fprintf( stderr, "mmserver: took over %d sessions from pid %d, set up in %d ms\n",
+           handoff.session_size(), handoff.pid(), int( Network::timestamp() - start ) );
+  return handoff.session_size();
+}
+
+void SessionHost::recv_control( void )
+{
+  char messages[ 64 ];
+  ssize_t len = read( control_fd, messages, sizeof( messages ) );
+  for ( ssize_t i = 0; i < len; i++ ) {
+    if ( messages[ i ] == STOP ) {
+      stop_all();
+    } else if ( messages[ i ] == REPORT ) {
+      report( stderr );
+    }
+  }
+}
+
+long SessionHost::resident_kb( void )
+{
+  FILE *statm = fopen( "/proc/self/statm", "r" );
+  if ( !statm ) {
+    return -1;
+  }
+  long size, resident;
+  int fields = fscanf( statm, "%ld %ld", &size, &resident );
+  fclose( statm );
+  if ( fields != 2 ) {
+    return -1;
+  }
+  return resident * (sysconf( _SC_PAGESIZE ) / 1024);
+}
+
+double SessionHost::cpu_seconds( void )
+{
+  struct rusage usage;
+  if ( getrusage( RUSAGE_SELF, &usage ) < 0 ) {
+    return 0;
+  }
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+    + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+double SessionHost::thread_cpu_seconds( void )
+{
+  struct timespec tp;
+  if ( clock_gettime( CLOCK_THREAD_CPUTIME_ID, &tp ) < 0 ) {
+    return 0;
+  }
+  return tp.tv_sec + tp.tv_nsec / 1e9;
+}
+
+void SessionHost::report( FILE *out ) const
+{
+  size_t hibernating = 0;
+  for ( map< uint64_t, MMSession * >::const_iterator i = by_id.begin(); i != by_id.end(); i++ ) {
+    if ( i->second->hibernating() ) {
+      hibernating++;
+    }
+  }
+
+  if ( control_fd >= 0 ) {
+    fprintf( out, "mmserver thread %d: %lu sessions (%lu hibernating), %.3f s CPU\n",
+             shard, (unsigned long)by_id.size(), (unsigned long)hibernating,
+             thread_cpu_seconds() );
+    return;
+  }
+
+  long rss_kb = resident_kb();
+  double cpu = cpu_seconds();
+  size_t sessions = by_id.size();
+
+  fprintf( out, "mmserver: %lu sessions (%lu hibernating), %ld kB resident, %.3f s CPU",
+           (unsigned long)sessions, (unsigned long)hibernating, rss_kb, cpu );
+  if ( sessions > 0 && rss_kb >= 0 && base_rss_kb >= 0 ) {
+    fprintf( out, "; per session %.1f kB, %.3f ms CPU",
+             double( rss_kb - base_rss_kb ) / sessions,
+             1000 * (cpu - base_cpu_seconds) / sessions );
+  }
+  fprintf( out, "\n" );
+}
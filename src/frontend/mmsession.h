@@ -0,0 +1,315 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+
+#ifndef MMSESSION_HPP
+#define MMSESSION_HPP
+
+#include <stdint.h>
+#include <stdio.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "networktransport.h"
+#include "commandstream.h"
+#include "terminalresults.h"
+#include "eventloop.h"
+#include "executor.h"
+#include "prng.h"
+#include "timerwheel.h"
+#include "handoff.h"
+
+namespace HandoffBuffers {
+  class Session;
+}
+
+/* One client's session of mmserver: its Transport, with its own key and
+   either its own socket or a SharedPort, and the bookkeeping for the
+   commands the client has sent. The commands run on an Executor that
+   may serve other sessions too. */
+class MMSession {
+public:
+  typedef Network::Transport< Term::TerminalResults, Term::CommandStream > ServerTransport;
+
+  /* ms to wait for a client before giving up on the session */
+  static const int TIMEOUT_IF_NO_CLIENT = 60000;
+
+private:
+  uint64_t id;
+  Executor &executor;
+  ServerTransport *network;
+
+  /* a fatal error has ended the session */
+  bool failed;
+
+  uint64_t last_remote_num;
+
+  /* number of the next command we take from the client, counting
+     both lanes but not signals; it is the command's number in the
+     normal lane as long as the high-priority one carries only signals */
+  uint64_t next_command;
+
+  /* Flow control: the client may send this far past what we have
+     finished with. Commands still waiting for or on a worker count
+     against it. */
+  uint64_t absorbed_bytes;
+  std::map< uint64_t, size_t > running_bytes;
+
+  /* Flow control the other way: the output of our commands that the
+     client has yet to acknowledge, as last told to the executor */
+  size_t reported_output;
+
+  /* when wait_time() was last up, in our SessionHost's wheel */
+  TimerWheel< MMSession >::Timer timer;
+
+  /* when the client last sent a command or a command last had output */
+  uint64_t last_active;
+
+  /* While another process gets ready to take over from us, commands
+     wait here, and count against the client in running_bytes, rather
+     than start on a worker. */
+  class HeldCommand {
+  public:
+    uint64_t command;
+    std::string line;
+    bool urgent;
+
+    HeldCommand( uint64_t s_command, const std::string &s_line, bool s_urgent )
+      : command( s_command ), line( s_line ), urgent( s_urgent ) {}
+  };
+  bool holding;
+  std::vector< HeldCommand > held;
+
+  void wake( void );
+  void submit( uint64_t command, const std::string &line, bool urgent );
+  void restore( const HandoffBuffers::Session &saved );
+
+  void take_commands( void );
+  void account_output( size_t collected );
+  void failure( const Network::NetworkException &e );
+  void failure( const Crypto::CryptoException &e );
+
+  /* not implemented */
+  MMSession( const MMSession & );
+  MMSession &operator=( const MMSession & );
+
+public:
+  MMSession( uint64_t s_id, Executor &s_executor,
+             const char *desired_ip, const char *desired_port );
+  /* on a shared port, where the client sends s_id with each datagram */
+  MMSession( uint64_t s_id, Executor &s_executor, Network::SharedPort &port );
+  /* Taken over from another process, on the socket it passed us or on
+     port. Commands it had not started are held until release(). */
+  MMSession( const HandoffBuffers::Session &saved, Executor &s_executor, int fd );
+  MMSession( const HandoffBuffers::Session &saved, Executor &s_executor,
+             Network::SharedPort &port );
+  ~MMSession();
+
+  uint64_t get_id( void ) const { return id; }
+  ServerTransport &get_network( void ) { return *network; }
+  /* our own socket, or -1 if we are on a SharedPort */
+  int fd( void ) const;
+
+  /* Our socket is readable, or datagram was read for us off our
+     SharedPort. */
+  void recv( const Network::Datagram *datagram = NULL );
+
+  /* a result of one of our commands */
+  void collect( const Executor::Result &result );
+
+  int wait_time( void );
+  void tick( void );
+  TimerWheel< MMSession >::Timer &get_timer( void ) { return timer; }
+
+  /* Asked to stop: start shutting down. Returns false if the session
+     should instead end at once. */
+  bool stop( void );
+
+  /* If nothing has happened for idle_ms and nothing is in flight,
+     let go of all the state we can and send keepalives less often,
+     until the client next sends a command. Returns true if we did. */
+  bool hibernate( int idle_ms );
+  bool hibernating( void ) const { return network->hibernating(); }
+
+  /* Made ahead of time, as by a WarmPool: start waiting for the
+     client from now. */
+  void start_waiting( void ) { network->start_waiting(); last_active = Network::timestamp(); }
+
+  /* Hold new commands back from the workers, until release() starts
+     them. Once no command is running, the session may be saved for
+     another process to carry on with, and then deleted. */
+  void hold( void ) { holding = true; }
+  void release( void );
+  bool running( void ) const { return running_bytes.size() > held.size(); }
+  void save( HandoffBuffers::Session &saved ) const;
+
+  /* end the session, e.g. because its socket failed */
+  void fail( void ) { failed = true; }
+
+  /* whether the session is over and may be deleted */
+  bool finished( void );
+};
+
+/* Runs any number of sessions in one process, multiplexed on one
+   EventLoop and sharing one pool of workers. Each session has its own
+   key and Transport, and either its own socket or, once share_port()
+   is called, the one SharedPort.
+
+   It may also be one shard of a ShardedHost, serving its share of the
+   sessions on a thread of its own. The ShardedHost then takes the
+   signals and passes them on as messages. */
+class SessionHost {
+public:
+  /* default for set_hibernate_after() */
+  static const int HIBERNATE_AFTER = 30000;
+
+  /* ms that our sessions may take to finish the commands they are
+     running when a successor comes to take them over, and then that
+     the handoff may pause them for */
+  static const int HANDOFF_DRAIN = 2000;
+  static const int HANDOFF_PAUSE = 2000;
+
+  /* messages from a ShardedHost */
+  static const char STOP = 'S';
+  static const char REPORT = 'R';
+
+private:
+  EventLoop loop;
+  Executor *executor; /* started once loop has blocked the signals */
+
+  /* which shard we are, of how many; the ids we give out steer our
+     clients' datagrams to our socket of a group of SharedPorts */
+  int shard, shards;
+
+  /* where a ShardedHost's messages come from, or -1 if we take the
+     signals ourselves */
+  int control_fd;
+
+  /* sessions are found by id, which is random so that a client of
+     an earlier server on a SharedPort does not reach a new session */
+  std::map< int, MMSession * > by_fd;
+  std::map< uint64_t, MMSession * > by_id;
+  PRNG prng;
+
+  Network::SharedPort *shared_port;
+
+  /* Each session's next deadline, when it must be ticked even if
+     nothing happens to it; and the sessions to visit this time
+     round, whose deadline is up or which had something happen. */
+  TimerWheel< MMSession > timers;
+  std::vector< MMSession * > due;
+
+  /* ms a session may be idle before it hibernates, or 0 for never */
+  int hibernate_after;
+  /* sessions have hibernated, but their memory has not been trimmed */
+  bool trim_pending;
+  uint64_t last_trim;
+
+  /* next port to try, when given a range to pick ports from */
+  int next_port;
+
+  /* where a successor may connect to take over from us, or -1; and
+     one that has, while our sessions finish their commands */
+  int upgrade_fd;
+  HandoffChannel *successor;
+  uint64_t drain_start;
+
+  /* what the process used before it had any sessions */
+  long base_rss_kb;
+  double base_cpu_seconds;
+
+  uint64_t new_id( void );
+  void add( MMSession *session );
+  void remove( MMSession *session );
+  void recv_shared( void );
+  void recv_control( void );
+  void stop_all( void );
+  void visit_due( void );
+  void trim( void );
+  void accept_successor( void );
+  void continue_handoff( void );
+  void hand_off( void );
+  void abandon_handoff( const char *why );
+
+  /* not implemented */
+  SessionHost( const SessionHost & );
+  SessionHost &operator=( const SessionHost & );
+
+public:
+  SessionHost( int workers );
+  /* as shard s_shard of s_shards, taking messages from s_control_fd */
+  SessionHost( int workers, int s_shard, int s_shards, int s_control_fd );
+  ~SessionHost();
+
+  /* Bind one port, to desired_ip and within the range desired_port
+     if given, for all sessions added from now on. Throws
+     NetworkException if it cannot. */
+  void share_port( const char *desired_ip, const char *desired_port );
+  /* the same with a port already bound, which we then own */
+  void share_port( Network::SharedPort *port );
+  bool sharing_port( void ) const { return shared_port != NULL; }
+
+  /* Start a session on the shared port, or else bound to desired_ip
+     and to a port in the range desired_port, if given. Throws
+     NetworkException if it cannot. */
+  MMSession *add_session( const char *desired_ip, const char *desired_port );
+
+  size_t size( void ) const { return by_id.size(); }
+
+  /* Live upgrade. A new process takes over every session of the one
+     listening at path, if there is one, with the sockets it passes
+     over, and carries on where it left off; returns how many, or -1 if
+     no one listens there. Throws NetworkException if the other process
+     does not hand them over. */
+  int take_over( const char *path );
+  /* From now on, let a new process take over by connecting to path.
+     Returns false, with errno set, if we cannot listen there. */
+  bool listen_for_successor( const char *path );
+
+  /* Let sessions idle for ms hibernate, or none if ms is 0. */
+  void set_hibernate_after( int ms ) { hibernate_after = ms; }
+
+  /* Serve until every session has ended. */
+  void run( void );
+
+  /* Print the memory and CPU time used, in total and per session.
+     As a shard, print our sessions and the CPU time of our thread. */
+  void report( FILE *out ) const;
+
+  /* resident set size of this process, in kB, or -1 if unknown */
+  static long resident_kb( void );
+  static double cpu_seconds( void );
+  static double thread_cpu_seconds( void );
+};
+
+#endif
@@ -0,0 +1,174 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include "shardedhost.h"
+#include "fatal_assert.h"
+
+using namespace std;
+
+static void make_pipe( int fds[ 2 ] )
+{
+  fatal_assert( pipe( fds ) == 0 );
+  for ( int i = 0; i < 2; i++ ) {
+    fatal_assert( fcntl( fds[ i ], F_SETFD, FD_CLOEXEC ) == 0 );
+    fatal_assert( fcntl( fds[ i ], F_SETFL, fcntl( fds[ i ], F_GETFL ) | O_NONBLOCK ) == 0 );
+  }
+}
+
+ShardedHost::ShardedHost( int threads, int workers )
+  : loop(), shards( threads ), done_pipe(), next_shard( 0 ), sharing( false )
+{
+  fatal_assert( threads > 0 );
+
+  /* blocked before any thread starts, so that only we take them */
+  loop.add_signal( SIGTERM );
+  loop.add_signal( SIGINT );
+  loop.add_signal( SIGUSR1 );
+
+  make_pipe( done_pipe );
+  loop.add_fd( done_pipe[ 0 ] );
+
+  for ( int i = 0; i < threads; i++ ) {
+    Shard &shard = shards[ i ];
+    make_pipe( shard.control_pipe );
+    shard.done_fd = done_pipe[ 1 ];
+    shard.host = new SessionHost( max( 1, workers / threads ), i, threads,
+                                  shard.control_pipe[ 0 ] );
+  }
+}
+
+ShardedHost::~ShardedHost()
+{
+  for ( vector< Shard >::iterator i = shards.begin(); i != shards.end(); i++ ) {
+    delete i->host;
+    close( i->control_pipe[ 0 ] );
+    close( i->control_pipe[ 1 ] );
+  }
+  close( done_pipe[ 0 ] );
+  close( done_pipe[ 1 ] );
+}
+
+void ShardedHost::share_port( const char *desired_ip, const char *desired_port )
+{
+  vector< Network::SharedPort * > group( Network::SharedPort::open_group( desired_ip, desired_port,
+                                                                           shards.size() ) );
+  for ( size_t i = 0; i < shards.size(); i++ ) {
+    shards[ i ].host->share_port( group[ i ] );
+  }
+  sharing = true;
+}
+
+void ShardedHost::set_hibernate_after( int ms )
+{
+  for ( vector< Shard >::iterator i = shards.begin(); i != shards.end(); i++ ) {
+    i->host->set_hibernate_after( ms );
+  }
+}
+
+MMSession *ShardedHost::add_session( const char *desired_ip, const char *desired_port )
+{
+  MMSession *session = shards[ next_shard ].host->add_session( desired_ip, desired_port );
+  next_shard = (next_shard + 1) % shards.size();
+  return session;
+}
+
+void *ShardedHost::shard_main( void *arg )
+{
+  Shard *shard = static_cast< Shard * >( arg );
+  shard->host->run();
+
+  char done = 0;
+  fatal_assert( write( shard->done_fd, &done, 1 ) == 1 );
+  return NULL;
+}
+
+void ShardedHost::tell_shards( char message ) const
+{
+  for ( vector< Shard >::const_iterator i = shards.begin(); i != shards.end(); i++ ) {
+    /* a shard that has finished no longer reads; its pipe may fill */
+    if ( write( i->control_pipe[ 1 ], &message, 1 ) < 0 && errno != EAGAIN ) {
+      perror( "write" );
+    }
+  }
+}
+
+void ShardedHost::run( void )
+{
+  for ( vector< Shard >::iterator i = shards.begin(); i != shards.end(); i++ ) {
+    fatal_assert( pthread_create( &i->thread, NULL, shard_main, &*i ) == 0 );
+  }
+
+  size_t running = shards.size();
+  while ( running > 0 ) {
+    if ( loop.wait( -1 ) < 0 ) {
+      perror( loop.backend() );
+      break;
+    }
+
+    if ( loop.read( done_pipe[ 0 ] ) ) {
+      char done[ 64 ];
+      ssize_t len = read( done_pipe[ 0 ], done, sizeof( done ) );
+      if ( len > 0 ) {
+        running -= len;
+      }
+    }
+
+    if ( loop.signal( SIGUSR1 ) ) {
+      report( stderr );
+    }
+
+    if ( loop.signal( SIGTERM ) || loop.signal( SIGINT ) ) {
+      tell_shards( SessionHost::STOP );
+    }
+  }
+
+  for ( vector< Shard >::iterator i = shards.begin(); i != shards.end(); i++ ) {
+    pthread_join( i->thread, NULL );
+  }
+}
+
+void ShardedHost::report( FILE *out ) const
+{
+  fprintf( out, "mmserver: %lu threads, %ld kB resident, %.3f s CPU\n",
+           (unsigned long)shards.size(), SessionHost::resident_kb(), SessionHost::cpu_seconds() );
+  tell_shards( SessionHost::REPORT );
+}
@@ -0,0 +1,101 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+#ifndef SHARDEDHOST_HPP
+#define SHARDEDHOST_HPP
+
+#include <pthread.h>
+#include <stdio.h>
+#include <vector>
+
+#include "eventloop.h"
+#include "mmsession.h"
+
+/* Serves sessions on several threads. Each thread runs a SessionHost
+   of its own, with its own EventLoop, workers and share of the
+   sessions, so no lock is taken for any datagram. This thread only
+   waits for signals and passes them on.
+
+   On a shared port each thread has its own socket, all bound to the
+   same port, and the kernel hands every datagram straight to the
+   socket of the thread that has its session. */
+class ShardedHost {
+private:
+  class Shard {
+  public:
+    SessionHost *host;
+    pthread_t thread;
+    int control_pipe[ 2 ]; /* to the shard */
+    int done_fd; /* the shard writes here when it is finished */
+
+    Shard() : host( NULL ), thread(), control_pipe(), done_fd( -1 ) {}
+  };
+
+  EventLoop loop;
+  std::vector< Shard > shards;
+  int done_pipe[ 2 ];
+
+  /* shard to add the next session to */
+  size_t next_shard;
+  bool sharing;
+
+  static void *shard_main( void *shard );
+  void tell_shards( char message ) const;
+
+  /* not implemented */
+  ShardedHost( const ShardedHost & );
+  ShardedHost &operator=( const ShardedHost & );
+
+public:
+  /* threads shards, sharing the workers between them */
+  ShardedHost( int threads, int workers );
+  ~ShardedHost();
+
+  /* As for a SessionHost, but each thread gets its own socket on the
+     port. Throws NetworkException if the system can't do that. */
+  void share_port( const char *desired_ip, const char *desired_port );
+  bool sharing_port( void ) const { return sharing; }
+
+  /* Start a session on the next thread in turn. */
+  MMSession *add_session( const char *desired_ip, const char *desired_port );
+
+  void set_hibernate_after( int ms );
+
+  /* Start the threads, and wait for every session to end. */
+  void run( void );
+
+  /* Print the memory and CPU time used, and have every thread print
+     its sessions and time. */
+  void report( FILE *out ) const;
+};
+
+#endif
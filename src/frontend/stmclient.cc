@@ -262,7 +262,7 @@ void STMClient::output_new_frame( void )
   }
 
   /* fetch target state */
-  *new_state = network->get_latest_remote_state().state.get_fb();
+  *new_state = network->get_latest_remote_state().state->get_fb();
 
   /* apply local overlays */
   overlays.apply( *new_state );
@@ -294,7 +294,7 @@ bool STMClient::process_network_input( void )
 
   overlays.get_prediction_engine().set_local_frame_acked( network->get_sent_state_acked() );
   overlays.get_prediction_engine().set_send_interval( network->send_interval() );
-  overlays.get_prediction_engine().set_local_frame_late_acked( network->get_latest_remote_state().state.get_echo_ack() );
+  overlays.get_prediction_engine().set_local_frame_late_acked( network->get_latest_remote_state().state->get_echo_ack() );
 
   return true;
 }
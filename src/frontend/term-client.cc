@@ -76,7 +76,11 @@ void usage( const char *argv0 ) {
   fprintf( stderr, "Copyright 2012 Keith Winstein <mosh-devel@mit.edu>\n" );
   fprintf( stderr, "License GPLv3+: GNU GPL version 3 or later <http://gnu.org/licenses/gpl.html>.\nThis is free software: you are free to change and redistribute it.\nThere is NO WARRANTY, to the extent permitted by law.\n\n" );
 
-  fprintf( stderr, "Usage: %s IP PORT\n       %s -c\n", argv0, argv0 );
+  fprintf( stderr, "Usage: %s [-e] [-b BYTES] [-s SESSION] IP PORT\n       %s -c\n", argv0, argv0 );
+  fprintf( stderr, "  -e          run each line of input as a command, instead of echoing it\n" );
+  fprintf( stderr, "  -b BYTES    stop reading input while BYTES are unacknowledged (default %lu)\n",
+           (unsigned long)MMClient::DEFAULT_OUTBOUND_BUDGET );
+  fprintf( stderr, "  -s SESSION  session id given by a server that shares its port\n" );
 }
 
 void print_colorcount( void )
@@ -103,9 +107,31 @@ int main( int argc, char *argv[] )
   fatal_assert( argc > 0 );
 
   /* Get arguments */
+  size_t outbound_budget = MMClient::DEFAULT_OUTBOUND_BUDGET;
+  bool line_mode = false;
+  uint64_t session_id = 0;
   int opt;
-  while ( (opt = getopt( argc, argv, "c" )) != -1 ) {
+  while ( (opt = getopt( argc, argv, "cb:es:" )) != -1 ) {
     switch ( opt ) {
+    case 'e':
+      line_mode = true;
+      break;
+    case 'b':
+      if ( strspn( optarg, "0123456789" ) != strlen( optarg ) || myatoi( optarg ) <= 0 ) {
+        fprintf( stderr, "%s: Bad byte budget (%s)\n\n", argv[ 0 ], optarg );
+        usage( argv[ 0 ] );
+        exit( 1 );
+      }
+      outbound_budget = myatoi( optarg );
+      break;
+    case 's':
+      if ( strlen( optarg ) != 16 || strspn( optarg, "0123456789abcdef" ) != 16 ) {
+        fprintf( stderr, "%s: Bad session id (%s)\n\n", argv[ 0 ], optarg );
+        usage( argv[ 0 ] );
+        exit( 1 );
+      }
+      session_id = strtoull( optarg, NULL, 16 );
+      break;
     case 'c':
       print_colorcount();
       exit( 0 );
@@ -167,7 +193,7 @@ int main( int argc, char *argv[] )
   set_native_locale();
 
   try {
-    MMClient client( ip, port, key );
+    MMClient client( ip, port, key, outbound_budget, line_mode, session_id );
     client.init();
 
     try {
@@ -191,7 +217,8 @@ int main( int argc, char *argv[] )
     fprintf( stderr, "Error: %s\r\n", s.c_str() );
   }
 
-  printf( "\n[mosh is exiting.]\n" );
+  /* stdout carries the commands' output */
+  fprintf( stderr, "\n[mosh is exiting.]\n" );
 
   free( key );
 
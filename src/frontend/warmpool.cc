@@ -0,0 +1,303 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <sstream>
+#include <vector>
+
+#include "warmpool.h"
+#include "handoff.h"
+#include "network.h"
+#include "crypto.h"
+#include "fatal_assert.h"
+#include "timestamp.h"
+
+using namespace std;
+
+WarmPool::WarmPool( const char *s_path, int s_size, Spare &s_spare )
+  : loop(), spare( s_spare ), path( s_path ), size( s_size ), listen_fd( -1 ),
+    spares(), not_before( 0 ), handed_out( 0 )
+{
+  fatal_assert( size > 0 );
+
+  loop.add_signal( SIGTERM );
+  loop.add_signal( SIGINT );
+  loop.add_signal( SIGCHLD );
+
+  /* logins may come all at once */
+  listen_fd = HandoffChannel::listen( s_path, SOMAXCONN );
+  if ( listen_fd < 0 ) {
+    throw Network::NetworkException( "listen on " + path, errno );
+  }
+  loop.add_fd( listen_fd );
+}
+
+WarmPool::~WarmPool()
+{
+  /* each spare that is still ours sees its socket close, and exits */
+  for ( map< int, Process >::iterator i = spares.begin(); i != spares.end(); i++ ) {
+    close( i->first );
+  }
+  close( listen_fd );
+  unlink( path.c_str() );
+}
+
+void WarmPool::spawn( void )
+{
+  int fds[ 2 ];
+  if ( socketpair( AF_UNIX, SOCK_SEQPACKET, 0, fds ) < 0 ) {
+    perror( "socketpair" );
+    not_before = frozen_timestamp() + RESPAWN_DELAY;
+    return;
+  }
+
+  /* or the spare would print what we had buffered again */
+  fflush( stdout );
+  fflush( stderr );
+
+  pid_t pid = fork();
+  if ( pid < 0 ) {
+    perror( "fork" );
+    close( fds[ 0 ] );
+    close( fds[ 1 ] );
+    not_before = frozen_timestamp() + RESPAWN_DELAY;
+    return;
+  }
+
+  if ( pid == 0 ) {
+    /* nothing of the pool's that would keep it or the other spares
+       from seeing that one of them has gone */
+    close( fds[ 0 ] );
+    close( listen_fd );
+    for ( map< int, Process >::iterator i = spares.begin(); i != spares.end(); i++ ) {
+      close( i->first );
+    }
+    spare_main( spare, fds[ 1 ] );
+    /* not reached */
+  }
+
+  close( fds[ 1 ] );
+  fatal_assert( fcntl( fds[ 0 ], F_SETFD, FD_CLOEXEC ) == 0 );
+  fatal_assert( fcntl( fds[ 0 ], F_SETFL, O_NONBLOCK ) == 0 );
+  loop.add_fd( fds[ 0 ] );
+  spares.insert( make_pair( fds[ 0 ], Process( pid, fds[ 0 ] ) ) );
+}
+
+void WarmPool::spare_main( Spare &spare, int fd )
+{
+  /* the pool's signals were blocked for its own loop */
+  sigset_t none;
+  fatal_assert( 0 == sigemptyset( &none ) );
+  fatal_assert( 0 == sigprocmask( SIG_SETMASK, &none, NULL ) );
+
+  string announcement;
+  try {
+    announcement = spare.prepare();
+  } catch ( const Network::NetworkException &e ) {
+    fprintf( stderr, "mmserver: spare not ready: %s: %s\n", e.function.c_str(), strerror( e.the_errno ) );
+    _exit( 1 );
+  } catch ( const Crypto::CryptoException &e ) {
+    fprintf( stderr, "mmserver: spare not ready: %s\n", e.text.c_str() );
+    _exit( 1 );
+  }
+  fatal_assert( !announcement.empty() );
+
+  if ( send( fd, announcement.data(), announcement.size(), MSG_NOSIGNAL ) != ssize_t( announcement.size() ) ) {
+    _exit( 1 );
+  }
+
+  char go;
+  ssize_t got;
+  do {
+    got = read( fd, &go, 1 );
+  } while ( got < 0 && errno == EINTR );
+  if ( got != 1 || go != HandoffChannel::GO ) {
+    _exit( 0 ); /* the pool has gone, and no client knows of us */
+  }
+  close( fd );
+
+  spare.serve();
+  exit( 0 );
+}
+
+void WarmPool::fill( void )
+{
+  while ( int( spares.size() ) < size && frozen_timestamp() >= not_before ) {
+    spawn();
+  }
+}
+
+void WarmPool::hear_from( Process &process )
+{
+  char buf[ 4096 ];
+  ssize_t len = recv( process.fd, buf, sizeof( buf ), 0 );
+  if ( len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ) {
+    return;
+  }
+
+  if ( len > 0 && process.announcement.empty() ) {
+    process.announcement.assign( buf, len );
+    return;
+  }
+
+  /* gone, or saying more than a spare should */
+  if ( process.announcement.empty() ) {
+    not_before = frozen_timestamp() + RESPAWN_DELAY;
+  }
+  const int fd = process.fd;
+  kill( process.pid, SIGTERM );
+  loop.remove_fd( fd );
+  close( fd );
+  spares.erase( fd );
+}
+
+void WarmPool::hand_out( void )
+{
+  HandoffChannel *login = HandoffChannel::accept( listen_fd );
+  if ( !login ) {
+    return;
+  }
+  login->set_timeout( TAKE_TIMEOUT );
+
+  map< int, Process >::iterator ready = spares.begin();
+  while ( ready != spares.end() && ready->second.announcement.empty() ) {
+    ready++;
+  }
+
+  /* with none ready, an empty answer; the login starts its own */
+  string answer;
+  if ( ready != spares.end() ) {
+    ostringstream message;
+    message << ready->second.pid << "\n" << ready->second.announcement;
+    answer = message.str();
+  }
+
+  bool told = login->send( answer, vector< int >() );
+  delete login;
+  if ( !told || ready == spares.end() ) {
+    return;
+  }
+
+  const char go = HandoffChannel::GO;
+  if ( send( ready->first, &go, 1, MSG_NOSIGNAL ) != 1 ) {
+    perror( "mmserver: spare" );
+  }
+  loop.remove_fd( ready->first );
+  close( ready->first );
+  spares.erase( ready );
+  handed_out++;
+  not_before = std::max( not_before, frozen_timestamp() + REFILL_DELAY );
+}
+
+void WarmPool::reap( void )
+{
+  while ( waitpid( -1, NULL, WNOHANG ) > 0 ) {}
+}
+
+void WarmPool::run( void )
+{
+  freeze_timestamp();
+  fill();
+
+  while ( true ) {
+    int timeout = -1;
+    if ( int( spares.size() ) < size ) {
+      timeout = not_before > frozen_timestamp() ? not_before - frozen_timestamp() : 0;
+    }
+
+    if ( loop.wait( timeout ) < 0 ) {
+      perror( loop.backend() );
+      break;
+    }
+    freeze_timestamp();
+
+    if ( loop.signal( SIGTERM ) || loop.signal( SIGINT ) ) {
+      break;
+    }
+
+    if ( loop.signal( SIGCHLD ) ) {
+      reap();
+    }
+
+    vector< int > active( loop.active() );
+    for ( vector< int >::const_iterator i = active.begin(); i != active.end(); i++ ) {
+      map< int, Process >::iterator process = spares.find( *i );
+      if ( process != spares.end() ) {
+        hear_from( process->second );
+      }
+    }
+
+    if ( loop.read( listen_fd ) ) {
+      hand_out();
+    }
+
+    fill();
+  }
+
+  fprintf( stderr, "mmserver: pool at %s handed out %u sessions\n", path.c_str(), handed_out );
+}
+
+bool WarmPool::take( const char *path, string &announcement, pid_t &pid )
+{
+  HandoffChannel *pool = HandoffChannel::connect( path );
+  if ( !pool ) {
+    return false;
+  }
+  pool->set_timeout( TAKE_TIMEOUT );
+
+  string answer;
+  vector< int > fds;
+  bool answered = pool->recv( answer, fds );
+  delete pool;
+  for ( vector< int >::const_iterator i = fds.begin(); i != fds.end(); i++ ) {
+    close( *i );
+  }
+
+  size_t newline = answer.find( '\n' );
+  if ( !answered || newline == string::npos ) {
+    return false;
+  }
+  pid = atoi( answer.substr( 0, newline ).c_str() );
+  announcement = answer.substr( newline + 1 );
+  return pid > 0 && !announcement.empty();
+}
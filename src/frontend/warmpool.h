@@ -0,0 +1,124 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+
+#ifndef WARMPOOL_HPP
+#define WARMPOOL_HPP
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <map>
+#include <string>
+
+#include "eventloop.h"
+
+/* Keeps spare server processes ready, so that a new session need not
+   wait for one to start. Each spare is forked from the pool with
+   everything a server does at startup already done, and then gets its
+   session ready, with its key and bound socket, and says where the
+   client is to find it. It waits there until the pool hands it to a
+   new login, which connects to the pool's Unix socket and is told what
+   the spare said; the spare then serves that one session as a server
+   of its own would, and the pool forks another to take its place.
+
+   Only a process of our own user is let in, as what passes is the
+   session's key. */
+class WarmPool {
+public:
+  /* What each spare process does. */
+  class Spare {
+  public:
+    virtual ~Spare() {}
+
+    /* Get a session ready, and return what to tell its client. */
+    virtual std::string prepare( void ) = 0;
+
+    /* Serve the session until it ends. */
+    virtual void serve( void ) = 0;
+  };
+
+  /* ms to wait before forking again after a spare fails to get ready */
+  static const int RESPAWN_DELAY = 1000;
+  /* ms to wait before forking a spare in place of one handed out, so
+     as not to hold up the login and the session's first state */
+  static const int REFILL_DELAY = 50;
+  /* ms a login may take to be told where its session is */
+  static const int TAKE_TIMEOUT = 1000;
+
+private:
+  class Process {
+  public:
+    pid_t pid;
+    int fd; /* our end of a socketpair with it */
+    std::string announcement; /* empty until it is ready */
+
+    Process( pid_t s_pid, int s_fd ) : pid( s_pid ), fd( s_fd ), announcement() {}
+  };
+
+  EventLoop loop;
+  Spare &spare;
+  std::string path;
+  int size;
+  int listen_fd;
+  std::map< int, Process > spares; /* by fd */
+  uint64_t not_before; /* when we may next fork a spare */
+  unsigned int handed_out;
+
+  void spawn( void );
+  void fill( void );
+  void hear_from( Process &process );
+  void hand_out( void );
+  void reap( void );
+  static void spare_main( Spare &spare, int fd );
+
+  /* not implemented */
+  WarmPool( const WarmPool & );
+  WarmPool &operator=( const WarmPool & );
+
+public:
+  /* Keep s_size spares ready, and hand them out to whoever connects
+     to path. Throws NetworkException if we cannot listen there. */
+  WarmPool( const char *path, int s_size, Spare &s_spare );
+  ~WarmPool();
+
+  /* Serve logins until SIGTERM or SIGINT. Spares that were handed out
+     carry on serving their sessions. */
+  void run( void );
+
+  /* For a new login: take a ready session from the pool at path. On
+     success, returns true and sets what its spare said and its pid.
+     Returns false if there is no pool there or none of its spares is
+     ready, so that the caller may start a session itself. */
+  static bool take( const char *path, std::string &announcement, pid_t &pid );
+};
+
+#endif
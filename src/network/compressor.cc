@@ -34,6 +34,7 @@
 
 #include "compressor.h"
 #include "dos_assert.h"
+#include "threadlocal.h"
 
 using namespace Network;
 using namespace std;
@@ -56,9 +57,9 @@ string Compressor::uncompress_str( const string &input )
   return string( reinterpret_cast<char *>( buffer ), len );
 }
 
-/* construct on first use */
+/* construct on first use, one for each thread that sends or receives */
 Compressor & Network::get_compressor( void )
 {
-  static Compressor the_compressor;
-  return the_compressor;
+  static ThreadLocal< Compressor > compressors;
+  return compressors.get();
 }
@@ -41,7 +41,10 @@
 #include <arpa/inet.h>
 #include <assert.h>
 #include <errno.h>
+#include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <algorithm>
 
 #include "dos_assert.h"
 #include "byteorder.h"
@@ -49,11 +52,26 @@
 #include "crypto.h"
 
 #include "timestamp.h"
+#include "threadlocal.h"
+
+#include "handoff.pb.h"
+
+#ifdef HAVE_REUSEPORT_CBPF
+#include <linux/filter.h>
+#endif
 
 #ifndef MSG_DONTWAIT
 #define MSG_DONTWAIT MSG_NONBLOCK
 #endif
 
+#ifndef HAVE_RECVMMSG
+/* as recvmmsg() would fill in, for our loop of recvmsg() */
+struct mmsghdr {
+  struct msghdr msg_hdr;
+  unsigned int msg_len;
+};
+#endif
+
 using namespace std;
 using namespace Network;
 using namespace Crypto;
@@ -85,18 +103,24 @@ Packet::Packet( string coded_packet, Session *session )
 
 /* Output coded string from packet */
 string Packet::tostring( Session *session )
+{
+  string coded( 2 * sizeof( uint16_t ) + payload.size() + Session::ADDED_BYTES, '\0' );
+  coded.resize( tostring( session, &coded[ 0 ], coded.size() ) );
+  return coded;
+}
+
+size_t Packet::tostring( Session *session, char *out, size_t out_len )
 {
   uint64_t direction_seq = (uint64_t( direction == TO_CLIENT ) << 63) | (seq & SEQUENCE_MASK);
 
   uint16_t ts_net[ 2 ] = { static_cast<uint16_t>( htobe16( timestamp ) ),
                            static_cast<uint16_t>( htobe16( timestamp_reply ) ) };
 
-  string timestamps = string( (char *)ts_net, 2 * sizeof( uint16_t ) );
-
-  return session->encrypt( Message( Nonce( direction_seq ), timestamps + payload ) );
+  return session->encrypt( Nonce( direction_seq ), (const char *)ts_net, 2 * sizeof( uint16_t ),
+			   payload, out, out_len );
 }
 
-Packet Connection::new_packet( string &s_payload )
+Packet Connection::new_packet( const string &s_payload )
 {
   uint16_t outgoing_timestamp_reply = -1;
 
@@ -146,6 +170,15 @@ void Connection::prune_sockets( void )
   }
 }
 
+/* Keep our sockets, the shared port's included, out of the commands
+   and shells we run */
+static void set_cloexec( int fd )
+{
+  if ( fcntl( fd, F_SETFD, fcntl( fd, F_GETFD ) | FD_CLOEXEC ) < 0 ) {
+    throw NetworkException( "fcntl", errno );
+  }
+}
+
 Connection::Socket::Socket()
   : _fd( socket( AF_INET, SOCK_DGRAM, 0 ) )
 {
@@ -153,6 +186,8 @@ Connection::Socket::Socket()
     throw NetworkException( "socket", errno );
   }
 
+  set_cloexec( _fd );
+
   /* Disable path MTU discovery */
 #ifdef HAVE_IP_MTU_DISCOVER
   char flag = IP_PMTUDISC_DONT;
@@ -201,12 +236,14 @@ const std::vector< int > Connection::fds( void ) const
 
 Connection::Connection( const char *desired_ip, const char *desired_port ) /* server */
   : socks(),
+    shared_sock( -1 ),
     has_remote_addr( false ),
     remote_addr(),
     server( true ),
     MTU( DEFAULT_SEND_MTU ),
     key(),
     session( key ),
+    session_id( 0 ),
     direction( TO_CLIENT ),
     next_seq( 0 ),
     saved_timestamp( -1 ),
@@ -219,10 +256,142 @@ Connection::Connection( const char *desired_ip, const char *desired_port ) /* se
     SRTT( 1000 ),
     RTTVAR( 500 ),
     have_send_exception( false ),
-    send_exception()
+    send_exception(),
+    pending_datagrams()
 {
   setup();
 
+  bind_server( sock(), desired_ip, desired_port );
+}
+
+Connection::Connection( SharedPort &port ) /* server on a shared port */
+  : socks(),
+    shared_sock( port.fd() ),
+    has_remote_addr( false ),
+    remote_addr(),
+    server( true ),
+    MTU( DEFAULT_SEND_MTU ),
+    key(),
+    session( key ),
+    session_id( 0 ),
+    direction( TO_CLIENT ),
+    next_seq( 0 ),
+    saved_timestamp( -1 ),
+    saved_timestamp_received_at( 0 ),
+    expected_receiver_seq( 0 ),
+    last_heard( -1 ),
+    last_port_choice( timestamp() ),
+    last_roundtrip_success( -1 ),
+    RTT_hit( false ),
+    SRTT( 1000 ),
+    RTTVAR( 500 ),
+    have_send_exception( false ),
+    send_exception(),
+    pending_datagrams()
+{
+}
+
+Connection::Connection( const HandoffBuffers::Connection &saved, int fd ) /* taken-over server */
+  : socks(),
+    shared_sock( -1 ),
+    has_remote_addr( false ),
+    remote_addr(),
+    server( true ),
+    MTU( DEFAULT_SEND_MTU ),
+    key( saved.key() ),
+    session( key ),
+    session_id( 0 ),
+    direction( TO_CLIENT ),
+    next_seq( 0 ),
+    saved_timestamp( -1 ),
+    saved_timestamp_received_at( 0 ),
+    expected_receiver_seq( 0 ),
+    last_heard( -1 ),
+    last_port_choice( timestamp() ),
+    last_roundtrip_success( -1 ),
+    RTT_hit( false ),
+    SRTT( 1000 ),
+    RTTVAR( 500 ),
+    have_send_exception( false ),
+    send_exception(),
+    pending_datagrams()
+{
+  socks.push_back( Socket( fd ) ); /* the copy is a dup() */
+  restore( saved );
+}
+
+Connection::Connection( const HandoffBuffers::Connection &saved, SharedPort &port ) /* taken-over server on a shared port */
+  : socks(),
+    shared_sock( port.fd() ),
+    has_remote_addr( false ),
+    remote_addr(),
+    server( true ),
+    MTU( DEFAULT_SEND_MTU ),
+    key( saved.key() ),
+    session( key ),
+    session_id( 0 ),
+    direction( TO_CLIENT ),
+    next_seq( 0 ),
+    saved_timestamp( -1 ),
+    saved_timestamp_received_at( 0 ),
+    expected_receiver_seq( 0 ),
+    last_heard( -1 ),
+    last_port_choice( timestamp() ),
+    last_roundtrip_success( -1 ),
+    RTT_hit( false ),
+    SRTT( 1000 ),
+    RTTVAR( 500 ),
+    have_send_exception( false ),
+    send_exception(),
+    pending_datagrams()
+{
+  restore( saved );
+}
+
+void Connection::restore( const HandoffBuffers::Connection &saved )
+{
+  has_remote_addr = saved.has_remote_addr();
+  remote_addr.sin_family = AF_INET;
+  remote_addr.sin_addr.s_addr = saved.remote_ip();
+  remote_addr.sin_port = htons( saved.remote_port() );
+  MTU = saved.mtu();
+
+  next_seq = saved.next_seq();
+  expected_receiver_seq = saved.expected_receiver_seq();
+
+  saved_timestamp = saved.saved_timestamp();
+  saved_timestamp_received_at = saved.saved_timestamp_received_at();
+  last_heard = saved.last_heard();
+  last_roundtrip_success = saved.last_roundtrip_success();
+  RTT_hit = saved.rtt_hit();
+  SRTT = saved.srtt();
+  RTTVAR = saved.rttvar();
+}
+
+void Connection::save( HandoffBuffers::Connection &saved ) const
+{
+  assert( server );
+
+  saved.set_key( key.printable_key() );
+  saved.set_has_remote_addr( has_remote_addr );
+  saved.set_remote_ip( remote_addr.sin_addr.s_addr );
+  saved.set_remote_port( ntohs( remote_addr.sin_port ) );
+  saved.set_mtu( MTU );
+
+  saved.set_next_seq( next_seq );
+  saved.set_expected_receiver_seq( expected_receiver_seq );
+
+  saved.set_saved_timestamp( saved_timestamp );
+  saved.set_saved_timestamp_received_at( saved_timestamp_received_at );
+  saved.set_last_heard( last_heard );
+  saved.set_last_roundtrip_success( last_roundtrip_success );
+  saved.set_rtt_hit( RTT_hit );
+  saved.set_srtt( SRTT );
+  saved.set_rttvar( RTTVAR );
+}
+
+void Connection::bind_server( int socket, const char *desired_ip, const char *desired_port )
+{
   /* The mosh wrapper always gives an IP request, in order
      to deal with multihomed servers. The port is optional. */
 
@@ -251,7 +420,7 @@ Connection::Connection( const char *desired_ip, const char *desired_port ) /* se
   /* try to bind to desired IP first */
   if ( desired_ip_addr != INADDR_ANY ) {
     try {
-      if ( try_bind( sock(), desired_ip_addr, desired_port_low, desired_port_high ) ) { return; }
+      if ( try_bind( socket, desired_ip_addr, desired_port_low, desired_port_high ) ) { return; }
     } catch ( const NetworkException& e ) {
       struct in_addr sin_addr;
       sin_addr.s_addr = desired_ip_addr;
@@ -263,7 +432,7 @@ Connection::Connection( const char *desired_ip, const char *desired_port ) /* se
 
   /* now try any local interface */
   try {
-    if ( try_bind( sock(), INADDR_ANY, desired_port_low, desired_port_high ) ) { return; }
+    if ( try_bind( socket, INADDR_ANY, desired_port_low, desired_port_high ) ) { return; }
   } catch ( const NetworkException& e ) {
     fprintf( stderr, "Error binding to any interface: %s: %s\n",
 	     e.function.c_str(), strerror( e.the_errno ) );
@@ -306,14 +475,16 @@ bool Connection::try_bind( int socket, uint32_t addr, int port_low, int port_hig
   return false;
 }
 
-Connection::Connection( const char *key_str, const char *ip, int port ) /* client */
+Connection::Connection( const char *key_str, const char *ip, int port, uint64_t s_session_id ) /* client */
   : socks(),
+    shared_sock( -1 ),
     has_remote_addr( false ),
     remote_addr(),
     server( false ),
-    MTU( DEFAULT_SEND_MTU ),
+    MTU( s_session_id ? DEFAULT_SEND_MTU - SESSION_ID_LEN : DEFAULT_SEND_MTU ),
     key( key_str ),
     session( key ),
+    session_id( s_session_id ),
     direction( TO_SERVER ),
     next_seq( 0 ),
     saved_timestamp( -1 ),
@@ -326,7 +497,8 @@ Connection::Connection( const char *key_str, const char *ip, int port ) /* clien
     SRTT( 1000 ),
     RTTVAR( 500 ),
     have_send_exception( false ),
-    send_exception()
+    send_exception(),
+    pending_datagrams()
 {
   setup();
 
@@ -344,29 +516,86 @@ Connection::Connection( const char *key_str, const char *ip, int port ) /* clien
 }
 
 void Connection::send( string s )
+{
+  send( &s, 1 );
+}
+
+void Connection::send( const std::vector< string > &payloads )
+{
+  if ( !payloads.empty() ) {
+    send( &payloads[ 0 ], payloads.size() );
+  }
+}
+
+/* What send() encrypts into: one set per thread, as for recv_batch(). */
+class SendBuffers {
+public:
+  struct mmsghdr headers[ Connection::SEND_BATCH ];
+  struct iovec iovecs[ Connection::SEND_BATCH ];
+  char datagrams[ Connection::SEND_BATCH ][ Session::RECEIVE_MTU ];
+};
+
+void Connection::send( const string *payloads, size_t count )
 {
   if ( !has_remote_addr ) {
     return;
   }
 
-  Packet px = new_packet( s );
+  static ThreadLocal< SendBuffers > buffers_for_thread;
+  SendBuffers &buffers = buffers_for_thread.get();
 
-  string p = px.tostring( &session );
+  for ( size_t batch_start = 0; batch_start < count; batch_start += SEND_BATCH ) {
+    const int batch = min( count - batch_start, size_t( SEND_BATCH ) );
 
-  ssize_t bytes_sent = sendto( sock(), p.data(), p.size(), MSG_DONTWAIT,
-			       (sockaddr *)&remote_addr, sizeof( remote_addr ) );
+    for ( int i = 0; i < batch; i++ ) {
+      char *datagram = buffers.datagrams[ i ];
+      size_t len = 0;
 
-  if ( bytes_sent == static_cast<ssize_t>( p.size() ) ) {
-    have_send_exception = false;
-  } else {
-    /* Notify the frontend on sendto() failure, but don't alter control flow.
-       sendto() success is not very meaningful because packets can be lost in
-       flight anyway. */
-    have_send_exception = true;
-    send_exception = NetworkException( "sendto", errno );
-
-    if ( errno == EMSGSIZE ) {
-      MTU = 500; /* payload MTU of last resort */
+      if ( session_id ) {
+	uint64_t id_net = htobe64( session_id );
+	memcpy( datagram, &id_net, SESSION_ID_LEN );
+	len += SESSION_ID_LEN;
+      }
+
+      Packet px = new_packet( payloads[ batch_start + i ] );
+      len += px.tostring( &session, datagram + len, Session::RECEIVE_MTU - len );
+
+      buffers.iovecs[ i ].iov_base = datagram;
+      buffers.iovecs[ i ].iov_len = len;
+
+      struct msghdr &header = buffers.headers[ i ].msg_hdr;
+      memset( &header, 0, sizeof( header ) );
+      header.msg_name = &remote_addr;
+      header.msg_namelen = sizeof( remote_addr );
+      header.msg_iov = &buffers.iovecs[ i ];
+      header.msg_iovlen = 1;
+    }
+
+    /* On error, the system call reports only the first datagram it
+       could not send; note it as sendto() did, and carry on with the
+       next, so that every datagram is tried once. */
+    for ( int i = 0; i < batch; ) {
+#ifdef HAVE_SENDMMSG
+      int sent = sendmmsg( sock(), &buffers.headers[ i ], batch - i, MSG_DONTWAIT );
+#else
+      int sent = sendmsg( sock(), &buffers.headers[ i ].msg_hdr, MSG_DONTWAIT ) < 0 ? -1 : 1;
+#endif
+
+      if ( sent > 0 ) {
+	have_send_exception = false;
+	i += sent;
+      } else {
+	/* Notify the frontend on sendto() failure, but don't alter control flow.
+	   sendto() success is not very meaningful because packets can be lost in
+	   flight anyway. */
+	have_send_exception = true;
+	send_exception = NetworkException( "sendto", errno );
+
+	if ( errno == EMSGSIZE ) {
+	  MTU = 500; /* payload MTU of last resort */
+	}
+	i++;
+      }
     }
   }
 
@@ -386,86 +615,138 @@ void Connection::send( string s )
 
 string Connection::recv( void )
 {
-  assert( !socks.empty() );
-  for ( std::deque< Socket >::const_iterator it = socks.begin();
-	it != socks.end();
-	it++ ) {
-    bool islast = (it + 1) == socks.end();
-    string payload;
-    try {
-      payload = recv_one( it->fd(), !islast );
-    } catch ( NetworkException & e ) {
-      if ( (e.the_errno == EAGAIN)
-	   || (e.the_errno == EWOULDBLOCK) ) {
-	assert( !islast );
-	continue;
-      } else {
-	throw;
-      }
+  if ( pending_datagrams.empty() ) {
+    assert( !socks.empty() );
+    /* older sockets first, as they were to the other side; block on
+       the newest only if none had anything */
+    size_t read = 0;
+    for ( std::deque< Socket >::const_iterator it = socks.begin();
+	  it != socks.end();
+	  it++ ) {
+      bool islast = (it + 1) == socks.end();
+      read += recv_batch( it->fd(), islast && read == 0, pending_datagrams );
+    }
+    if ( pending_datagrams.empty() ) {
+      /* all we read was too big to be ours */
+      throw NetworkException( "Received oversize datagram", EMSGSIZE );
     }
 
     /* succeeded */
     prune_sockets();
-    return payload;
   }
-  assert( false );
-  return "";
-}
-
-string Connection::recv_one( int sock_to_recv, bool nonblocking )
-{
-  /* receive source address, ECN, and payload in msghdr structure */
-  struct sockaddr_in packet_remote_addr;
-  struct msghdr header;
-  struct iovec msg_iovec;
-
-  char msg_payload[ Session::RECEIVE_MTU ];
-  char msg_control[ Session::RECEIVE_MTU ];
-
-  /* receive source address */
-  header.msg_name = &packet_remote_addr;
-  header.msg_namelen = sizeof( packet_remote_addr );
 
-  /* receive payload */
-  msg_iovec.iov_base = msg_payload;
-  msg_iovec.iov_len = Session::RECEIVE_MTU;
-  header.msg_iov = &msg_iovec;
-  header.msg_iovlen = 1;
+  Datagram datagram;
+  datagram.payload.swap( pending_datagrams.front().payload );
+  datagram.from = pending_datagrams.front().from;
+  datagram.congestion_experienced = pending_datagrams.front().congestion_experienced;
+  pending_datagrams.pop_front();
+  return recv( datagram );
+}
 
-  /* receive explicit congestion notification */
-  header.msg_control = msg_control;
-  header.msg_controllen = Session::RECEIVE_MTU;
+/* Where recv_batch() reads to: one set per thread, rather than per
+   connection, as it is only needed for the length of the call. */
+class RecvBuffers {
+public:
+  static const int CONTROL_LEN = 64; /* room for the ECN octet */
 
-  /* receive flags */
-  header.msg_flags = 0;
+  struct mmsghdr headers[ Connection::RECV_BATCH ];
+  struct iovec iovecs[ Connection::RECV_BATCH ];
+  struct sockaddr_in addrs[ Connection::RECV_BATCH ];
+  char payloads[ Connection::RECV_BATCH ][ Session::RECEIVE_MTU ];
+  char controls[ Connection::RECV_BATCH ][ CONTROL_LEN ];
+};
 
-  ssize_t received_len = recvmsg( sock_to_recv, &header, nonblocking ? MSG_DONTWAIT : 0 );
+size_t Connection::recv_batch( int sock_to_recv, bool wait, std::deque< Datagram > &datagrams )
+{
+  static ThreadLocal< RecvBuffers > buffers_for_thread;
+  RecvBuffers &buffers = buffers_for_thread.get();
+
+  /* the kernel writes back the lengths, so set them every time */
+  for ( int i = 0; i < RECV_BATCH; i++ ) {
+    struct msghdr &header = buffers.headers[ i ].msg_hdr;
+
+    /* receive source address */
+    header.msg_name = &buffers.addrs[ i ];
+    header.msg_namelen = sizeof( buffers.addrs[ i ] );
+
+    /* receive payload */
+    buffers.iovecs[ i ].iov_base = buffers.payloads[ i ];
+    buffers.iovecs[ i ].iov_len = Session::RECEIVE_MTU;
+    header.msg_iov = &buffers.iovecs[ i ];
+    header.msg_iovlen = 1;
+
+    /* receive explicit congestion notification */
+    header.msg_control = buffers.controls[ i ];
+    header.msg_controllen = RecvBuffers::CONTROL_LEN;
+
+    /* receive flags */
+    header.msg_flags = 0;
+    buffers.headers[ i ].msg_len = 0;
+  }
 
-  if ( received_len < 0 ) {
-    throw NetworkException( "recvmsg", errno );
+#ifdef HAVE_RECVMMSG
+  int received = recvmmsg( sock_to_recv, buffers.headers, RECV_BATCH,
+			   wait ? MSG_WAITFORONE : MSG_DONTWAIT, NULL );
+#else
+  int received = 0;
+  while ( received < RECV_BATCH ) {
+    ssize_t len = recvmsg( sock_to_recv, &buffers.headers[ received ].msg_hdr,
+			   (wait && received == 0) ? 0 : MSG_DONTWAIT );
+    if ( len < 0 ) {
+      if ( received > 0 ) {
+	break; /* report the error, if it stays, next time */
+      }
+      received = -1;
+      break;
+    }
+    buffers.headers[ received ].msg_len = len;
+    received++;
   }
+#endif
 
-  if ( header.msg_flags & MSG_TRUNC ) {
-    throw NetworkException( "Received oversize datagram", errno );
+  if ( received < 0 ) {
+    if ( !wait && (errno == EAGAIN || errno == EWOULDBLOCK) ) {
+      return 0;
+    }
+    throw NetworkException( "recvmmsg", errno );
   }
 
-  /* receive ECN */
-  bool congestion_experienced = false;
+  for ( int i = 0; i < received; i++ ) {
+    const struct msghdr &header = buffers.headers[ i ].msg_hdr;
 
-  struct cmsghdr *ecn_hdr = CMSG_FIRSTHDR( &header );
-  if ( ecn_hdr
-       && (ecn_hdr->cmsg_level == IPPROTO_IP)
-       && (ecn_hdr->cmsg_type == IP_TOS) ) {
-    /* got one */
-    uint8_t *ecn_octet_p = (uint8_t *)CMSG_DATA( ecn_hdr );
-    assert( ecn_octet_p );
+    if ( header.msg_flags & MSG_TRUNC ) {
+      continue; /* too big to be one of ours */
+    }
 
-    if ( (*ecn_octet_p & 0x03) == 0x03 ) {
-      congestion_experienced = true;
+    datagrams.push_back( Datagram() );
+    Datagram &datagram = datagrams.back();
+    datagram.from = buffers.addrs[ i ];
+
+    /* receive ECN */
+    struct cmsghdr *ecn_hdr = CMSG_FIRSTHDR( &header );
+    if ( ecn_hdr
+	 && (ecn_hdr->cmsg_level == IPPROTO_IP)
+	 && (ecn_hdr->cmsg_type == IP_TOS) ) {
+      /* got one */
+      uint8_t *ecn_octet_p = (uint8_t *)CMSG_DATA( ecn_hdr );
+      assert( ecn_octet_p );
+
+      if ( (*ecn_octet_p & 0x03) == 0x03 ) {
+	datagram.congestion_experienced = true;
+      }
     }
+
+    datagram.payload.assign( buffers.payloads[ i ], buffers.headers[ i ].msg_len );
   }
 
-  Packet p( string( msg_payload, received_len ), &session );
+  return received;
+}
+
+string Connection::recv( const Datagram &datagram )
+{
+  const struct sockaddr_in &packet_remote_addr = datagram.from;
+
+  Packet p( datagram.payload, &session );
 
   dos_assert( p.direction == (server ? TO_SERVER : TO_CLIENT) ); /* prevent malicious playback to sender */
 
@@ -477,7 +758,7 @@ string Connection::recv_one( int sock_to_recv, bool nonblocking )
       saved_timestamp = p.timestamp;
       saved_timestamp_received_at = timestamp();
 
-      if ( congestion_experienced ) {
+      if ( datagram.congestion_experienced ) {
 	/* signal counterparty to slow down */
 	/* this will gradually slow the counterparty down to the minimum frame rate */
 	saved_timestamp -= CONGESTION_TIMESTAMP_PENALTY;
@@ -536,6 +817,136 @@ int Connection::port( void ) const
   return ntohs( local_addr.sin_port );
 }
 
+SharedPort::SharedPort( const char *desired_ip, const char *desired_port )
+  : sock(), pending()
+{
+  set_receive_buffer();
+
+  Connection::bind_server( sock.fd(), desired_ip, desired_port );
+}
+
+SharedPort::SharedPort( const struct sockaddr_in &addr )
+  : sock(), pending()
+{
+  set_receive_buffer();
+
+  int flag = 1;
+  if ( setsockopt( sock.fd(), SOL_SOCKET, SO_REUSEPORT, &flag, sizeof( flag ) ) < 0 ) {
+    throw NetworkException( "setsockopt( SO_REUSEPORT )", errno );
+  }
+
+  if ( bind( sock.fd(), (const sockaddr *)&addr, sizeof( addr ) ) < 0 ) {
+    throw NetworkException( "bind", errno );
+  }
+}
+
+SharedPort::SharedPort( int fd )
+  : sock( fd ), pending()
+{
+}
+
+void SharedPort::set_receive_buffer( void )
+{
+  int bufsize = RECEIVE_BUFFER;
+  if ( setsockopt( sock.fd(), SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof( bufsize ) ) < 0 ) {
+    perror( "setsockopt( SO_RCVBUF )" );
+  }
+}
+
+std::vector< SharedPort * > SharedPort::open_group( const char *desired_ip, const char *desired_port,
+						    int count )
+{
+  std::vector< SharedPort * > group;
+  if ( count == 1 ) {
+    group.push_back( new SharedPort( desired_ip, desired_port ) );
+    return group;
+  }
+
+#ifdef HAVE_REUSEPORT_CBPF
+  /* Pick the port the usual way. Having no SO_REUSEPORT, the probe
+     can't bind where another group is, so we don't join one. */
+  struct sockaddr_in addr;
+  {
+    SharedPort probe( desired_ip, desired_port );
+    socklen_t addrlen = sizeof( addr );
+    if ( getsockname( probe.fd(), (sockaddr *)&addr, &addrlen ) < 0 ) {
+      throw NetworkException( "getsockname", errno );
+    }
+  }
+
+  try {
+    for ( int i = 0; i < count; i++ ) {
+      group.push_back( new SharedPort( addr ) );
+    }
+
+    /* Return steer() of the session id, which the kernel takes as the
+       index of a socket in the order they were bound. The program sees
+       the UDP payload, and a load past its end returns 0. */
+    struct sock_filter code[] = {
+      BPF_STMT( BPF_LD | BPF_W | BPF_ABS, Connection::SESSION_ID_LEN - sizeof( uint32_t ) ),
+      BPF_STMT( BPF_ALU | BPF_MOD | BPF_K, uint32_t( count ) ),
+      BPF_STMT( BPF_RET | BPF_A, 0 ),
+    };
+    struct sock_fprog program;
+    program.len = sizeof( code ) / sizeof( code[ 0 ] );
+    program.filter = code;
+    if ( setsockopt( group.front()->fd(), SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+		     &program, sizeof( program ) ) < 0 ) {
+      throw NetworkException( "setsockopt( SO_ATTACH_REUSEPORT_CBPF )", errno );
+    }
+  } catch ( ... ) {
+    for ( std::vector< SharedPort * >::iterator i = group.begin(); i != group.end(); i++ ) {
+      delete *i;
+    }
+    throw;
+  }
+
+  return group;
+#else
+  throw NetworkException( "Sharing a port between threads", EOPNOTSUPP );
+#endif
+}
+
+int SharedPort::port( void ) const
+{
+  struct sockaddr_in local_addr;
+  socklen_t addrlen = sizeof( local_addr );
+
+  if ( getsockname( fd(), (sockaddr *)&local_addr, &addrlen ) < 0 ) {
+    throw NetworkException( "getsockname", errno );
+  }
+
+  return ntohs( local_addr.sin_port );
+}
+
+bool SharedPort::recv( Datagram &datagram )
+{
+  while ( true ) {
+    if ( pending.empty() ) {
+      if ( Connection::recv_batch( fd(), false, pending ) == 0 ) {
+	return false;
+      }
+      if ( pending.empty() ) {
+	continue; /* all too big to be ours; read on */
+      }
+    }
+    datagram.payload.swap( pending.front().payload );
+    datagram.from = pending.front().from;
+    datagram.congestion_experienced = pending.front().congestion_experienced;
+    pending.pop_front();
+
+    if ( datagram.payload.size() < size_t( Connection::SESSION_ID_LEN ) ) {
+      continue; /* not from one of our clients */
+    }
+
+    uint64_t id_net;
+    memcpy( &id_net, datagram.payload.data(), Connection::SESSION_ID_LEN );
+    datagram.session_id = be64toh( id_net );
+    datagram.payload.erase( 0, Connection::SESSION_ID_LEN );
+    return true;
+  }
+}
+
 uint64_t Network::timestamp( void )
 {
   return frozen_timestamp();
@@ -587,6 +998,8 @@ Connection::Socket::Socket( const Socket & other )
   if ( _fd < 0 ) {
     throw NetworkException( "socket", errno );
   }
+
+  set_cloexec( _fd ); /* dup() doesn't carry the flag over */
 }
 
 Connection::Socket & Connection::Socket::operator=( const Socket & other )
@@ -597,6 +1010,8 @@ Connection::Socket & Connection::Socket::operator=( const Socket & other )
     throw NetworkException( "socket", errno );
   }
 
+  set_cloexec( _fd );
+
   return *this;
 }
 
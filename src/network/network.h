@@ -46,6 +46,10 @@
 
 using namespace Crypto;
 
+namespace HandoffBuffers {
+  class Connection;
+}
+
 namespace Network {
   static const unsigned int MOSH_PROTOCOL_VERSION = 2; /* bumped for echo-ack */
 
@@ -82,8 +86,23 @@ namespace Network {
     Packet( string coded_packet, Session *session );
     
     string tostring( Session *session );
+    /* into out, with room for out_len; returns the length written */
+    size_t tostring( Session *session, char *out, size_t out_len );
+  };
+
+  /* A datagram as read off a socket, before it is decrypted. */
+  class Datagram {
+  public:
+    string payload;
+    struct sockaddr_in from;
+    bool congestion_experienced;
+    uint64_t session_id; /* set by a SharedPort */
+
+    Datagram() : payload(), from(), congestion_experienced( false ), session_id( 0 ) {}
   };
 
+  class SharedPort;
+
   class Connection {
   private:
     static const int DEFAULT_SEND_MTU = 1300;
@@ -102,6 +121,7 @@ namespace Network {
     static const int CONGESTION_TIMESTAMP_PENALTY = 500; /* ms */
 
     static bool try_bind( int socket, uint32_t addr, int port_low, int port_high );
+    static void bind_server( int socket, const char *desired_ip, const char *desired_port );
 
     class Socket
     {
@@ -111,6 +131,8 @@ namespace Network {
     public:
       int fd( void ) const { return _fd; }
       Socket();
+      /* take over a socket that is already set up */
+      explicit Socket( int s_fd ) : _fd( s_fd ) {}
       ~Socket();
 
       Socket( const Socket & other );
@@ -118,6 +140,7 @@ namespace Network {
     };
 
     std::deque< Socket > socks;
+    int shared_sock; /* a SharedPort's socket, or -1 if we have our own */
     bool has_remote_addr;
     struct sockaddr_in remote_addr;
 
@@ -128,7 +151,11 @@ namespace Network {
     Base64Key key;
     Session session;
 
+    /* put in the clear ahead of each datagram we send, if nonzero */
+    uint64_t session_id;
+
     void setup( void );
+    void restore( const HandoffBuffers::Connection &saved );
 
     Direction direction;
     uint64_t next_seq;
@@ -149,22 +176,71 @@ namespace Network {
     bool have_send_exception;
     NetworkException send_exception;
 
-    Packet new_packet( string &s_payload );
+    /* read in the last batch, but not yet taken by recv() */
+    std::deque< Datagram > pending_datagrams;
+
+    Packet new_packet( const string &s_payload );
+
+    /* Encrypt each payload into a datagram of its own and send them,
+       with one system call for every SEND_BATCH where the system has
+       sendmmsg(). */
+    void send( const string *payloads, size_t count );
 
     void hop_port( void );
 
-    int sock( void ) const { assert( !socks.empty() ); return socks.back().fd(); }
+    int sock( void ) const
+    {
+      if ( shared_sock >= 0 ) {
+        return shared_sock;
+      }
+      assert( !socks.empty() );
+      return socks.back().fd();
+    }
 
     void prune_sockets( void );
 
-    string recv_one( int sock_to_recv, bool nonblocking );
+    /* Read up to RECV_BATCH datagrams waiting on sock_to_recv onto the
+       end of datagrams, with one system call where the system has
+       recvmmsg(). If wait, block until there is at least one. Returns
+       how many were read, which is 0 only if !wait and there were
+       none. Datagrams too big to be ours are read but dropped, so
+       fewer may have been added, even none. */
+    static size_t recv_batch( int sock_to_recv, bool wait, std::deque< Datagram > &datagrams );
+
+    friend class SharedPort;
 
   public:
+    /* bytes of session id ahead of a datagram sent to a SharedPort */
+    static const int SESSION_ID_LEN = 8;
+
+    /* most datagrams read from a socket at once */
+    static const int RECV_BATCH = 32;
+    /* most datagrams written to one at once */
+    static const int SEND_BATCH = 32;
+
     Connection( const char *desired_ip, const char *desired_port ); /* server */
-    Connection( const char *key_str, const char *ip, int port ); /* client */
+    Connection( SharedPort &port ); /* server on a port shared with other sessions */
+    Connection( const char *key_str, const char *ip, int port, uint64_t s_session_id = 0 ); /* client */
+    /* server taken over from another process, with the socket it
+       passed us, which we now own, or on a shared port */
+    Connection( const HandoffBuffers::Connection &saved, int fd );
+    Connection( const HandoffBuffers::Connection &saved, SharedPort &port );
+
+    /* everything but the socket, for another process to carry on with */
+    void save( HandoffBuffers::Connection &saved ) const;
 
     void send( string s );
+    /* the fragments of one instruction, in order */
+    void send( const std::vector< string > &payloads );
+    /* The next datagram's payload. Every datagram waiting is read at
+       once, and handed out by this and later calls; it blocks only if
+       none is left from before and none is waiting. */
     string recv( void );
+    /* whether recv() has datagrams left from its last read, as it may
+       if one of them threw */
+    bool pending( void ) const { return !pending_datagrams.empty(); }
+    /* decrypt and account for a datagram read off a SharedPort */
+    string recv( const Datagram &datagram );
     const std::vector< int > fds( void ) const;
     int get_MTU( void ) const { return MTU; }
 
@@ -186,6 +262,60 @@ namespace Network {
 
     static bool parse_portrange( const char * desired_port_range, int & desired_port_low, int & desired_port_high );
   };
+
+  /* One UDP socket that the server Connections of any number of
+     sessions send from and receive on, so that they need neither a
+     port nor a file descriptor each. Clients of such sessions put
+     their session id in the clear ahead of every datagram, and each
+     datagram is handed to its session by that id instead of by
+     trying every session's key on it.
+
+     Threads that each serve their own sessions can each have a
+     SharedPort on the same port, made by open_group(). The kernel
+     then gives each datagram to the socket steer() picks for its
+     session id. */
+  class SharedPort {
+  private:
+    /* Every session's datagrams queue in the one socket, so give it
+       the room many sockets would have had; the kernel caps this. */
+    static const int RECEIVE_BUFFER = 4 * 1024 * 1024;
+
+    Connection::Socket sock;
+
+    /* read in the last batch, but not yet taken by recv() */
+    std::deque< Datagram > pending;
+
+    void set_receive_buffer( void );
+
+    /* a member of a group, bound to addr with SO_REUSEPORT */
+    SharedPort( const struct sockaddr_in &addr );
+
+    /* not implemented */
+    SharedPort( const SharedPort & );
+    SharedPort & operator=( const SharedPort & );
+
+  public:
+    SharedPort( const char *desired_ip, const char *desired_port );
+    /* take over a socket bound by another process */
+    explicit SharedPort( int fd );
+
+    /* Bind count sockets to one port, which is picked as for a single
+       SharedPort. Throws NetworkException if it cannot, or if the
+       system cannot steer datagrams between sockets. */
+    static std::vector< SharedPort * > open_group( const char *desired_ip, const char *desired_port,
+						   int count );
+
+    /* which socket of a group of count gets session_id's datagrams */
+    static int steer( uint64_t session_id, int count ) { return uint32_t( session_id ) % count; }
+
+    int fd( void ) const { return sock.fd(); }
+    int port( void ) const;
+
+    /* Read the next datagram without blocking, and take its session
+       id off the front. Returns false once there are none left.
+       Datagrams too short to have a session id are skipped. */
+    bool recv( Datagram &datagram );
+  };
 }
 
 #endif
@@ -36,6 +36,8 @@
 
 #include "transportsender.cc"
 
+#include "handoff.pb.h"
+
 using namespace Network;
 using namespace std;
 
@@ -44,33 +46,129 @@ Transport<MyState, RemoteState>::Transport( MyState &initial_state, RemoteState
 					    const char *desired_ip, const char *desired_port )
   : connection( desired_ip, desired_port ),
     sender( &connection, initial_state ),
-    received_states( 1, TimestampedState<RemoteState>( timestamp(), 0, initial_remote ) ),
+    received_states( MAX_RECEIVED_STATES ),
     receiver_quench_timer( 0 ),
-    last_receiver_state( initial_remote ),
+    last_receiver_state(),
     fragments(),
     verbose( false )
 {
+  received_states.push_back( timestamp(), 0, initial_remote );
+  last_receiver_state = received_states.back().state;
   /* server */
 }
 
 template <class MyState, class RemoteState>
 Transport<MyState, RemoteState>::Transport( MyState &initial_state, RemoteState &initial_remote,
-					    const char *key_str, const char *ip, int port )
-  : connection( key_str, ip, port ),
+					    SharedPort &port )
+  : connection( port ),
+    sender( &connection, initial_state ),
+    received_states( MAX_RECEIVED_STATES ),
+    receiver_quench_timer( 0 ),
+    last_receiver_state(),
+    fragments(),
+    verbose( false )
+{
+  received_states.push_back( timestamp(), 0, initial_remote );
+  last_receiver_state = received_states.back().state;
+  /* server on a shared port */
+}
+
+template <class MyState, class RemoteState>
+Transport<MyState, RemoteState>::Transport( MyState &initial_state, RemoteState &initial_remote,
+					    const char *key_str, const char *ip, int port,
+					    uint64_t session_id )
+  : connection( key_str, ip, port, session_id ),
     sender( &connection, initial_state ),
-    received_states( 1, TimestampedState<RemoteState>( timestamp(), 0, initial_remote ) ),
+    received_states( MAX_RECEIVED_STATES ),
     receiver_quench_timer( 0 ),
-    last_receiver_state( initial_remote ),
+    last_receiver_state(),
     fragments(),
     verbose( false )
 {
+  received_states.push_back( timestamp(), 0, initial_remote );
+  last_receiver_state = received_states.back().state;
   /* client */
 }
 
+template <class MyState, class RemoteState>
+Transport<MyState, RemoteState>::Transport( const HandoffBuffers::Transport &saved, int fd )
+  : connection( saved.connection(), fd ),
+    sender( &connection, saved.sender() ),
+    received_states( MAX_RECEIVED_STATES ),
+    receiver_quench_timer( 0 ),
+    last_receiver_state(),
+    fragments(),
+    verbose( false )
+{
+  restore_received_states( saved );
+}
+
+template <class MyState, class RemoteState>
+Transport<MyState, RemoteState>::Transport( const HandoffBuffers::Transport &saved, SharedPort &port )
+  : connection( saved.connection(), port ),
+    sender( &connection, saved.sender() ),
+    received_states( MAX_RECEIVED_STATES ),
+    receiver_quench_timer( 0 ),
+    last_receiver_state(),
+    fragments(),
+    verbose( false )
+{
+  restore_received_states( saved );
+}
+
+/* The first state is whole, and the rest diffs from it, so that they
+   all share its storage as received states do. */
+template <class MyState, class RemoteState>
+void Transport<MyState, RemoteState>::restore_received_states( const HandoffBuffers::Transport &saved )
+{
+  fatal_assert( saved.received_state_size() > 0
+		&& size_t( saved.received_state_size() ) <= MAX_RECEIVED_STATES );
+
+  /* each state is built in place and handed to the ring */
+  shared::shared_ptr<RemoteState> oldest( new RemoteState );
+  oldest->restore( saved.received_state( 0 ).state() );
+  for ( int i = 0; i < saved.received_state_size(); i++ ) {
+    shared::shared_ptr<RemoteState> state( oldest );
+    if ( i > 0 ) {
+      state.reset( new RemoteState( *oldest ) );
+      state->apply_string( saved.received_state( i ).state() );
+    }
+    received_states.push_back( saved.received_state( i ).timestamp(),
+			       saved.received_state( i ).num(), state );
+  }
+
+  last_receiver_state = received_states.back().state;
+}
+
+template <class MyState, class RemoteState>
+void Transport<MyState, RemoteState>::save( HandoffBuffers::Transport &saved ) const
+{
+  fatal_assert( *last_receiver_state == *received_states.back().state );
+
+  connection.save( *saved.mutable_connection() );
+  sender.save( *saved.mutable_sender() );
+
+  const RemoteState &oldest = *received_states.front().state;
+  for ( size_t i = 0; i < received_states.size(); i++ ) {
+    const typename StateRing<RemoteState>::Entry &received = received_states[ i ];
+    HandoffBuffers::State *state = saved.add_received_state();
+    state->set_num( received.num );
+    state->set_timestamp( received.timestamp );
+    state->set_state( i == 0 ? oldest.save() : received.state->diff_from( oldest ) );
+  }
+}
+
 template <class MyState, class RemoteState>
 void Transport<MyState, RemoteState>::recv( void )
 {
-  string s( connection.recv() );
+  do {
+    process_payload( connection.recv() );
+  } while ( connection.pending() );
+}
+
+template <class MyState, class RemoteState>
+void Transport<MyState, RemoteState>::process_payload( string s )
+{
   Fragment frag( s );
 
   if ( fragments.add_fragment( frag ) ) { /* complete packet */
@@ -86,29 +184,17 @@ void Transport<MyState, RemoteState>::recv( void )
     connection.set_last_roundtrip_success( sender.get_sent_state_acked_timestamp() );
 
     /* first, make sure we don't already have the new state */
-    for ( typename list< TimestampedState<RemoteState> >::iterator i = received_states.begin();
-	  i != received_states.end();
-	  i++ ) {
-      if ( inst.new_num() == i->num ) {
-	return;
-      }
+    if ( received_states.find( inst.new_num() ) < received_states.size() ) {
+      return;
     }
     
     /* now, make sure we do have the old state */
-    bool found = 0;
-    typename list< TimestampedState<RemoteState> >::iterator reference_state = received_states.begin();
-    while ( reference_state != received_states.end() ) {
-      if ( inst.old_num() == reference_state->num ) {
-	found = true;
-	break;
-      }
-      reference_state++;
-    }
-    
-    if ( !found ) {
+    size_t reference = received_states.find( inst.old_num() );
+    if ( reference == received_states.size() ) {
       //    fprintf( stderr, "Ignoring out-of-order packet. Reference state %d has been discarded or hasn't yet been received.\n", int(inst.old_num) );
       return; /* this is security-sensitive and part of how we enforce idempotency */
     }
+    shared::shared_ptr<RemoteState> reference_state = received_states[ reference ].state;
     
     /* Do not accept state if our queue is full */
     /* This is better than dropping states from the middle of the
@@ -117,9 +203,9 @@ void Transport<MyState, RemoteState>::recv( void )
 
     process_throwaway_until( inst.throwaway_num() );
 
-    if ( received_states.size() > 1024 ) { /* limit on state queue */
+    if ( received_states.size() > QUENCH_RECEIVED_STATES ) { /* limit on state queue */
       uint64_t now = timestamp();
-      if ( now < receiver_quench_timer ) { /* deny letting state grow further */
+      if ( now < receiver_quench_timer || received_states.full() ) { /* deny letting state grow further */
 	if ( verbose ) {
 	  fprintf( stderr, "[%u] Receiver queue full, discarding %d (malicious sender or long-unidirectional connectivity?)\n",
 		   (unsigned int)(timestamp() % 100000), (int)inst.new_num() );
@@ -130,55 +216,65 @@ void Transport<MyState, RemoteState>::recv( void )
       }
     }
 
-    /* apply diff to reference state */
-    TimestampedState<RemoteState> new_state = *reference_state;
-    new_state.timestamp = timestamp();
-    new_state.num = inst.new_num();
-
-    if ( !inst.diff().empty() ) {
-      new_state.state.apply_string( inst.diff() );
+    /* apply diff to reference state; with no diff, the new state is
+       the reference state, and shares it if it lands next to it */
+    shared::shared_ptr<RemoteState> new_state;
+    if ( inst.diff().empty() ) {
+      size_t place = received_states.place_for( inst.new_num() );
+      reference = received_states.find( inst.old_num() );
+      if ( reference < received_states.size()
+	   && (reference + 1 == place || reference == place) ) {
+	new_state = reference_state;
+      }
+    }
+    if ( !new_state ) {
+      new_state.reset( new RemoteState( *reference_state ) );
+      if ( !inst.diff().empty() ) {
+	new_state->apply_string( inst.diff() );
+      }
     }
 
     /* Insert new state in sorted place */
-    for ( typename list< TimestampedState<RemoteState> >::iterator i = received_states.begin();
-	  i != received_states.end();
-	  i++ ) {
-      if ( i->num > new_state.num ) {
-	received_states.insert( i, new_state );
-	if ( verbose ) {
-	  fprintf( stderr, "[%u] Received OUT-OF-ORDER state %d [ack %d]\n",
-		   (unsigned int)(timestamp() % 100000), (int)new_state.num, (int)inst.ack_num() );
-	}
-	return;
+    uint64_t new_timestamp = timestamp();
+    size_t place = received_states.insert( new_timestamp, inst.new_num(), new_state );
+    if ( place + 1 < received_states.size() ) {
+      if ( verbose ) {
+	fprintf( stderr, "[%u] Received OUT-OF-ORDER state %d [ack %d]\n",
+		 (unsigned int)(timestamp() % 100000), (int)inst.new_num(), (int)inst.ack_num() );
       }
+      return;
     }
     if ( verbose ) {
       fprintf( stderr, "[%u] Received state %d [coming from %d, ack %d]\n",
-	       (unsigned int)(timestamp() % 100000), (int)new_state.num, (int)inst.old_num(), (int)inst.ack_num() );
+	       (unsigned int)(timestamp() % 100000), (int)inst.new_num(), (int)inst.old_num(), (int)inst.ack_num() );
     }
-    received_states.push_back( new_state );
     sender.set_ack_num( received_states.back().num );
 
-    sender.remote_heard( new_state.timestamp );
+    sender.remote_heard( new_timestamp );
     if ( !inst.diff().empty() ) {
       sender.set_data_ack();
     }
   }
 }
 
+template <class MyState, class RemoteState>
+void Transport<MyState, RemoteState>::hibernate( void )
+{
+  sender.hibernate();
+
+  /* the client may still base a diff on any of these */
+  received_states.compact();
+  /* ours too, in case it has been cut from the ring */
+  last_receiver_state->compact();
+
+  fragments = FragmentAssembly();
+}
+
 /* The sender uses throwaway_num to tell us the earliest received state that we need to keep around */
 template <class MyState, class RemoteState>
 void Transport<MyState, RemoteState>::process_throwaway_until( uint64_t throwaway_num )
 {
-  typename list< TimestampedState<RemoteState> >::iterator i = received_states.begin();
-  while ( i != received_states.end() ) {
-    typename list< TimestampedState<RemoteState> >::iterator inext = i;
-    inext++;
-    if ( i->num < throwaway_num ) {
-      received_states.erase( i );
-    }
-    i = inext;
-  }
+  received_states.cut( throwaway_num );
 
   fatal_assert( received_states.size() > 0 );
 }
@@ -188,16 +284,12 @@ string Transport<MyState, RemoteState>::get_remote_diff( void )
 {
   /* find diff between last receiver state and current remote state, then rationalize states */
 
-  string ret( received_states.back().state.diff_from( last_receiver_state ) );
-
-  const RemoteState *oldest_receiver_state = &received_states.front().state;
+  string ret( received_states.back().state->diff_from( *last_receiver_state ) );
 
-  for ( typename list< TimestampedState<RemoteState> >::reverse_iterator i = received_states.rbegin();
-	i != received_states.rend();
-	i++ ) {
-    i->state.subtract( oldest_receiver_state );
-  }  
+  received_states.subtract_front();
 
+  /* the back's object is subtracted along with the rest, and is
+     never changed otherwise; nothing to copy */
   last_receiver_state = received_states.back().state;
 
   return ret;
@@ -44,6 +44,10 @@
 #include "transportfragment.h"
 
 
+namespace HandoffBuffers {
+  class Transport;
+}
+
 namespace Network {
   template <class MyState, class RemoteState>
   class Transport
@@ -57,11 +61,20 @@ namespace Network {
 
     /* helper methods for recv() */
     void process_throwaway_until( uint64_t throwaway_num );
+    void process_payload( string s );
+    void restore_received_states( const HandoffBuffers::Transport &saved );
+
+    /* beyond this many received states, take one new one only every 15 s */
+    static const size_t QUENCH_RECEIVED_STATES = 1024;
+    /* and never hold more than this many */
+    static const size_t MAX_RECEIVED_STATES = 2048;
 
     /* simple receiver */
-    list< TimestampedState<RemoteState> > received_states;
+    StateRing<RemoteState> received_states;
     uint64_t receiver_quench_timer;
-    RemoteState last_receiver_state; /* the state we were in when user last queried state */
+    /* the state we were in when user last queried state; shares the
+       object of that received state rather than copying it */
+    shared::shared_ptr<RemoteState> last_receiver_state;
     FragmentAssembly fragments;
     bool verbose;
 
@@ -69,7 +82,18 @@ namespace Network {
     Transport( MyState &initial_state, RemoteState &initial_remote,
 	       const char *desired_ip, const char *desired_port );
     Transport( MyState &initial_state, RemoteState &initial_remote,
-	       const char *key_str, const char *ip, int port );
+	       SharedPort &port );
+    Transport( MyState &initial_state, RemoteState &initial_remote,
+	       const char *key_str, const char *ip, int port, uint64_t session_id = 0 );
+    /* server taken over from another process, on the socket it passed
+       us or on port */
+    Transport( const HandoffBuffers::Transport &saved, int fd );
+    Transport( const HandoffBuffers::Transport &saved, SharedPort &port );
+
+    /* Everything but the socket, for another process to carry on
+       with. The frontend must have read every state received, as a
+       server does as soon as it arrives. */
+    void save( HandoffBuffers::Transport &saved ) const;
 
     /* Send data or an ack if necessary. */
     void tick( void ) { sender.tick(); }
@@ -77,8 +101,14 @@ namespace Network {
     /* Returns the number of ms to wait until next possible event. */
     int wait_time( void ) { return sender.wait_time(); }
 
-    /* Blocks waiting for a packet. */
+    /* Blocks waiting for a packet, and then processes every packet
+       waiting, in order. If one of them throws, those after it are
+       left for the next call; see pending(). */
     void recv( void );
+    bool pending( void ) const { return connection.pending(); }
+
+    /* Take a packet that was read off our SharedPort. */
+    void recv( const Datagram &datagram ) { process_payload( connection.recv( datagram ) ); }
 
     /* Find diff between last receiver state and current remote state, then rationalize states. */
     string get_remote_diff( void );
@@ -91,18 +121,33 @@ namespace Network {
     bool shutdown_ack_timed_out( void ) const { return sender.shutdown_ack_timed_out(); }
     bool has_remote_addr( void ) const { return connection.get_has_remote_addr(); }
 
+    /* A server made ahead of its client: count the wait for the first
+       state from the client from now. */
+    void start_waiting( void ) { if ( !get_remote_state_num() ) { received_states.back().timestamp = timestamp(); } }
+
+    /* Hibernation of an idle connection: once quiescent(), keep as few
+       states as the protocol allows, with no storage of their own,
+       and send acks less often, until wake(). Both states must have
+       compact(). */
+    bool quiescent( void ) const { return sender.quiescent(); }
+    void hibernate( void );
+    void wake( void ) { sender.wake(); }
+    bool hibernating( void ) const { return sender.get_hibernating(); }
+
     /* Other side has requested shutdown and we have sent one ACK */
     bool counterparty_shutdown_ack_sent( void ) const { return sender.get_counterparty_shutdown_acknowledged(); }
 
     int port( void ) const { return connection.port(); }
     string get_key( void ) const { return connection.get_key(); }
 
+    /* The frontend changes the state it sends in place; setting it
+       copies all of x. */
     MyState &get_current_state( void ) { return sender.get_current_state(); }
     void set_current_state( const MyState &x ) { sender.set_current_state( x ); }
 
     uint64_t get_remote_state_num( void ) const { return received_states.back().num; }
 
-    const TimestampedState<RemoteState> & get_latest_remote_state( void ) const { return received_states.back(); }
+    const typename StateRing<RemoteState>::Entry & get_latest_remote_state( void ) const { return received_states.back(); }
 
     const std::vector< int > fds( void ) const { return connection.fds(); }
 
@@ -104,6 +104,10 @@ namespace Network {
     }
     vector<Fragment> make_fragments( const Instruction &inst, int MTU );
     uint64_t last_ack_sent( void ) const { return last_instruction.ack_num(); }
+
+    /* so that another process can go on numbering instructions */
+    uint64_t get_next_instruction_id( void ) const { return next_instruction_id; }
+    void set_next_instruction_id( uint64_t id ) { next_instruction_id = id; }
   };
   
 }
@@ -38,6 +38,10 @@
 
 #include "transportsender.h"
 #include "transportfragment.h"
+#include "threadlocal.h"
+#include "fatal_assert.h"
+
+#include "handoff.pb.h"
 
 #include <limits.h>
 
@@ -48,8 +52,12 @@ template <class MyState>
 TransportSender<MyState>::TransportSender( Connection *s_connection, MyState &initial_state )
   : connection( s_connection ), 
     current_state( initial_state ),
-    sent_states( 1, TimestampedState<MyState>( timestamp(), 0, initial_state ) ),
-    assumed_receiver_state( sent_states.begin() ),
+    sent_states( MAX_SENT_STATES + 1 ),
+    assumed_receiver_state( 0 ),
+    diff_cache(),
+    diff_cache_recent( 0 ),
+    diff_cache_hits( 0 ),
+    diff_cache_misses( 0 ),
     fragmenter(),
     next_ack_time( timestamp() ),
     next_send_time( timestamp() ),
@@ -61,9 +69,82 @@ TransportSender<MyState>::TransportSender( Connection *s_connection, MyState &in
     pending_data_ack( false ),
     SEND_MINDELAY( 8 ),
     last_heard( 0 ),
-    prng(),
-    mindelay_clock( -1 )
+    mindelay_clock( -1 ),
+    hibernating( false )
 {
+  sent_states.push_back( timestamp(), 0, initial_state );
+}
+
+template <class MyState>
+TransportSender<MyState>::TransportSender( Connection *s_connection, const HandoffBuffers::Sender &saved )
+  : connection( s_connection ),
+    current_state(),
+    sent_states( MAX_SENT_STATES + 1 ),
+    assumed_receiver_state( 0 ),
+    diff_cache(),
+    diff_cache_recent( 0 ),
+    diff_cache_hits( 0 ),
+    diff_cache_misses( 0 ),
+    fragmenter(),
+    next_ack_time( timestamp() ),
+    next_send_time( timestamp() ),
+    verbose( false ),
+    shutdown_in_progress( saved.shutdown_in_progress() ),
+    shutdown_tries( saved.shutdown_tries() ),
+    shutdown_start( saved.shutdown_start() ),
+    ack_num( saved.ack_num() ),
+    pending_data_ack( saved.pending_data_ack() ),
+    SEND_MINDELAY( 8 ),
+    last_heard( saved.last_heard() ),
+    mindelay_clock( -1 ),
+    hibernating( saved.hibernating() )
+{
+  fatal_assert( saved.sent_state_size() > 0
+		&& size_t( saved.sent_state_size() ) <= MAX_SENT_STATES );
+
+  /* each state is built in place and handed to the ring */
+  shared::shared_ptr<MyState> acknowledged( new MyState );
+  acknowledged->restore( saved.sent_state( 0 ).state() );
+  for ( int i = 0; i < saved.sent_state_size(); i++ ) {
+    shared::shared_ptr<MyState> state( acknowledged );
+    if ( i > 0 ) {
+      state.reset( new MyState( *acknowledged ) );
+      state->apply_string( saved.sent_state( i ).state() );
+    }
+    sent_states.push_back( saved.sent_state( i ).timestamp(), saved.sent_state( i ).num(), state );
+  }
+
+  /* the receiver surely has this one */
+  assumed_receiver_state = 0;
+
+  current_state = *acknowledged;
+  current_state.apply_string( saved.current_state() );
+
+  fragmenter.set_next_instruction_id( saved.next_instruction_id() );
+}
+
+template <class MyState>
+void TransportSender<MyState>::save( HandoffBuffers::Sender &saved ) const
+{
+  const MyState &acknowledged = *sent_states.front().state;
+  for ( size_t i = 0; i < sent_states.size(); i++ ) {
+    const typename sent_states_type::Entry &sent = sent_states[ i ];
+    HandoffBuffers::State *state = saved.add_sent_state();
+    state->set_num( sent.num );
+    state->set_timestamp( sent.timestamp );
+    state->set_state( i == 0 ? acknowledged.save()
+		      : sent.state->diff_from( acknowledged ) );
+  }
+  saved.set_current_state( current_state.diff_from( acknowledged ) );
+
+  saved.set_ack_num( ack_num );
+  saved.set_pending_data_ack( pending_data_ack );
+  saved.set_last_heard( last_heard );
+  saved.set_shutdown_in_progress( shutdown_in_progress );
+  saved.set_shutdown_tries( shutdown_tries );
+  saved.set_shutdown_start( shutdown_start );
+  saved.set_next_instruction_id( fragmenter.get_next_instruction_id() );
+  saved.set_hibernating( hibernating );
 }
 
 /* Try to send roughly two frames per RTT, bounded by limits on frame rate */
@@ -96,20 +177,20 @@ void TransportSender<MyState>::calculate_timers( void )
     next_ack_time = now + ACK_DELAY;
   }
 
-  if ( !(current_state == sent_states.back().state) ) {
+  if ( !same_state( current_state, *sent_states.back().state ) ) {
     if ( mindelay_clock == uint64_t( -1 ) ) {
       mindelay_clock = now;
     }
 
     next_send_time = max( mindelay_clock + SEND_MINDELAY,
 			  sent_states.back().timestamp + send_interval() );
-  } else if ( !(current_state == assumed_receiver_state->state)
+  } else if ( !same_state( current_state, assumed_receiver() )
 	      && (last_heard + ACTIVE_RETRY_TIMEOUT > now) ) {
     next_send_time = sent_states.back().timestamp + send_interval();
     if ( mindelay_clock != uint64_t( -1 ) ) {
       next_send_time = max( next_send_time, mindelay_clock + SEND_MINDELAY );
     }
-  } else if ( !(current_state == sent_states.front().state )
+  } else if ( !same_state( current_state, *sent_states.front().state )
 	      && (last_heard + ACTIVE_RETRY_TIMEOUT > now) ) {
     next_send_time = sent_states.back().timestamp + connection->timeout() + ACK_DELAY;
   } else {
@@ -165,13 +246,13 @@ void TransportSender<MyState>::tick( void )
 
   /* Determine if a new diff or empty ack needs to be sent */
     
-  string diff = current_state.diff_from( assumed_receiver_state->state );
+  string diff = diff_from_sent( assumed_receiver_state );
 
   attempt_prospective_resend_optimization( diff );
 
   if ( verbose ) {
     /* verify diff has round-trip identity (modulo Unicode fallback rendering) */
-    MyState newstate( assumed_receiver_state->state );
+    MyState newstate( assumed_receiver() );
     newstate.apply_string( diff );
     if ( current_state.compare( newstate ) ) {
       fprintf( stderr, "Warning, round-trip Instruction verification failed!\n" );
@@ -203,22 +284,23 @@ void TransportSender<MyState>::send_empty_ack( void )
     new_num = uint64_t( -1 );
   }
 
-  //  sent_states.push_back( TimestampedState<MyState>( sent_states.back().timestamp, new_num, current_state ) );
   add_sent_state( now, new_num, current_state );
   send_in_fragments( "", new_num );
 
-  next_ack_time = now + ACK_INTERVAL;
+  next_ack_time = now + ack_interval();
   next_send_time = uint64_t(-1);
 }
 
 template <class MyState>
-void TransportSender<MyState>::add_sent_state( uint64_t the_timestamp, uint64_t num, MyState &state )
+void TransportSender<MyState>::add_sent_state( uint64_t the_timestamp, uint64_t num, const MyState &state )
 {
-  sent_states.push_back( TimestampedState<MyState>( the_timestamp, num, state ) );
-  if ( sent_states.size() > 32 ) { /* limit on state queue */
-    typename sent_states_type::iterator last = sent_states.end();
-    for ( int i = 0; i < 16; i++ ) { last--; }
-    sent_states.erase( last ); /* erase state from middle of queue */
+  sent_states.push_back( the_timestamp, num, state );
+  if ( sent_states.size() > MAX_SENT_STATES ) { /* limit on state queue */
+    size_t middle = sent_states.size() - 16;
+    sent_states.erase( middle ); /* erase state from middle of queue */
+    if ( assumed_receiver_state >= middle ) {
+      assumed_receiver_state--;
+    }
   }
 }
 
@@ -226,7 +308,7 @@ template <class MyState>
 void TransportSender<MyState>::send_to_receiver( string diff )
 {
   uint64_t new_num;
-  if ( current_state == sent_states.back().state ) { /* previously sent */
+  if ( same_state( current_state, *sent_states.back().state ) ) { /* previously sent */
     new_num = sent_states.back().num;
   } else { /* new state */
     new_num = sent_states.back().num + 1;
@@ -247,12 +329,36 @@ void TransportSender<MyState>::send_to_receiver( string diff )
 
   /* successfully sent, probably */
   /* ("probably" because the FIRST size-exceeded datagram doesn't get an error) */
-  assumed_receiver_state = sent_states.end();
-  assumed_receiver_state--;
-  next_ack_time = timestamp() + ACK_INTERVAL;
+  assumed_receiver_state = sent_states.size() - 1;
+  next_ack_time = timestamp() + ack_interval();
   next_send_time = uint64_t(-1);
 }
 
+template <class MyState>
+const string &TransportSender<MyState>::diff_from_sent( size_t i )
+{
+  const MyState &sent = *sent_states[ i ].state;
+
+  for ( int slot = 0; slot < DIFF_CACHE_SIZE; slot++ ) {
+    CachedDiff &cached = diff_cache[ slot ];
+    if ( cached.valid && cached.sent_version == sent.get_version()
+         && cached.version == current_state.get_version() ) {
+      diff_cache_hits++;
+      diff_cache_recent = slot;
+      return cached.diff;
+    }
+  }
+
+  diff_cache_misses++;
+  diff_cache_recent = (diff_cache_recent + 1) % DIFF_CACHE_SIZE;
+  CachedDiff &cached = diff_cache[ diff_cache_recent ];
+  cached.sent_version = sent.get_version();
+  cached.version = current_state.get_version();
+  cached.valid = true;
+  cached.diff = current_state.diff_from( sent );
+  return cached.diff;
+}
+
 template <class MyState>
 void TransportSender<MyState>::update_assumed_receiver_state( void )
 {
@@ -260,41 +366,36 @@ void TransportSender<MyState>::update_assumed_receiver_state( void )
 
   /* start from what is known and give benefit of the doubt to unacknowledged states
      transmitted recently enough ago */
-  assumed_receiver_state = sent_states.begin();
-
-  typename list< TimestampedState<MyState> >::iterator i = sent_states.begin();
-  i++;
+  assumed_receiver_state = 0;
 
-  while ( i != sent_states.end() ) {
-    assert( now >= i->timestamp );
+  for ( size_t i = 1; i < sent_states.size(); i++ ) {
+    assert( now >= sent_states[ i ].timestamp );
 
-    if ( uint64_t(now - i->timestamp) < connection->timeout() + ACK_DELAY ) {
+    if ( uint64_t(now - sent_states[ i ].timestamp) < connection->timeout() + ACK_DELAY ) {
       assumed_receiver_state = i;
     } else {
       return;
     }
-
-    i++;
   }
 }
 
 template <class MyState>
 void TransportSender<MyState>::rationalize_states( void )
 {
-  const MyState * known_receiver_state = &sent_states.front().state;
+  const MyState * known_receiver_state = sent_states.front().state.get();
 
   current_state.subtract( known_receiver_state );
 
-  for ( typename list< TimestampedState<MyState> >::reverse_iterator i = sent_states.rbegin();
-	i != sent_states.rend();
-	i++ ) {
-    i->state.subtract( known_receiver_state );
-  }
+  sent_states.subtract_front();
 }
 
 template <class MyState>
 const string TransportSender<MyState>::make_chaff( void )
 {
+  /* one for all senders on a thread, rather than a file descriptor each */
+  static ThreadLocal< PRNG > prngs;
+  PRNG &prng = prngs.get();
+
   const size_t CHAFF_MAX = 16;
   const size_t chaff_len = prng.uint8() % (CHAFF_MAX + 1);
 
@@ -309,7 +410,7 @@ void TransportSender<MyState>::send_in_fragments( string diff, uint64_t new_num
   Instruction inst;
 
   inst.set_protocol_version( MOSH_PROTOCOL_VERSION );
-  inst.set_old_num( assumed_receiver_state->num );
+  inst.set_old_num( sent_states[ assumed_receiver_state ].num );
   inst.set_new_num( new_num );
   inst.set_ack_num( ack_num );
   inst.set_throwaway_num( sent_states.front().num );
@@ -322,19 +423,27 @@ void TransportSender<MyState>::send_in_fragments( string diff, uint64_t new_num
 
   vector<Fragment> fragments = fragmenter.make_fragments( inst, connection->get_MTU() );
 
+  /* all at once, so that a big instruction costs one system call */
+  vector<string> payloads;
+  payloads.reserve( fragments.size() );
   for ( vector<Fragment>::iterator i = fragments.begin();
         i != fragments.end();
         i++ ) {
-    connection->send( i->tostring() );
+    payloads.push_back( i->tostring() );
+  }
+  connection->send( payloads );
 
-    if ( verbose ) {
-      fprintf( stderr, "[%u] Sent [%d=>%d] id %d, frag %d ack=%d, throwaway=%d, len=%d, frame rate=%.2f, timeout=%d, srtt=%.1f\n",
+  if ( verbose ) {
+    for ( vector<Fragment>::iterator i = fragments.begin();
+          i != fragments.end();
+          i++ ) {
+      fprintf( stderr, "[%u] Sent [%d=>%d] id %d, frag %d ack=%d, throwaway=%d, len=%d, frame rate=%.2f, timeout=%d, srtt=%.1f, diff cache %u hits/%u misses\n",
 	       (unsigned int)(timestamp() % 100000), (int)inst.old_num(), (int)inst.new_num(), (int)i->id, (int)i->fragment_num,
 	       (int)inst.ack_num(), (int)inst.throwaway_num(), (int)i->contents.size(),
 	       1000.0 / (double)send_interval(),
-	       (int)connection->timeout(), connection->get_SRTT() );
+	       (int)connection->timeout(), connection->get_SRTT(),
+	       diff_cache_hits, diff_cache_misses );
     }
-
   }
 
   pending_data_ack = false;
@@ -345,15 +454,46 @@ void TransportSender<MyState>::process_acknowledgment_through( uint64_t ack_num
 {
   /* Ignore ack if we have culled the state it's acknowledging */
 
-  if ( sent_states.end() !=
-       find_if( sent_states.begin(), sent_states.end(),
-		bind2nd( mem_fun_ref( &TimestampedState<MyState>::num_eq ), ack_num ) ) ) {
-    sent_states.remove_if( bind2nd( mem_fun_ref( &TimestampedState<MyState>::num_lt ), ack_num ) );
+  if ( sent_states.find( ack_num ) < sent_states.size() ) {
+    assumed_receiver_state -= min( assumed_receiver_state, sent_states.cut( ack_num ) );
   }
 
   assert( !sent_states.empty() );
 }
 
+template <class MyState>
+bool TransportSender<MyState>::quiescent( void ) const
+{
+  return (!shutdown_in_progress) && same_state( current_state, *sent_states.front().state );
+}
+
+template <class MyState>
+void TransportSender<MyState>::hibernate( void )
+{
+  assert( quiescent() );
+
+  /* the states in between only repeat the acknowledged one */
+  while ( sent_states.size() > 2 ) {
+    sent_states.erase( 1 );
+  }
+  assumed_receiver_state = 0;
+
+  rationalize_states();
+  current_state.compact();
+  sent_states.compact();
+
+  hibernating = true;
+}
+
+template <class MyState>
+void TransportSender<MyState>::wake( void )
+{
+  if ( hibernating ) {
+    hibernating = false;
+    next_ack_time = min( next_ack_time, timestamp() + ACK_INTERVAL );
+  }
+}
+
 /* give up on getting acknowledgement for shutdown */
 template <class MyState>
 bool TransportSender<MyState>::shutdown_ack_timed_out( void ) const
@@ -381,11 +521,11 @@ void TransportSender<MyState>::set_ack_num( uint64_t s_ack_num )
 template <class MyState>
 void TransportSender<MyState>::attempt_prospective_resend_optimization( string &proposed_diff )
 {
-  if ( assumed_receiver_state == sent_states.begin() ) {
+  if ( assumed_receiver_state == 0 ) {
     return;
   }
 
-  string resend_diff = current_state.diff_from( sent_states.front().state );
+  const string &resend_diff = diff_from_sent( 0 );
 
   /* We do a prophylactic resend if it would make the diff shorter,
      or if it would lengthen it by no more than 100 bytes and still be
@@ -394,7 +534,7 @@ void TransportSender<MyState>::attempt_prospective_resend_optimization( string &
   if ( (resend_diff.size() <= proposed_diff.size())
        || ( (resend_diff.size() < 1000)
 	    && (resend_diff.size() - proposed_diff.size() < 100) ) ) {
-    assumed_receiver_state = sent_states.begin();
+    assumed_receiver_state = 0;
     proposed_diff = resend_diff;
   }
 }
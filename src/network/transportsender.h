@@ -47,6 +47,10 @@ using std::list;
 using std::pair;
 using namespace TransportBuffers;
 
+namespace HandoffBuffers {
+  class Sender;
+}
+
 namespace Network {
   /* timing parameters */
   const int SEND_INTERVAL_MIN = 20; /* ms between frames */
@@ -55,6 +59,10 @@ namespace Network {
   const int ACK_DELAY = 100; /* ms before delayed ack */
   const int SHUTDOWN_RETRIES = 16; /* number of shutdown packets to send before giving up */
   const int ACTIVE_RETRY_TIMEOUT = 10000; /* attempt to resend at frame rate */
+  /* ms between empty acks while hibernating; a client that goes
+     PORT_HOP_INTERVAL without a state acknowledged hops ports, and it
+     sends a new state with every ACK_INTERVAL */
+  const int HIBERNATE_ACK_INTERVAL = 6000;
 
   template <class MyState>
   class TransportSender
@@ -67,20 +75,48 @@ namespace Network {
     void send_to_receiver( string diff );
     void send_empty_ack( void );
     void send_in_fragments( string diff, uint64_t new_num );
-    void add_sent_state( uint64_t the_timestamp, uint64_t num, MyState &state );
+    void add_sent_state( uint64_t the_timestamp, uint64_t num, const MyState &state );
 
     /* state of sender */
     Connection *connection;
 
     MyState current_state;
 
-    typedef list< TimestampedState<MyState> > sent_states_type;
+    /* most states kept, from the acknowledged one to the last sent */
+    static const size_t MAX_SENT_STATES = 32;
+
+    typedef StateRing<MyState> sent_states_type;
     sent_states_type sent_states;
     /* first element: known, acknowledged receiver state */
     /* last element: last sent state */
 
     /* somewhere in the middle: the assumed state of the receiver */
-    typename sent_states_type::iterator assumed_receiver_state;
+    size_t assumed_receiver_state;
+    const MyState &assumed_receiver( void ) const { return *sent_states[ assumed_receiver_state ].state; }
+
+    /* Diffs of current_state from sent states, by the versions of
+       both. A tick with nothing new and the resend heuristic ask for
+       the same one or two over and over. A number won't do for the
+       sent state, as every shutdown state is numbered -1. Subtracting
+       the acknowledged state from both sides does not change a diff,
+       so rationalize_states() leaves them be. */
+    class CachedDiff {
+    public:
+      uint64_t sent_version;
+      uint64_t version;
+      bool valid;
+      string diff;
+
+      CachedDiff() : sent_version( 0 ), version( 0 ), valid( false ), diff() {}
+    };
+
+    static const int DIFF_CACHE_SIZE = 2;
+    CachedDiff diff_cache[ DIFF_CACHE_SIZE ];
+    int diff_cache_recent; /* the slot last used */
+    unsigned int diff_cache_hits, diff_cache_misses;
+
+    /* current_state.diff_from() the i-th sent state */
+    const string &diff_from_sent( size_t i );
 
     /* for fragment creation */
     Fragmenter fragmenter;
@@ -105,14 +141,23 @@ namespace Network {
     uint64_t last_heard; /* last time received new state */
 
     /* chaff to disguise instruction length */
-    PRNG prng;
     const string make_chaff( void );
 
     uint64_t mindelay_clock; /* time of first pending change to current state */
 
+    /* idle, with acks stretched to HIBERNATE_ACK_INTERVAL */
+    bool hibernating;
+    int ack_interval( void ) const { return hibernating ? HIBERNATE_ACK_INTERVAL : ACK_INTERVAL; }
+
   public:
     /* constructor */
     TransportSender( Connection *s_connection, MyState &initial_state );
+    /* carry on from where another process saved */
+    TransportSender( Connection *s_connection, const HandoffBuffers::Sender &saved );
+
+    /* The states sent, from the acknowledged one on, the current
+       state, and what we know of the receiver, for another process. */
+    void save( HandoffBuffers::Sender &saved ) const;
 
     /* Send data or an ack if necessary */
     void tick( void );
@@ -132,6 +177,16 @@ namespace Network {
     /* Received something */
     void remote_heard( uint64_t ts ) { last_heard = ts; }
 
+    /* Everything we have sent is acknowledged and nothing new is waiting */
+    bool quiescent( void ) const;
+
+    /* While quiescent: keep only the acknowledged state, and the last
+       one sent so that its number is not reused, compact them, and
+       send acks less often until wake(). */
+    void hibernate( void );
+    void wake( void );
+    bool get_hibernating( void ) const { return hibernating; }
+
     /* Starts shutdown sequence */
     void start_shutdown( void ) { if ( !shutdown_in_progress ) { shutdown_start = timestamp(); shutdown_in_progress = true; } }
 
@@ -33,22 +33,257 @@
 #ifndef TRANSPORT_STATE_HPP
 #define TRANSPORT_STATE_HPP
 
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "shared.h"
+
 namespace Network {
+  /* Whether two states are equal. An unchanged copy has the version of
+     what it was copied from, which settles it without comparing whole
+     states; that is the usual case, as when nothing has happened since
+     the last send. States that came to be equal by separate changes
+     are still compared. */
   template <class State>
-  class TimestampedState
+  bool same_state( const State &a, const State &b )
+  {
+    return a.get_version() == b.get_version() || a == b;
+  }
+
+  /* A ring of states in order of number, as the sender keeps what it
+     has sent and the receiver what it has received. Numbers only grow
+     from front to back, but for the shutdown number, the largest,
+     which may repeat.
+
+     Each entry holds a handle to its state, not the state. A run of
+     entries with equal states can share one object, as a run of empty
+     acks does, so making room in the middle or dropping old entries
+     moves pointers, never states. Sharing is kept to neighbours: the
+     sharers of an object are always next to one another, so a state
+     is mutated once by walking the ring and skipping repeats.
+
+     Storage grows by doubling up to what limit entries need, so an
+     idle transport costs a few slots, not the most it could hold. An
+     entry is found by number at the slot that number would have if
+     there were no gaps, as there usually are not, and otherwise by a
+     binary search. */
+  template <class State>
+  class StateRing
   {
   public:
-    uint64_t timestamp;
-    uint64_t num;
-    State state;
-    
-    TimestampedState( uint64_t s_timestamp, uint64_t s_num, State &s_state )
-      : timestamp( s_timestamp ), num( s_num ), state( s_state )
+    class Entry {
+    public:
+      uint64_t timestamp;
+      uint64_t num;
+      shared::shared_ptr<State> state;
+
+      Entry() : timestamp( 0 ), num( 0 ), state() {}
+    };
+
+  private:
+    static const size_t INITIAL_SLOTS = 4;
+
+    std::vector<Entry> slots; /* a power of two of them */
+    size_t first;
+    size_t count;
+    size_t limit;
+
+    Entry &slot( size_t i ) { return slots[ (first + i) & (slots.size() - 1) ]; }
+    const Entry &slot( size_t i ) const { return slots[ (first + i) & (slots.size() - 1) ]; }
+
+    /* make room for one more at the back */
+    void grow( void )
+    {
+      assert( count < limit );
+      if ( count < slots.size() ) {
+        return;
+      }
+      std::vector<Entry> bigger( slots.size() * 2 );
+      for ( size_t i = 0; i < count; i++ ) {
+        bigger[ i ].timestamp = slot( i ).timestamp;
+        bigger[ i ].num = slot( i ).num;
+        bigger[ i ].state.swap( slot( i ).state );
+      }
+      slots.swap( bigger );
+      first = 0;
+    }
+
+  public:
+    StateRing( size_t s_limit )
+      : slots( INITIAL_SLOTS ), first( 0 ), count( 0 ), limit( s_limit )
     {}
 
-    /* For use with find_if, remove_if */
-    bool num_eq( uint64_t v ) const { return num == v; }
-    bool num_lt( uint64_t v ) const { return num <  v; }
+    size_t size( void ) const { return count; }
+    bool empty( void ) const { return count == 0; }
+    bool full( void ) const { return count == limit; }
+
+    /* i-th entry from the front */
+    Entry &operator[]( size_t i ) { assert( i < count ); return slot( i ); }
+    const Entry &operator[]( size_t i ) const { assert( i < count ); return slot( i ); }
+
+    Entry &front( void ) { return (*this)[ 0 ]; }
+    const Entry &front( void ) const { return (*this)[ 0 ]; }
+    Entry &back( void ) { return (*this)[ count - 1 ]; }
+    const Entry &back( void ) const { return (*this)[ count - 1 ]; }
+
+    /* Append a state, sharing the last one's object if it is equal. */
+    void push_back( uint64_t timestamp, uint64_t num, const State &state )
+    {
+      if ( !empty() && same_state( *back().state, state ) ) {
+        insert( timestamp, num, back().state );
+      } else {
+        insert( timestamp, num, shared::shared_ptr<State>( new State( state ) ) );
+      }
+    }
+
+    /* The same for a new object the caller hands over, which is kept
+       rather than copied. */
+    void push_back( uint64_t timestamp, uint64_t num, shared::shared_ptr<State> state )
+    {
+      if ( !empty() && same_state( *back().state, *state ) ) {
+        state = back().state;
+      }
+      insert( timestamp, num, state );
+    }
+
+    /* where insert() would put an entry numbered num */
+    size_t place_for( uint64_t num ) const
+    {
+      size_t place = count;
+      while ( place > 0 && slot( place - 1 ).num > num ) {
+        place--;
+      }
+      return place;
+    }
+
+    /* Put an entry in its place by number, after any with the same
+       number. Its state must be a new object or that of an entry it
+       lands next to. Returns its index. */
+    size_t insert( uint64_t timestamp, uint64_t num, shared::shared_ptr<State> state )
+    {
+      grow();
+
+      size_t place = place_for( num );
+      for ( size_t i = count; i > place; i-- ) {
+        slot( i ) = slot( i - 1 );
+      }
+      count++;
+
+      Entry &entry = slot( place );
+      entry.timestamp = timestamp;
+      entry.num = num;
+      entry.state.swap( state );
+
+      /* landing inside a run that shares an object splits it; the
+         entries after this one get a copy of their own */
+      if ( place > 0 && place + 1 < count
+           && slot( place - 1 ).state == slot( place + 1 ).state
+           && slot( place ).state != slot( place + 1 ).state ) {
+        shared::shared_ptr<State> copy( new State( *slot( place + 1 ).state ) );
+        const State *shared_state = slot( place + 1 ).state.get();
+        for ( size_t i = place + 1; i < count && slot( i ).state.get() == shared_state; i++ ) {
+          slot( i ).state = copy;
+        }
+      }
+
+      return place;
+    }
+
+    void pop_front( void )
+    {
+      assert( count > 0 );
+      slot( 0 ).state.reset();
+      first = (first + 1) & (slots.size() - 1);
+      count--;
+    }
+
+    /* Remove the i-th entry, moving up whichever side of it is shorter. */
+    void erase( size_t i )
+    {
+      assert( i < count );
+      if ( i < count / 2 ) {
+        for ( size_t j = i; j > 0; j-- ) {
+          slot( j ) = slot( j - 1 );
+        }
+        pop_front();
+      } else {
+        for ( size_t j = i; j + 1 < count; j++ ) {
+          slot( j ) = slot( j + 1 );
+        }
+        slot( count - 1 ).state.reset();
+        count--;
+      }
+    }
+
+    /* Drop every entry numbered below num. Returns how many went. */
+    size_t cut( uint64_t num )
+    {
+      size_t dropped = 0;
+      while ( count > 0 && front().num < num ) {
+        pop_front();
+        dropped++;
+      }
+      return dropped;
+    }
+
+    /* index of the first entry numbered num, or size() if there is none */
+    size_t find( uint64_t num ) const
+    {
+      if ( empty() ) {
+        return 0;
+      }
+
+      uint64_t offset = num - front().num;
+      if ( num >= front().num && offset < count && slot( offset ).num == num
+           && (offset == 0 || slot( offset - 1 ).num != num) ) {
+        return offset;
+      }
+
+      size_t low = 0, high = count;
+      while ( low < high ) {
+        size_t mid = low + (high - low) / 2;
+        if ( slot( mid ).num < num ) {
+          low = mid + 1;
+        } else {
+          high = mid;
+        }
+      }
+      return (low < count && slot( low ).num == num) ? low : count;
+    }
+
+    /* Cut the front state, which the other side surely has, off every
+       state, once each; the front's own last, as the rest are cut
+       against it. */
+    void subtract_front( void )
+    {
+      assert( !empty() );
+      State *known = front().state.get();
+      const State *previous = NULL;
+      for ( size_t i = count; i-- > 0; ) {
+        State *state = slot( i ).state.get();
+        if ( state != previous && state != known ) {
+          state->subtract( known );
+        }
+        previous = state;
+      }
+      known->subtract( known );
+    }
+
+    /* Let every state give back what it no longer needs. */
+    void compact( void )
+    {
+      const State *previous = NULL;
+      for ( size_t i = 0; i < count; i++ ) {
+        State *state = slot( i ).state.get();
+        if ( state != previous ) {
+          state->compact();
+        }
+        previous = state;
+      }
+    }
   };
 }
 
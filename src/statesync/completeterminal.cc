@@ -44,6 +44,8 @@ using namespace HostBuffers;
 
 string Complete::act( const string &str )
 {
+  version.bump();
+
   for ( unsigned int i = 0; i < str.size(); i++ ) {
     /* parse octet into up to three actions */
     list<Action *> actions( parser.input( str[ i ] ) );
@@ -63,6 +65,8 @@ string Complete::act( const string &str )
 
 string Complete::act( const Action *act )
 {
+  version.bump();
+
   /* apply action to terminal */
   act->act_on_terminal( &terminal );
   return terminal.read_octets_to_host();
@@ -109,6 +113,7 @@ void Complete::apply_string( string diff )
       uint64_t inst_echo_ack_num = input.instruction( i ).GetExtension( echoack ).echo_ack_num();
       assert( inst_echo_ack_num >= echo_ack );
       echo_ack = inst_echo_ack_num;
+      version.bump();
     }
   }
 }
@@ -141,6 +146,7 @@ bool Complete::set_echo_ack( uint64_t now )
 
   if ( echo_ack != newest_echo_ack ) {
     ret = true;
+    version.bump();
   }
 
   echo_ack = newest_echo_ack;
@@ -38,6 +38,7 @@
 
 #include "parser.h"
 #include "terminal.h"
+#include "stateversion.h"
 
 /* This class represents the complete terminal -- a UTF8Parser feeding Actions to an Emulator. */
 
@@ -52,11 +53,13 @@ namespace Terminal {
     input_history_type input_history;
     uint64_t echo_ack;
 
+    StateVersion version;
+
     static const int ECHO_TIMEOUT = 50; /* for late ack */
 
   public:
     Complete( size_t width, size_t height ) : parser(), terminal( width, height ), display( false ),
-					      input_history(), echo_ack( 0 ) {}
+					      input_history(), echo_ack( 0 ), version() {}
     
     std::string act( const std::string &str );
     std::string act( const Parser::Action *act );
@@ -70,6 +73,7 @@ namespace Terminal {
     int wait_time( uint64_t now ) const;
 
     /* interface for Network::Transport */
+    uint64_t get_version( void ) const { return version.get(); }
     void subtract( const Complete * ) {}
     std::string diff_from( const Complete &existing ) const;
     void apply_string( std::string diff );
@@ -39,6 +39,7 @@
 #include <assert.h>
 
 #include "parseraction.h"
+#include "stateversion.h"
 
 using std::deque;
 using std::list;
@@ -75,18 +76,20 @@ namespace Network {
   {
   private:
     deque<UserEvent> actions;
+    StateVersion version;
     
   public:
-    UserStream() : actions() {}
+    UserStream() : actions(), version() {}
     
-    void push_back( Parser::UserByte s_userbyte ) { actions.push_back( UserEvent( s_userbyte ) ); }
-    void push_back( Parser::Resize s_resize ) { actions.push_back( UserEvent( s_resize ) ); }
+    void push_back( Parser::UserByte s_userbyte ) { version.bump(); actions.push_back( UserEvent( s_userbyte ) ); }
+    void push_back( Parser::Resize s_resize ) { version.bump(); actions.push_back( UserEvent( s_resize ) ); }
     
     bool empty( void ) const { return actions.empty(); }
     size_t size( void ) const { return actions.size(); }
     const Parser::Action *get_action( unsigned int i );
     
     /* interface for Network::Transport */
+    uint64_t get_version( void ) const { return version.get(); }
     void subtract( const UserStream *prefix );
     string diff_from( const UserStream &existing ) const;
     void apply_string( string diff );
@@ -1,52 +1,345 @@
+#include <assert.h>
+#include <vector>
+
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+
 #include "commandstream.h"
+#include "fatal_assert.h"
+#include "wireformat.h"
 
 #include "commandmessage.pb.h"
 
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::io::CodedOutputStream;
+using google::protobuf::io::StringOutputStream;
+
+/* CommandMessages are encoded and decoded by hand rather than through
+   the generated classes; see wireformat.h. The wire format is that of
+   commandmessage.proto. */
+
 namespace Term {
 
+using namespace WireFormat;
+
+static int extension_field( CommandType type ) {
+  switch ( type ) {
+  case GeneralType:
+    return TermBuffers::kGeneralFieldNumber;
+  case DataType:
+    return TermBuffers::kDataFieldNumber;
+  case SignalType:
+    return TermBuffers::kSignalFieldNumber;
+  default:
+    assert( false );
+    return -1;
+  }
+}
+
 void CommandStream::subtract(const CommandStream *prefix) {
-  for (std::deque<std::string>::const_iterator i = prefix->actions.begin();
-    i != prefix->actions.end();
-    i++) {
-    actions.pop_front();
+  /* prefix is an earlier copy of this stream, so its ends are our new
+     beginnings */
+  for (int i = 0; i < NUM_PRIORITIES; i++) {
+    Lane &lane = lanes[i];
+    const Lane &prefix_lane = prefix->lanes[i];
+    if (prefix_lane.actions.get_end_num() > lane.actions.get_begin_num()) {
+      lane.actions.cut(prefix_lane.actions.get_end_num());
+      lane.begin_bytes = prefix_lane.end_bytes;
+    }
+  }
+
+  /* the other side may still be sent references this far back */
+  const uint64_t begin_bytes = lanes[NormalPriority].begin_bytes;
+  if (begin_bytes > RepeatCache::WINDOW) {
+    repeats->forget_before(begin_bytes - RepeatCache::WINDOW);
+  }
+}
+
+/* Called on an idle stream: free the lanes if everything in them has
+   been subtracted, and pack the repeat cache away until it is needed.
+   The transport does this to each of its copies, which share the cache. */
+void CommandStream::compact() {
+  for (int i = 0; i < NUM_PRIORITIES; i++) {
+    lanes[i].actions.compact();
   }
+  repeats->pack();
 }
 
+/* Consecutive commands of the same type are sent as one Instruction,
+   their payloads back to back followed by a packed list of lengths,
+   in the way UserStream merges keystrokes. The receiver splits them up
+   again, so both sides agree on command numbers.
+
+   A large command that repeats one the receiver still has cached (see
+   RepeatCache) is sent on its own, as the distance back to it.
+
+   Each lane goes into its own field of the CommandMessage. */
+void CommandStream::diff_lane(CodedOutputStream &out, Priority priority,
+                              const CommandStream &existing, bool references) const {
+  const SharedLog<Command> &actions = lanes[priority].actions;
+  const Lane &existing_lane = existing.lanes[priority];
+  assert(existing_lane.actions.get_end_num() >= actions.get_begin_num());
+  assert(existing_lane.actions.get_end_num() <= actions.get_end_num());
+
+  const int instruction_field = priority == HighPriority
+    ? TermBuffers::CommandMessage::kPriorityInstructionFieldNumber
+    : TermBuffers::CommandMessage::kInstructionFieldNumber;
+
+  /* the receiver has cached what ends at or after this; without
+     references, nothing we would refer to */
+  const uint64_t oldest_repeat = !references ? uint64_t(-1)
+    : existing_lane.end_bytes > RepeatCache::WINDOW
+    ? existing_lane.end_bytes - RepeatCache::WINDOW : 0;
+
+  uint64_t num = existing_lane.actions.get_end_num();
+  uint64_t start = existing_lane.end_bytes;
+  while (num < actions.get_end_num()) {
+    const Command &first = actions.get(num);
+    const CommandType type = first.type;
+    const int field = extension_field(type);
 
-std::string CommandStream::diff_from(const CommandStream &existing) const {
-  std::deque<std::string>::const_iterator my_it = actions.begin();
+    if (first.repeat_of != 0 && first.repeat_of >= oldest_repeat) {
+      const uint32_t repeat_tag = make_tag(TermBuffers::General::kRepeatOfFieldNumber, WIRETYPE_VARINT);
+      const uint64_t distance = start - first.repeat_of;
+      size_t extension_len = CodedOutputStream::VarintSize32(repeat_tag)
+        + CodedOutputStream::VarintSize64(distance);
 
-  for (std::deque<std::string>::const_iterator i = existing.actions.begin();
-    i != existing.actions.end();
-    i++) {
-    my_it++;
+      write_header(out, instruction_field, field_size(field, extension_len));
+      write_header(out, field, extension_len);
+      out.WriteTag(repeat_tag);
+      out.WriteVarint64(distance);
+
+      start += first.size();
+      num++;
+      continue;
+    }
+
+    /* find the run of commands to merge */
+    uint64_t run_end = num;
+    size_t payload_total = 0, lengths_len = 0;
+    while (run_end < actions.get_end_num()) {
+      const Command &command = actions.get(run_end);
+      if (run_end > num
+          && (command.type != type
+              || payload_total + command.size() > MAX_COALESCED_SIZE
+              || (command.repeat_of != 0 && command.repeat_of >= oldest_repeat))) {
+        break;
+      }
+      payload_total += command.size();
+      lengths_len += CodedOutputStream::VarintSize32(command.size());
+      run_end++;
+    }
+
+    const bool merged = run_end - num > 1;
+    size_t extension_len = field_size(TermBuffers::General::kPayloadFieldNumber, payload_total);
+    if (merged) {
+      extension_len += field_size(TermBuffers::General::kLengthsFieldNumber, lengths_len);
+    }
+
+    write_header(out, instruction_field, field_size(field, extension_len));
+    write_header(out, field, extension_len);
+    write_header(out, TermBuffers::General::kPayloadFieldNumber, payload_total);
+    for (uint64_t i = num; i < run_end; i++) {
+      const Command &command = actions.get(i);
+      out.WriteRaw(command.data(), command.size());
+    }
+    if (merged) {
+      write_header(out, TermBuffers::General::kLengthsFieldNumber, lengths_len);
+      for (uint64_t i = num; i < run_end; i++) {
+        out.WriteVarint32(actions.get(i).size());
+      }
+    }
+
+    start += payload_total;
+    num = run_end;
   }
+}
 
-  TermBuffers::CommandMessage output;
+/* New high-priority commands go first, so that they lead the first
+   fragment of the diff. */
+std::string CommandStream::diff(const CommandStream &existing, bool references) const {
+  std::string output;
+  {
+    StringOutputStream stream(&output);
+    CodedOutputStream out(&stream);
 
-  while (my_it != actions.end()) {
-    TermBuffers::Instruction *new_inst = output.add_instruction();
-    new_inst->MutableExtension(TermBuffers::general)->set_payload(*my_it);
+    diff_lane(out, HighPriority, existing, references);
+    diff_lane(out, NormalPriority, existing, references);
+  }
+
+  return output;
+}
+
+/* Parse one Instruction and append its commands. The payloads are not
+   copied; the new Commands point into buffer.
+
+   The repeat statistics are kept here rather than by the sender, which
+   diffs the same commands many times over and sends only some of the
+   diffs: the transport applies each diff it takes exactly once. */
+void CommandStream::apply_instruction(CodedInputStream &in, Priority priority,
+                                      const shared::shared_ptr<const std::string> &buffer) {
+  CommandType type = GeneralType;
+  size_t offset = 0, length = 0;
+  std::vector<uint32_t> lengths;
+  bool repeat = false;
+  uint64_t repeat_distance = 0;
+
+  uint32_t tag;
+  while ((tag = in.ReadTag()) != 0) {
+    int field = tag >> 3;
+    if (field == TermBuffers::kGeneralFieldNumber) {
+      type = GeneralType;
+    } else if (field == TermBuffers::kDataFieldNumber) {
+      type = DataType;
+    } else if (field == TermBuffers::kSignalFieldNumber) {
+      type = SignalType;
+    } else {
+      fatal_assert(skip_field(in, tag));
+      continue;
+    }
+    fatal_assert((tag & 7) == WIRETYPE_LENGTH_DELIMITED);
 
-    my_it++;
+    uint32_t extension_len;
+    fatal_assert(in.ReadVarint32(&extension_len));
+    CodedInputStream::Limit limit = in.PushLimit(extension_len);
+
+    offset = length = 0;
+    lengths.clear();
+    repeat = false;
+    while ((tag = in.ReadTag()) != 0) {
+      if (tag == make_tag(TermBuffers::General::kPayloadFieldNumber, WIRETYPE_LENGTH_DELIMITED)) {
+        uint32_t len;
+        fatal_assert(in.ReadVarint32(&len));
+        offset = in.CurrentPosition();
+        length = len;
+        fatal_assert(in.Skip(len));
+      } else if (tag == make_tag(TermBuffers::General::kLengthsFieldNumber, WIRETYPE_LENGTH_DELIMITED)) {
+        uint32_t len;
+        fatal_assert(in.ReadVarint32(&len));
+        CodedInputStream::Limit packed_limit = in.PushLimit(len);
+        while (in.BytesUntilLimit() > 0) {
+          uint32_t command_len;
+          fatal_assert(in.ReadVarint32(&command_len));
+          lengths.push_back(command_len);
+        }
+        in.PopLimit(packed_limit);
+      } else if (tag == make_tag(TermBuffers::General::kLengthsFieldNumber, WIRETYPE_VARINT)) {
+        uint32_t command_len;
+        fatal_assert(in.ReadVarint32(&command_len));
+        lengths.push_back(command_len);
+      } else if (tag == make_tag(TermBuffers::General::kRepeatOfFieldNumber, WIRETYPE_VARINT)) {
+        fatal_assert(in.ReadVarint64(&repeat_distance));
+        repeat = true;
+      } else {
+        fatal_assert(skip_field(in, tag));
+      }
+    }
+    fatal_assert(in.ConsumedEntireMessage());
+    in.PopLimit(limit);
+  }
+
+  if (repeat) {
+    const uint64_t end_bytes = lanes[priority].end_bytes;
+    fatal_assert(priority == NormalPriority && repeat_distance <= end_bytes);
+    const Payload *original = repeats->get(end_bytes - repeat_distance);
+    fatal_assert(original != NULL);
+    repeats->count_lookup();
+    repeats->count_hit(original->size());
+    append(priority, Command(type, *original), false);
+    return;
   }
 
-  return output.SerializeAsString();
+  if (lengths.empty()) {
+    count_lookup(priority, length);
+    append(priority, Command(type, buffer, offset, length), false);
+    return;
+  }
+
+  for (std::vector<uint32_t>::const_iterator i = lengths.begin();
+       i != lengths.end();
+       i++) {
+    fatal_assert(*i <= length);
+    count_lookup(priority, *i);
+    append(priority, Command(type, buffer, offset, *i), false);
+    offset += *i;
+    length -= *i;
+  }
+  fatal_assert(length == 0);
 }
 
 void CommandStream::apply_string(std::string diff) {
-  TermBuffers::CommandMessage input;
-  input.ParseFromString(diff);
+  /* take over the diff's buffer; the new commands will point into it */
+  shared::shared_ptr<std::string> owned(new std::string);
+  owned->swap(diff);
+  shared::shared_ptr<const std::string> buffer(owned);
 
-  for (int i = 0; i < input.instruction_size(); i++) {
-    std::string message =
-      input.instruction(i).GetExtension(TermBuffers::general).payload();
-    actions.push_back(message);
+  CodedInputStream in(reinterpret_cast<const uint8_t *>(buffer->data()), buffer->size());
+
+  uint32_t tag;
+  while ((tag = in.ReadTag()) != 0) {
+    Priority priority;
+    if (tag == make_tag(TermBuffers::CommandMessage::kInstructionFieldNumber,
+                        WIRETYPE_LENGTH_DELIMITED)) {
+      priority = NormalPriority;
+    } else if (tag == make_tag(TermBuffers::CommandMessage::kPriorityInstructionFieldNumber,
+                               WIRETYPE_LENGTH_DELIMITED)) {
+      priority = HighPriority;
+    } else {
+      fatal_assert(skip_field(in, tag));
+      continue;
+    }
+
+    uint32_t len;
+    fatal_assert(in.ReadVarint32(&len));
+    CodedInputStream::Limit limit = in.PushLimit(len);
+    apply_instruction(in, priority, buffer);
+    fatal_assert(in.ConsumedEntireMessage());
+    in.PopLimit(limit);
   }
+  fatal_assert(in.ConsumedEntireMessage());
 }
 
-const std::string *CommandStream::get_action(unsigned int i) {
-  return &actions[i];
+/* Each lane's beginning, the commands from there written out in full,
+   and the repeat cache, which the sender may still refer to. */
+std::string CommandStream::save(void) const {
+  TermBuffers::SavedStream saved;
+  CommandStream start;
+  for (int i = 0; i < NUM_PRIORITIES; i++) {
+    const Lane &lane = lanes[i];
+    saved.add_begin_num(lane.actions.get_begin_num());
+    saved.add_begin_bytes(lane.begin_bytes);
+    start.lanes[i].actions.skip_to(lane.actions.get_begin_num());
+    start.lanes[i].begin_bytes = start.lanes[i].end_bytes = lane.begin_bytes;
+  }
+  saved.set_commands(diff(start, false));
+
+  const std::map<uint64_t, Payload> &cached = repeats->get_all();
+  for (std::map<uint64_t, Payload>::const_iterator i = cached.begin(); i != cached.end(); i++) {
+    TermBuffers::SavedRepeat *repeat = saved.add_repeat();
+    repeat->set_end(i->first);
+    repeat->set_payload(i->second.data(), i->second.size());
+  }
+
+  return saved.SerializeAsString();
+}
+
+void CommandStream::restore(const std::string &s) {
+  TermBuffers::SavedStream saved;
+  fatal_assert(saved.ParseFromString(s));
+  fatal_assert(saved.begin_num_size() == NUM_PRIORITIES
+               && saved.begin_bytes_size() == NUM_PRIORITIES);
+
+  *this = CommandStream();
+  for (int i = 0; i < NUM_PRIORITIES; i++) {
+    lanes[i].actions.skip_to(saved.begin_num(i));
+    lanes[i].begin_bytes = lanes[i].end_bytes = saved.begin_bytes(i);
+  }
+  for (int i = 0; i < saved.repeat_size(); i++) {
+    repeats->remember(saved.repeat(i).end(), Payload(saved.repeat(i).payload()), false);
+  }
+  apply_string(saved.commands());
+  /* those came from the other process, not the sender */
+  repeats->clear_stats();
 }
 
-} // namespace Term
\ No newline at end of file
+} // namespace Term
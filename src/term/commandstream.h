@@ -1,32 +1,186 @@
 #ifndef TERM_COMMANDSTREAM_H_
 #define TERM_COMMANDSTREAM_H_
 
-#include <deque>
+#include <stdint.h>
 #include <string>
 
+#include "payload.h"
+#include "repeatcache.h"
+#include "shared.h"
+#include "sharedlog.h"
+#include "stateversion.h"
+
+namespace google {
+  namespace protobuf {
+    namespace io {
+      class CodedInputStream;
+      class CodedOutputStream;
+    }
+  }
+}
+
 namespace Term {
+  enum CommandType {
+    GeneralType = 0, /* a command string */
+    DataType = 1,    /* uninterpreted bytes */
+    SignalType = 2   /* a signal for the commands the server is running,
+                        as its number in decimal */
+  };
+
+  /* Each priority is a separate lane of the stream, numbered on its own.
+     A diff carries the new high-priority commands ahead of the rest, and
+     the receiver can act on them without waiting for the normal ones
+     sent before them. */
+  enum Priority {
+    NormalPriority = 0,
+    HighPriority = 1
+  };
+  static const int NUM_PRIORITIES = 2;
+
+  /* One entry in a CommandStream. */
+  class Command : public Payload {
+    public:
+      CommandType type;
+
+      /* on the sending side, where an identical earlier command ends
+         in the stream, or 0 */
+      uint64_t repeat_of;
+
+      Command( CommandType s_type, const std::string &payload )
+        : Payload( payload ), type( s_type ), repeat_of( 0 ) {}
+
+      Command( CommandType s_type, const Payload &payload )
+        : Payload( payload ), type( s_type ), repeat_of( 0 ) {}
+
+      Command( CommandType s_type, const shared::shared_ptr<const std::string> &s_buffer,
+               size_t s_offset, size_t s_length )
+        : Payload( s_buffer, s_offset, s_length ), type( s_type ), repeat_of( 0 ) {}
+  };
+
+  /* A CommandStream is an append-only sequence of commands. Every command
+     has an absolute sequence number, counted from the start of the session.
+
+     All of the states a Transport keeps around are prefixes of the same
+     stream, so comparing two of them, diffing them or cutting a common
+     prefix off is just arithmetic on [begin_num, end_num). The commands
+     themselves are kept in a SharedLog, so the many copies the transport
+     holds share one set of strings.
+
+     Commands go into one of NUM_PRIORITIES lanes, each a sequence of its
+     own; the accessors below default to the normal one.
+
+     A normal command that repeats a recent large one is sent as a
+     reference to it; see RepeatCache. Only one copy of a stream may be
+     appended to by push_back() for that to work, as in the transport's
+     sender. */
 	class CommandStream {
     private:
-      std::deque<std::string> actions;
+      /* limit on the payload of one merged Instruction */
+      static const size_t MAX_COALESCED_SIZE = 8192;
+
+      class Lane {
+        public:
+          SharedLog<Command> actions;
+
+          /* payload bytes in the lane before get_begin_num() and before
+             get_end_num(), counted from the start of the session */
+          uint64_t begin_bytes;
+          uint64_t end_bytes;
+
+          Lane() : actions(), begin_bytes(0), end_bytes(0) { }
+      };
+
+      Lane lanes[NUM_PRIORITIES];
+
+      /* shared by all copies; covers the normal lane */
+      shared::shared_ptr<RepeatCache> repeats;
+
+      StateVersion version;
+
+      void append(Priority priority, const Command &command, bool sending) {
+        version.bump();
+        Lane &lane = lanes[priority];
+        lane.actions.push_back(command);
+        lane.end_bytes += command.size();
+        if (priority == NormalPriority) {
+          repeats->remember(lane.end_bytes, command, sending);
+        }
+      }
+
+      void diff_lane(google::protobuf::io::CodedOutputStream &out, Priority priority,
+                     const CommandStream &existing, bool references) const;
+      std::string diff(const CommandStream &existing, bool references) const;
+      void apply_instruction(google::protobuf::io::CodedInputStream &in, Priority priority,
+                             const shared::shared_ptr<const std::string> &buffer);
+      /* a command of size received in full that could have been a repeat */
+      void count_lookup(Priority priority, size_t size) {
+        if (priority == NormalPriority && size >= RepeatCache::MIN_SIZE) {
+          repeats->count_lookup();
+        }
+      }
 
     public:
-      CommandStream() : actions() { }
-      
-      void push_back(std::string str) { actions.push_back(str); }  
+      CommandStream() : lanes(), repeats(new RepeatCache), version() { }
+
+      void push_back(const std::string &str) { push_back(GeneralType, str); }
+      void push_back(CommandType type, const std::string &str,
+                     Priority priority = NormalPriority) {
+        Command command(type, str);
+        if (priority == NormalPriority) {
+          command.repeat_of = repeats->find(command);
+        }
+        append(priority, command, true);
+      }
+
+      bool empty(Priority priority = NormalPriority) const { return lanes[priority].actions.empty(); }
+      size_t size(Priority priority = NormalPriority) const { return lanes[priority].actions.size(); }
+      const Command *get_action(unsigned int i, Priority priority = NormalPriority) const {
+        return &lanes[priority].actions[i];
+      }
+
+      uint64_t get_begin_num(Priority priority = NormalPriority) const {
+        return lanes[priority].actions.get_begin_num();
+      }
+      uint64_t get_end_num(Priority priority = NormalPriority) const {
+        return lanes[priority].actions.get_end_num();
+      }
+
+      /* total payload size of the commands held; on the sending side,
+         the bytes not yet acknowledged */
+      uint64_t get_bytes(Priority priority = NormalPriority) const {
+        return lanes[priority].end_bytes - lanes[priority].begin_bytes;
+      }
+
+      /* payload bytes pushed since the start of the session */
+      uint64_t get_end_bytes(Priority priority = NormalPriority) const {
+        return lanes[priority].end_bytes;
+      }
 
-      bool empty() const { return actions.empty(); }
-      size_t size() const { return actions.size(); }
-      const std::string *get_action(unsigned int i);
+      /* on the receiving side, what came as references */
+      const RepeatCache::Stats &get_repeat_stats( void ) const { return repeats->get_stats(); }
 
       /* interface for Network::Transport */
+      /* unchanged by subtract() and compact(), which only drop what
+         the other side already has */
+      uint64_t get_version( void ) const { return version.get(); }
       void subtract(const CommandStream *prefix);
-      std::string diff_from(const CommandStream &existing) const;
+      void compact( void );
+      std::string diff_from(const CommandStream &existing) const { return diff(existing, true); }
       void apply_string(std::string diff);
+      /* The whole stream and the repeat cache, for another process to
+         restore() as the receiving side's copy. */
+      std::string save( void ) const;
+      void restore(const std::string &saved);
       bool operator==(const CommandStream &s) const {
-        return actions == s.actions;
+        for (int i = 0; i < NUM_PRIORITIES; i++) {
+          if (lanes[i].actions.get_end_num() != s.lanes[i].actions.get_end_num()) {
+            return false;
+          }
+        }
+        return true;
       }
       bool compare(const CommandStream &s) const { return false; }
 	};
 }
 
-#endif // TERM_COMMANDSTREAM_H_
\ No newline at end of file
+#endif // TERM_COMMANDSTREAM_H_
@@ -0,0 +1,31 @@
+#ifndef TERM_PAYLOAD_H_
+#define TERM_PAYLOAD_H_
+
+#include <string>
+
+#include "shared.h"
+
+namespace Term {
+  /* An immutable string that is a slice of a buffer, which may be shared
+     with other payloads, e.g. all of those that arrived in one diff. */
+  class Payload {
+    private:
+      shared::shared_ptr<const std::string> buffer;
+      size_t offset;
+      size_t length;
+
+    public:
+      Payload( const std::string &s )
+        : buffer( new std::string( s ) ), offset( 0 ), length( s.size() ) {}
+
+      Payload( const shared::shared_ptr<const std::string> &s_buffer,
+               size_t s_offset, size_t s_length )
+        : buffer( s_buffer ), offset( s_offset ), length( s_length ) {}
+
+      const char *data( void ) const { return buffer->data() + offset; }
+      size_t size( void ) const { return length; }
+      std::string str( void ) const { return std::string( data(), size() ); }
+  };
+}
+
+#endif // TERM_PAYLOAD_H_
@@ -0,0 +1,135 @@
+#include <string.h>
+#include <zlib.h>
+
+#include "fatal_assert.h"
+#include "repeatcache.h"
+
+namespace Term {
+
+/* 64-bit FNV-1a */
+static uint64_t hash( const Payload &payload ) {
+  const unsigned char *p = reinterpret_cast<const unsigned char *>( payload.data() );
+  const unsigned char *end = p + payload.size();
+  uint64_t h = 14695981039346656037ULL;
+  while ( p < end ) {
+    h ^= *p++;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+uint64_t RepeatCache::find( const Payload &payload ) {
+  if ( payload.size() < MIN_SIZE ) {
+    return 0;
+  }
+  unpack();
+
+  std::map<uint64_t, uint64_t>::const_iterator i = by_hash.find( hash( payload ) );
+  if ( i == by_hash.end() ) {
+    return 0;
+  }
+
+  const Payload *cached = get( i->second );
+  if ( cached == NULL
+       || cached->size() != payload.size()
+       || memcmp( cached->data(), payload.data(), payload.size() ) != 0 ) {
+    return 0;
+  }
+  return i->second;
+}
+
+void RepeatCache::remember( uint64_t end, const Payload &payload, bool index ) {
+  if ( payload.size() < MIN_SIZE ) {
+    return;
+  }
+  unpack();
+
+  by_end.erase( end );
+  by_end.insert( std::make_pair( end, payload ) );
+  if ( index ) {
+    by_hash[ hash( payload ) ] = end;
+  }
+}
+
+const Payload *RepeatCache::get( uint64_t end ) {
+  unpack();
+  std::map<uint64_t, Payload>::const_iterator i = by_end.find( end );
+  return i == by_end.end() ? NULL : &i->second;
+}
+
+void RepeatCache::forget_before( uint64_t offset ) {
+  /* an idle stream keeps being asked to forget what it already has */
+  if ( !packed_index.empty() && packed_index.front().first >= offset ) {
+    return;
+  }
+  unpack();
+  by_end.erase( by_end.begin(), by_end.lower_bound( offset ) );
+
+  /* the hash index is pruned lazily: a stale entry just fails to find()
+     its payload, so only sweep once they are the majority */
+  if ( by_hash.size() <= 2 * by_end.size() + 64 ) {
+    return;
+  }
+  for ( std::map<uint64_t, uint64_t>::iterator i = by_hash.begin(); i != by_hash.end(); ) {
+    if ( i->second < offset ) {
+      by_hash.erase( i++ );
+    } else {
+      i++;
+    }
+  }
+}
+
+void RepeatCache::pack( void ) {
+  if ( by_end.empty() ) {
+    return;
+  }
+  unpack();
+
+  std::string payloads;
+  for ( std::map<uint64_t, Payload>::const_iterator i = by_end.begin(); i != by_end.end(); i++ ) {
+    payloads.append( i->second.data(), i->second.size() );
+    packed_index.push_back( std::make_pair( i->first, i->second.size() ) );
+  }
+
+  uLongf packed_len = compressBound( payloads.size() );
+  packed.resize( packed_len );
+  fatal_assert( compress( reinterpret_cast<Bytef *>( &packed[ 0 ] ), &packed_len,
+                          reinterpret_cast<const Bytef *>( payloads.data() ),
+                          payloads.size() ) == Z_OK );
+  packed.resize( packed_len );
+  std::string( packed ).swap( packed ); /* give back the slack */
+
+  /* this lets go of the buffers the payloads were read into, too */
+  by_end.clear();
+}
+
+void RepeatCache::unpack( void ) {
+  if ( packed_index.empty() ) {
+    return;
+  }
+
+  size_t total = 0;
+  for ( size_t i = 0; i < packed_index.size(); i++ ) {
+    total += packed_index[ i ].second;
+  }
+
+  std::string *payloads = new std::string( total, '\0' );
+  shared::shared_ptr<const std::string> buffer( payloads );
+  uLongf payloads_len = total;
+  fatal_assert( uncompress( reinterpret_cast<Bytef *>( &(*payloads)[ 0 ] ), &payloads_len,
+                            reinterpret_cast<const Bytef *>( packed.data() ),
+                            packed.size() ) == Z_OK
+                && payloads_len == total );
+
+  size_t offset = 0;
+  for ( size_t i = 0; i < packed_index.size(); i++ ) {
+    by_end.insert( std::make_pair( packed_index[ i ].first,
+                                   Payload( buffer, offset, packed_index[ i ].second ) ) );
+    offset += packed_index[ i ].second;
+  }
+
+  std::string().swap( packed );
+  std::vector< std::pair<uint64_t, size_t> >().swap( packed_index );
+}
+
+}
@@ -0,0 +1,86 @@
+#ifndef TERM_REPEATCACHE_H_
+#define TERM_REPEATCACHE_H_
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "payload.h"
+
+namespace Term {
+  /* Remembers the recent large payloads of a CommandStream, so that a
+     command identical to an earlier one can be sent as a reference to
+     it. One cache is shared by all copies of a stream.
+
+     Payloads are keyed by where they end in the stream, in bytes from
+     the start of the session, which both sides agree on. Both sides
+     keep everything ending within WINDOW bytes before the oldest state
+     they still hold, and the sender only refers that far back from the
+     state its diff is based on, so a reference always finds its target.
+
+     The sender also indexes payloads by a hash of their content; hits
+     are checked byte for byte, so collisions only cost a miss.
+
+     While its stream is idle the cache may be pack()ed: the payloads,
+     up to WINDOW bytes of them, are deflated into one string and
+     inflated again on the next lookup. */
+  class RepeatCache {
+    public:
+      /* payloads smaller than this are never cached */
+      static const size_t MIN_SIZE = 256;
+      static const uint64_t WINDOW = 4 * 1024 * 1024;
+
+      /* kept by the receiver, so that each command is counted once
+         for every time it arrives */
+      class Stats {
+        public:
+          uint64_t lookups; /* large commands received, in full or not */
+          uint64_t hits; /* of them, references received */
+          uint64_t bytes_saved; /* payload bytes not sent */
+
+          Stats() : lookups( 0 ), hits( 0 ), bytes_saved( 0 ) {}
+      };
+
+    private:
+      std::map<uint64_t, Payload> by_end;
+      std::map<uint64_t, uint64_t> by_hash; /* content hash to end */
+      Stats stats;
+
+      /* by_end while packed: the payloads deflated back to back, and
+         where each ends in the stream and how long it is */
+      std::string packed;
+      std::vector< std::pair<uint64_t, size_t> > packed_index;
+
+      void unpack( void );
+
+    public:
+      RepeatCache() : by_end(), by_hash(), stats(), packed(), packed_index() {}
+
+      /* Where an identical payload still in the cache ends, or 0. */
+      uint64_t find( const Payload &payload );
+
+      /* Keep payload, which ends at end; index it if we are the sender. */
+      void remember( uint64_t end, const Payload &payload, bool index );
+
+      /* The payload ending at end, or NULL if it was never cached. */
+      const Payload *get( uint64_t end );
+
+      /* Drop everything ending before offset. */
+      void forget_before( uint64_t offset );
+
+      void count_lookup( void ) { stats.lookups++; }
+      void count_hit( size_t bytes ) { stats.hits++; stats.bytes_saved += bytes; }
+      const Stats &get_stats( void ) const { return stats; }
+      void clear_stats( void ) { stats = Stats(); }
+
+      /* Deflate the payloads until they are next needed. */
+      void pack( void );
+      /* every payload cached, by where it ends */
+      const std::map<uint64_t, Payload> &get_all( void ) { unpack(); return by_end; }
+
+      size_t size( void ) const { return by_end.size() + packed_index.size(); }
+  };
+}
+
+#endif // TERM_REPEATCACHE_H_
@@ -0,0 +1,140 @@
+#ifndef TERM_SHAREDLOG_H_
+#define TERM_SHAREDLOG_H_
+
+#include <assert.h>
+#include <stdint.h>
+#include <vector>
+
+#include "shared.h"
+
+namespace Term {
+  /* An append-only log whose copies share storage.
+
+     Entries live in fixed-size chunks that are never modified once an
+     entry has been written, only appended to. Copying a log copies the
+     list of chunk pointers, not the entries. A copy may append in place
+     to a shared tail chunk as long as nobody else has appended past its
+     own end; otherwise it forks the tail first. Memory is therefore
+     proportional to the number of distinct entries, not to the number
+     of copies.
+
+     Entries are numbered absolutely from the start of the log. Cutting
+     off a prefix drops whole chunks once no entry in them is needed, and
+     compact() drops the chunk an empty log is still partway through. */
+  template <class Entry>
+  class SharedLog {
+    private:
+      static const uint64_t CHUNK_SIZE = 256;
+
+      class Chunk {
+        public:
+          /* the first entry's place in the chunk; nonzero only when a
+             compacted log starts again partway through one */
+          size_t offset;
+          std::vector<Entry> entries;
+
+          /* reserved up front so that appending never moves entries
+             another copy may be reading */
+          Chunk( size_t s_offset = 0 ) : offset( s_offset ), entries() {
+            entries.reserve( CHUNK_SIZE - offset );
+          }
+      };
+
+      typedef shared::shared_ptr<Chunk> chunk_ptr;
+
+      /* chunks.front() holds entries from first_chunk * CHUNK_SIZE; a
+         vector, unlike a deque, costs nothing while it is empty */
+      std::vector<chunk_ptr> chunks;
+      uint64_t first_chunk;
+
+      uint64_t begin_num;
+      uint64_t end_num;
+
+      const Entry &at( uint64_t num ) const {
+        assert( num >= begin_num && num < end_num );
+        const Chunk &chunk = *chunks[ num / CHUNK_SIZE - first_chunk ];
+        return chunk.entries[ num % CHUNK_SIZE - chunk.offset ];
+      }
+
+      /* Make sure the tail chunk ends exactly at our end. */
+      void fork_tail( void ) {
+        assert( !chunks.empty() );
+        const size_t offset = chunks.back()->offset;
+        size_t used = end_num - (first_chunk + chunks.size() - 1) * CHUNK_SIZE - offset;
+        const std::vector<Entry> &tail = chunks.back()->entries;
+        assert( tail.size() >= used );
+        if ( tail.size() != used ) {
+          chunk_ptr fork( new Chunk( offset ) );
+          fork->entries.insert( fork->entries.end(), tail.begin(), tail.begin() + used );
+          chunks.back() = fork;
+        }
+      }
+
+    public:
+      SharedLog() : chunks(), first_chunk( 0 ), begin_num( 0 ), end_num( 0 ) {}
+
+      uint64_t get_begin_num( void ) const { return begin_num; }
+      uint64_t get_end_num( void ) const { return end_num; }
+      bool empty( void ) const { return begin_num == end_num; }
+      size_t size( void ) const { return end_num - begin_num; }
+
+      /* i-th entry after begin_num */
+      const Entry &operator[]( size_t i ) const { return at( begin_num + i ); }
+
+      /* entry by absolute number */
+      const Entry &get( uint64_t num ) const { return at( num ); }
+
+      void push_back( const Entry &e ) {
+        if ( chunks.empty() ) {
+          first_chunk = end_num / CHUNK_SIZE;
+          chunks.push_back( chunk_ptr( new Chunk( end_num % CHUNK_SIZE ) ) );
+        } else if ( end_num % CHUNK_SIZE == 0 ) {
+          assert( first_chunk + chunks.size() == end_num / CHUNK_SIZE );
+          chunks.push_back( chunk_ptr( new Chunk ) );
+        } else {
+          fork_tail();
+        }
+
+        chunks.back()->entries.push_back( e );
+        end_num++;
+      }
+
+      /* Forget everything before num. */
+      void cut( uint64_t num ) {
+        if ( num <= begin_num ) {
+          return;
+        }
+        assert( num <= end_num );
+        begin_num = num;
+
+        size_t unneeded = 0;
+        while ( unneeded < chunks.size() && (first_chunk + 1) * CHUNK_SIZE <= begin_num ) {
+          unneeded++;
+          first_chunk++;
+        }
+        chunks.erase( chunks.begin(), chunks.begin() + unneeded );
+        if ( chunks.empty() ) {
+          first_chunk = begin_num / CHUNK_SIZE;
+        }
+      }
+
+      /* Start a new, empty log at num, as if num entries had been
+         pushed and cut. */
+      void skip_to( uint64_t num ) {
+        assert( chunks.empty() && end_num == 0 );
+        first_chunk = num / CHUNK_SIZE;
+        begin_num = end_num = num;
+      }
+
+      /* If the log is empty, let go of the storage it still shares;
+         the next push_back() starts a chunk of its own. */
+      void compact( void ) {
+        if ( empty() ) {
+          std::vector<chunk_ptr>().swap( chunks );
+          first_chunk = end_num / CHUNK_SIZE;
+        }
+      }
+  };
+}
+
+#endif // TERM_SHAREDLOG_H_
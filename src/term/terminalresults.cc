@@ -0,0 +1,189 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+
+#include "terminalresults.h"
+#include "fatal_assert.h"
+#include "wireformat.h"
+
+#include "terminalresults.pb.h"
+
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::io::CodedOutputStream;
+using google::protobuf::io::StringOutputStream;
+
+/* ResultMessages are encoded and decoded by hand, like CommandMessages,
+   so that output is neither copied into nor out of generated classes.
+   The wire format is that of terminalresults.proto. */
+
+namespace Term {
+
+using namespace WireFormat;
+
+static uint32_t zigzag( int32_t n ) {
+  return (uint32_t( n ) << 1) ^ uint32_t( n >> 31 );
+}
+
+static int32_t unzigzag( uint32_t n ) {
+  return int32_t( (n >> 1) ^ -(n & 1) );
+}
+
+std::string TerminalResults::diff_from(const TerminalResults &existing) const {
+  assert(existing.get_end_num() >= get_begin_num());
+  assert(existing.get_end_num() <= get_end_num());
+
+  std::string output;
+  {
+    StringOutputStream stream(&output);
+    CodedOutputStream out(&stream);
+
+    const uint32_t command_tag = make_tag(TermBuffers::Event::kCommandFieldNumber, WIRETYPE_VARINT);
+    const uint32_t status_tag = make_tag(TermBuffers::Event::kExitStatusFieldNumber, WIRETYPE_VARINT);
+
+    for (uint64_t num = existing.get_end_num(); num < get_end_num(); num++) {
+      const ResultEvent &event = events.get(num);
+
+      size_t event_len = CodedOutputStream::VarintSize32(command_tag)
+        + CodedOutputStream::VarintSize64(event.command);
+      if (event.finished) {
+        event_len += CodedOutputStream::VarintSize32(status_tag)
+          + CodedOutputStream::VarintSize32(zigzag(event.exit_status));
+      } else {
+        event_len += field_size(TermBuffers::Event::kOutputFieldNumber, event.size());
+      }
+
+      write_header(out, TermBuffers::ResultMessage::kEventFieldNumber, event_len);
+      out.WriteTag(command_tag);
+      out.WriteVarint64(event.command);
+      if (event.finished) {
+        out.WriteTag(status_tag);
+        out.WriteVarint32(zigzag(event.exit_status));
+      } else {
+        write_header(out, TermBuffers::Event::kOutputFieldNumber, event.size());
+        out.WriteRaw(event.data(), event.size());
+      }
+    }
+
+    if (credit != existing.credit) {
+      out.WriteTag(make_tag(TermBuffers::ResultMessage::kCreditFieldNumber, WIRETYPE_VARINT));
+      out.WriteVarint64(credit);
+    }
+  }
+
+  return output;
+}
+
+/* Parse one Event and append it. Output is not copied; the new event
+   points into buffer. */
+void TerminalResults::apply_event(CodedInputStream &in,
+                                  const shared::shared_ptr<const std::string> &buffer) {
+  uint64_t command = 0;
+  size_t offset = 0, length = 0;
+  bool finished = false;
+  int exit_status = 0;
+
+  uint32_t tag;
+  while ((tag = in.ReadTag()) != 0) {
+    if (tag == make_tag(TermBuffers::Event::kCommandFieldNumber, WIRETYPE_VARINT)) {
+      fatal_assert(in.ReadVarint64(&command));
+    } else if (tag == make_tag(TermBuffers::Event::kOutputFieldNumber, WIRETYPE_LENGTH_DELIMITED)) {
+      uint32_t len;
+      fatal_assert(in.ReadVarint32(&len));
+      offset = in.CurrentPosition();
+      length = len;
+      fatal_assert(in.Skip(len));
+    } else if (tag == make_tag(TermBuffers::Event::kExitStatusFieldNumber, WIRETYPE_VARINT)) {
+      uint32_t status;
+      fatal_assert(in.ReadVarint32(&status));
+      exit_status = unzigzag(status);
+      finished = true;
+    } else {
+      fatal_assert(skip_field(in, tag));
+    }
+  }
+
+  events.push_back(ResultEvent(command, buffer, offset, length, finished, exit_status));
+  end_bytes += length;
+}
+
+void TerminalResults::apply_string(std::string diff) {
+  version.bump();
+
+  /* take over the diff's buffer; the new events will point into it */
+  shared::shared_ptr<std::string> owned(new std::string);
+  owned->swap(diff);
+  shared::shared_ptr<const std::string> buffer(owned);
+
+  CodedInputStream in(reinterpret_cast<const uint8_t *>(buffer->data()), buffer->size());
+
+  uint32_t tag;
+  while ((tag = in.ReadTag()) != 0) {
+    if (tag == make_tag(TermBuffers::ResultMessage::kEventFieldNumber,
+                        WIRETYPE_LENGTH_DELIMITED)) {
+      uint32_t len;
+      fatal_assert(in.ReadVarint32(&len));
+      CodedInputStream::Limit limit = in.PushLimit(len);
+      apply_event(in, buffer);
+      fatal_assert(in.ConsumedEntireMessage());
+      in.PopLimit(limit);
+    } else if (tag == make_tag(TermBuffers::ResultMessage::kCreditFieldNumber, WIRETYPE_VARINT)) {
+      fatal_assert(in.ReadVarint64(&credit));
+    } else {
+      fatal_assert(skip_field(in, tag));
+    }
+  }
+  fatal_assert(in.ConsumedEntireMessage());
+}
+
+std::string TerminalResults::save(void) const {
+  TermBuffers::SavedResults saved;
+  TerminalResults start;
+  start.events.skip_to(get_begin_num());
+
+  saved.set_begin_num(get_begin_num());
+  saved.set_credit(credit);
+  saved.set_events(diff_from(start));
+  return saved.SerializeAsString();
+}
+
+void TerminalResults::restore(const std::string &s) {
+  TermBuffers::SavedResults saved;
+  fatal_assert(saved.ParseFromString(s));
+
+  *this = TerminalResults();
+  events.skip_to(saved.begin_num());
+  apply_string(saved.events());
+  credit = saved.credit();
+}
+
+/* For the sender's round-trip check: whether s differs from us in the
+   events both hold, in where they end or in the credit. */
+bool TerminalResults::compare(const TerminalResults &s) const {
+  bool ret = false;
+  if (!(*this == s)) {
+    fprintf(stderr, "Results end at %d with credit %d vs. at %d with credit %d.\n",
+            (int)get_end_num(), (int)credit, (int)s.get_end_num(), (int)s.credit);
+    ret = true;
+  }
+
+  const uint64_t end = std::min(get_end_num(), s.get_end_num());
+  for (uint64_t num = std::max(get_begin_num(), s.get_begin_num()); num < end; num++) {
+    const ResultEvent &mine = events.get(num);
+    const ResultEvent &theirs = s.events.get(num);
+    if (mine.command != theirs.command || mine.finished != theirs.finished
+        || mine.exit_status != theirs.exit_status
+        || mine.size() != theirs.size()
+        || memcmp(mine.data(), theirs.data(), mine.size()) != 0) {
+      fprintf(stderr, "Result event %d differs.\n", (int)num);
+      ret = true;
+    }
+  }
+
+  return ret;
+}
+
+} // namespace Term
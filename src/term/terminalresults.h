@@ -0,0 +1,128 @@
+#ifndef TERM_TERMINALRESULTS_H_
+#define TERM_TERMINALRESULTS_H_
+
+#include <assert.h>
+#include <stdint.h>
+#include <string>
+
+#include "payload.h"
+#include "shared.h"
+#include "sharedlog.h"
+#include "stateversion.h"
+
+namespace google {
+  namespace protobuf {
+    namespace io {
+      class CodedInputStream;
+    }
+  }
+}
+
+namespace Term {
+  /* One entry in a TerminalResults: either a piece of a command's
+     output or, if finished, its exit status. */
+  class ResultEvent : public Payload {
+    public:
+      uint64_t command;
+      bool finished;
+      int exit_status;
+
+      ResultEvent( uint64_t s_command, const std::string &output )
+        : Payload( output ), command( s_command ), finished( false ), exit_status( 0 ) {}
+
+      ResultEvent( uint64_t s_command, int s_exit_status )
+        : Payload( std::string() ), command( s_command ), finished( true ),
+          exit_status( s_exit_status ) {}
+
+      ResultEvent( uint64_t s_command, const shared::shared_ptr<const std::string> &s_buffer,
+                   size_t s_offset, size_t s_length, bool s_finished, int s_exit_status )
+        : Payload( s_buffer, s_offset, s_length ), command( s_command ),
+          finished( s_finished ), exit_status( s_exit_status ) {}
+  };
+
+  /* The server's side of a session: the output and exit status of each
+     command the client sent, as an append-only log of events.
+
+     Like a CommandStream, every copy the transport keeps is a prefix of
+     the same log, so a diff carries only the events the other side has
+     not seen, however much output came before them.
+
+     It also carries the server's flow-control credit for the client's
+     CommandStream, so that the client stops sending commands before
+     the server has to refuse them. */
+  class TerminalResults {
+    private:
+      SharedLog<ResultEvent> events;
+
+      /* output bytes before get_begin_num() and before get_end_num(),
+         counted from wherever this copy's line of states began */
+      uint64_t begin_bytes;
+      uint64_t end_bytes;
+
+      /* flow control for the client's CommandStream: the server will
+         absorb commands up to this byte offset in it */
+      uint64_t credit;
+
+      StateVersion version;
+
+      void apply_event(google::protobuf::io::CodedInputStream &in,
+                       const shared::shared_ptr<const std::string> &buffer);
+
+    public:
+      /* credit assumed by both sides before the server says otherwise */
+      static const uint64_t INITIAL_CREDIT = 1024 * 1024;
+
+      TerminalResults() : events(), begin_bytes( 0 ), end_bytes( 0 ), credit( INITIAL_CREDIT ), version() { }
+
+      void append_output(uint64_t command, const std::string &output) {
+        version.bump();
+        events.push_back(ResultEvent(command, output));
+        end_bytes += output.size();
+      }
+      void finish(uint64_t command, int exit_status) {
+        version.bump();
+        events.push_back(ResultEvent(command, exit_status));
+      }
+
+      uint64_t get_credit( void ) const { return credit; }
+      void set_credit(uint64_t s_credit) {
+        assert(s_credit >= credit);
+        if (s_credit != credit) {
+          version.bump();
+          credit = s_credit;
+        }
+      }
+
+      bool empty() const { return events.empty(); }
+      size_t size() const { return events.size(); }
+      const ResultEvent *get_event(unsigned int i) const { return &events[i]; }
+
+      /* output bytes of the events held; on the sending side, the
+         output not yet acknowledged */
+      uint64_t get_bytes( void ) const { return end_bytes - begin_bytes; }
+
+      uint64_t get_begin_num( void ) const { return events.get_begin_num(); }
+      uint64_t get_end_num( void ) const { return events.get_end_num(); }
+
+      /* interface for Network::Transport */
+      uint64_t get_version( void ) const { return version.get(); }
+      void subtract(const TerminalResults *prefix) {
+        if (prefix->get_end_num() > get_begin_num()) {
+          events.cut(prefix->get_end_num());
+          begin_bytes = prefix->end_bytes;
+        }
+      }
+      void compact( void ) { events.compact(); }
+      std::string diff_from(const TerminalResults &existing) const;
+      void apply_string(std::string diff);
+      /* the whole state, for another process to restore() */
+      std::string save( void ) const;
+      void restore(const std::string &saved);
+      bool operator==(const TerminalResults &s) const {
+        return events.get_end_num() == s.events.get_end_num() && credit == s.credit;
+      }
+      bool compare(const TerminalResults &s) const;
+  };
+}
+
+#endif // TERM_TERMINALRESULTS_H_
@@ -0,0 +1,55 @@
+#ifndef TERM_WIREFORMAT_H_
+#define TERM_WIREFORMAT_H_
+
+#include <stdint.h>
+
+#include <google/protobuf/io/coded_stream.h>
+
+/* Helpers for the state types that encode and decode their protobuf
+   messages by hand, so that payloads are written straight from and
+   sliced straight out of their own buffers. */
+
+namespace Term {
+  namespace WireFormat {
+    static const int WIRETYPE_VARINT = 0;
+    static const int WIRETYPE_FIXED64 = 1;
+    static const int WIRETYPE_LENGTH_DELIMITED = 2;
+    static const int WIRETYPE_FIXED32 = 5;
+
+    inline uint32_t make_tag( int field, int wiretype ) {
+      return (uint32_t( field ) << 3) | wiretype;
+    }
+
+    /* size of a length-delimited field holding len bytes */
+    inline size_t field_size( int field, size_t len ) {
+      using google::protobuf::io::CodedOutputStream;
+      return CodedOutputStream::VarintSize32( make_tag( field, WIRETYPE_LENGTH_DELIMITED ) )
+        + CodedOutputStream::VarintSize32( len ) + len;
+    }
+
+    inline void write_header( google::protobuf::io::CodedOutputStream &out, int field, size_t len ) {
+      out.WriteTag( make_tag( field, WIRETYPE_LENGTH_DELIMITED ) );
+      out.WriteVarint32( len );
+    }
+
+    /* skip over an unknown field; returns false on malformed input */
+    inline bool skip_field( google::protobuf::io::CodedInputStream &in, uint32_t tag ) {
+      uint64_t dummy64;
+      uint32_t dummy32;
+      switch ( tag & 7 ) {
+      case WIRETYPE_VARINT:
+        return in.ReadVarint64( &dummy64 );
+      case WIRETYPE_FIXED64:
+        return in.ReadLittleEndian64( &dummy64 );
+      case WIRETYPE_LENGTH_DELIMITED:
+        return in.ReadVarint32( &dummy32 ) && in.Skip( dummy32 );
+      case WIRETYPE_FIXED32:
+        return in.ReadLittleEndian32( &dummy32 );
+      default:
+        return false;
+      }
+    }
+  }
+}
+
+#endif // TERM_WIREFORMAT_H_
@@ -0,0 +1,474 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Tests Term::CommandStream the way Network::Transport uses it: many
+   copies of one stream, diffed against each other, branched, applied
+   and rationalized. */
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "commandstream.h"
+#include "commandmessage.pb.h"
+#include "fatal_assert.h"
+
+using Term::CommandStream;
+
+bool verbose = false;
+
+static std::string command( int i )
+{
+  char buf[ 32 ];
+  snprintf( buf, sizeof( buf ), "command %d", i );
+  return std::string( buf );
+}
+
+static void check_contents( const CommandStream &s, int first, int count )
+{
+  fatal_assert( s.size() == size_t( count ) );
+  uint64_t bytes = 0;
+  for ( int i = 0; i < count; i++ ) {
+    fatal_assert( s.get_action( i )->str() == command( first + i ) );
+    bytes += s.get_action( i )->size();
+  }
+  fatal_assert( s.get_bytes() == bytes );
+}
+
+/* A copy shares storage with its original. */
+static void test_sharing( void )
+{
+  CommandStream a;
+  for ( int i = 0; i < 1000; i++ ) {
+    a.push_back( command( i ) );
+  }
+
+  CommandStream b( a );
+  fatal_assert( a == b );
+  for ( size_t i = 0; i < a.size(); i++ ) {
+    fatal_assert( a.get_action( i )->data() == b.get_action( i )->data() );
+  }
+
+  /* appending to one does not show up in the other */
+  b.push_back( command( 1000 ) );
+  fatal_assert( !(a == b) );
+  check_contents( a, 0, 1000 );
+  check_contents( b, 0, 1001 );
+}
+
+/* Two copies of the same state that grow differently must not see
+   each other's commands. */
+static void test_branch( void )
+{
+  CommandStream base;
+  for ( int i = 0; i < 300; i++ ) {
+    base.push_back( command( i ) );
+  }
+
+  CommandStream left( base ), right( base );
+  left.push_back( command( 300 ) );
+  right.push_back( std::string( "something else" ) );
+  right.push_back( command( 302 ) );
+
+  check_contents( base, 0, 300 );
+  check_contents( left, 0, 301 );
+  fatal_assert( right.get_action( 300 )->str() == "something else" );
+  fatal_assert( right.get_action( 301 )->str() == command( 302 ) );
+}
+
+/* Diffs between copies recreate the newer state on the other side. */
+static void test_diff_apply( void )
+{
+  CommandStream sent, received;
+  std::vector<CommandStream> history;
+
+  for ( int round = 0; round < 20; round++ ) {
+    CommandStream assumed( sent );
+    for ( int i = 0; i < 50 * round; i++ ) {
+      sent.push_back( command( sent.get_end_num() ) );
+    }
+
+    received.apply_string( sent.diff_from( assumed ) );
+    fatal_assert( received == sent );
+    history.push_back( sent );
+
+    /* everything up to the previous round has been acknowledged */
+    if ( history.size() > 1 ) {
+      const CommandStream *acked = &history[ history.size() - 2 ];
+      sent.subtract( acked );
+      received.subtract( acked );
+      fatal_assert( sent.get_begin_num() == acked->get_end_num() );
+    }
+
+    check_contents( received, received.get_begin_num(), received.size() );
+  }
+
+  /* diffing a state against itself produces no instructions */
+  CommandStream again( received );
+  again.apply_string( sent.diff_from( sent ) );
+  fatal_assert( again == received );
+}
+
+/* The hand-written encoder and decoder agree with the generated code. */
+static void test_wire_format( void )
+{
+  CommandStream empty, sent;
+  sent.push_back( command( 0 ) );
+  sent.push_back( Term::DataType, std::string( "\0binary\xff", 8 ) );
+  sent.push_back( std::string() );
+
+  TermBuffers::CommandMessage parsed;
+  fatal_assert( parsed.ParseFromString( sent.diff_from( empty ) ) );
+  fatal_assert( parsed.instruction_size() == 3 );
+  fatal_assert( parsed.instruction( 0 ).GetExtension( TermBuffers::general ).payload() == command( 0 ) );
+  fatal_assert( parsed.instruction( 1 ).GetExtension( TermBuffers::data ).payload()
+                == std::string( "\0binary\xff", 8 ) );
+  fatal_assert( parsed.instruction( 2 ).HasExtension( TermBuffers::general ) );
+
+  CommandStream received;
+  received.apply_string( parsed.SerializeAsString() );
+  fatal_assert( received.size() == 3 );
+  fatal_assert( received.get_action( 0 )->type == Term::GeneralType );
+  fatal_assert( received.get_action( 1 )->type == Term::DataType );
+  fatal_assert( received.get_action( 1 )->str() == std::string( "\0binary\xff", 8 ) );
+  fatal_assert( received.get_action( 2 )->size() == 0 );
+}
+
+/* Runs of small commands of one type share an Instruction, but come
+   out the other side as the same commands with the same numbers. */
+static void test_coalescing( void )
+{
+  CommandStream empty, sent;
+  for ( int i = 0; i < 2000; i++ ) {
+    if ( i % 500 == 499 ) {
+      sent.push_back( Term::DataType, std::string( 3, char( i ) ) );
+    } else {
+      sent.push_back( command( i ) );
+    }
+  }
+  sent.push_back( std::string( 10000, 'x' ) );
+  sent.push_back( command( 2001 ) );
+
+  std::string diff = sent.diff_from( empty );
+
+  TermBuffers::CommandMessage parsed;
+  fatal_assert( parsed.ParseFromString( diff ) );
+  fatal_assert( parsed.instruction_size() > 8 );
+  fatal_assert( parsed.instruction_size() < 30 );
+  for ( int i = 0; i < parsed.instruction_size(); i++ ) {
+    const TermBuffers::Instruction &inst = parsed.instruction( i );
+    if ( inst.HasExtension( TermBuffers::general ) ) {
+      const TermBuffers::General &general = inst.GetExtension( TermBuffers::general );
+      /* only the oversized command may exceed the limit, and alone */
+      fatal_assert( general.payload().size() <= 8192 || general.lengths_size() == 0 );
+    }
+  }
+
+  CommandStream received;
+  received.apply_string( diff );
+  fatal_assert( received == sent );
+  fatal_assert( received.size() == sent.size() );
+  for ( size_t i = 0; i < sent.size(); i++ ) {
+    fatal_assert( received.get_action( i )->type == sent.get_action( i )->type );
+    fatal_assert( received.get_action( i )->str() == sent.get_action( i )->str() );
+  }
+
+  /* a merged diff is much smaller than one Instruction per command */
+  fatal_assert( diff.size() < 2000 * (command( 1000 ).size() + 4) + 10100 );
+}
+
+static std::string big_command( int i, size_t size )
+{
+  std::string s = command( i );
+  s.resize( size, 'a' + i % 26 );
+  return s;
+}
+
+/* Repeats of recent large commands go as references, and come out the
+   other side whole. */
+static void test_repeats( void )
+{
+  CommandStream sent, received;
+  CommandStream acked( sent );
+
+  for ( int round = 0; round < 10; round++ ) {
+    CommandStream assumed( sent );
+    for ( int i = 0; i < 20; i++ ) {
+      sent.push_back( big_command( i % 4, 2000 ) );
+    }
+    sent.push_back( std::string( "small" ) );
+
+    std::string diff = sent.diff_from( assumed );
+    fatal_assert( sent.diff_from( assumed ) == diff ); /* as a resend check does */
+    if ( round > 0 ) {
+      /* everything but the small command is a repeat */
+      fatal_assert( diff.size() < 200 );
+    }
+
+    CommandStream next( received );
+    next.apply_string( diff );
+    fatal_assert( next == sent );
+    for ( size_t i = 0; i < 21; i++ ) {
+      const std::string expected = i < 20 ? big_command( i % 4, 2000 ) : "small";
+      fatal_assert( next.get_action( next.size() - 21 + i )->str() == expected );
+    }
+
+    /* the receiver's own diffs never contain references */
+    CommandStream copy;
+    copy.apply_string( next.diff_from( received ) );
+    fatal_assert( copy.size() == 21 && copy.get_action( 0 )->str() == big_command( 0, 2000 ) );
+
+    received.subtract( &acked );
+    next.subtract( &acked );
+    sent.subtract( &acked );
+    received = next;
+    acked = assumed;
+  }
+
+  /* counted as received, however often the sender diffed them */
+  const Term::RepeatCache::Stats &stats = received.get_repeat_stats();
+  fatal_assert( stats.lookups == 200 );
+  fatal_assert( stats.hits == 196 );
+  fatal_assert( stats.bytes_saved == 196 * 2000 );
+  fatal_assert( sent.get_repeat_stats().lookups == 0 );
+
+  /* nothing is referred to further back than the window */
+  CommandStream assumed( sent );
+  const std::string filler( 64 * 1024, 'f' );
+  for ( size_t bytes = 0; bytes <= Term::RepeatCache::WINDOW; bytes += filler.size() ) {
+    sent.push_back( Term::DataType, filler + command( bytes ) );
+  }
+  received.apply_string( sent.diff_from( assumed ) );
+  received.subtract( &assumed );
+  sent.subtract( &assumed );
+  assumed = sent;
+
+  sent.push_back( big_command( 0, 2000 ) );
+  std::string diff = sent.diff_from( assumed );
+  fatal_assert( diff.size() > 2000 );
+  received.apply_string( diff );
+  fatal_assert( received == sent );
+  fatal_assert( received.get_action( received.size() - 1 )->str() == big_command( 0, 2000 ) );
+}
+
+/* An idle stream compacted by the transport carries on where it left
+   off, references to its packed repeat cache included. */
+static void test_compact( void )
+{
+  CommandStream sent, received;
+  for ( int i = 0; i < 300; i++ ) {
+    sent.push_back( i % 10 ? command( i ) : big_command( i, 1000 ) );
+  }
+  received.apply_string( sent.diff_from( CommandStream() ) );
+
+  /* everything is acknowledged, in the middle of a chunk */
+  CommandStream acked( sent );
+  sent.subtract( &acked );
+  received.subtract( &acked );
+  fatal_assert( sent.empty() && received.empty() );
+
+  sent.compact();
+  received.compact();
+  fatal_assert( sent.get_end_num() == 300 && received.get_end_num() == 300 );
+  fatal_assert( sent == received );
+
+  /* still idle: subtracting again leaves the cache packed */
+  received.subtract( &acked );
+
+  for ( int i = 300; i < 320; i++ ) {
+    sent.push_back( command( i ) );
+  }
+  sent.push_back( big_command( 290, 1000 ) );
+  std::string diff = sent.diff_from( acked );
+  fatal_assert( diff.size() < 1000 );
+
+  received.apply_string( diff );
+  fatal_assert( received == sent );
+  fatal_assert( received.size() == 21 );
+  for ( int i = 0; i < 20; i++ ) {
+    fatal_assert( received.get_action( i )->str() == command( 300 + i ) );
+  }
+  fatal_assert( received.get_action( 20 )->str() == big_command( 290, 1000 ) );
+
+  /* and compacting a stream that is not empty changes nothing */
+  received.compact();
+  fatal_assert( received.size() == 21 && received.get_action( 0 )->str() == command( 300 ) );
+}
+
+static void test_save( void )
+{
+  CommandStream sent, received;
+  for ( int i = 0; i < 200; i++ ) {
+    sent.push_back( i % 10 ? command( i ) : big_command( i, 1000 ) );
+  }
+  sent.push_back( Term::SignalType, "2", Term::HighPriority );
+  received.apply_string( sent.diff_from( CommandStream() ) );
+
+  /* half of it is acknowledged */
+  CommandStream acked;
+  acked.apply_string( sent.diff_from( CommandStream() ) );
+  for ( int i = 200; i < 300; i++ ) {
+    sent.push_back( command( i ) );
+  }
+  received.apply_string( sent.diff_from( acked ) );
+  received.subtract( &acked );
+
+  CommandStream restored;
+  restored.restore( received.save() );
+  fatal_assert( restored == received );
+  fatal_assert( restored.get_repeat_stats().lookups == 0 );
+  fatal_assert( restored.get_begin_num() == 200 && restored.size() == 100 );
+  fatal_assert( restored.get_end_bytes() == received.get_end_bytes() );
+  fatal_assert( restored.get_bytes() == received.get_bytes() );
+  fatal_assert( restored.get_end_num( Term::HighPriority ) == 1 );
+  check_contents( restored, 200, 100 );
+
+  /* the restored cache still resolves the sender's references, in
+     every copy of the stream */
+  CommandStream copy( restored );
+  sent.push_back( big_command( 190, 1000 ) );
+  std::string diff = sent.diff_from( received );
+  fatal_assert( diff.size() < 100 );
+  restored.apply_string( diff );
+  copy.apply_string( diff );
+  fatal_assert( restored == sent && copy == sent );
+  fatal_assert( restored.get_action( 100 )->str() == big_command( 190, 1000 ) );
+  fatal_assert( copy.get_action( 100 )->str() == big_command( 190, 1000 ) );
+}
+
+static void test_priorities( void )
+{
+  CommandStream sent;
+  for ( int i = 0; i < 100; i++ ) {
+    sent.push_back( command( i ) );
+  }
+  CommandStream acked( sent );
+
+  for ( int i = 0; i < 50; i++ ) {
+    sent.push_back( Term::DataType, std::string( 1000, char( i ) ) );
+  }
+  CommandStream bulk_only( sent );
+  sent.push_back( Term::SignalType, "2", Term::HighPriority );
+  sent.push_back( Term::GeneralType, "urgent", Term::HighPriority );
+
+  /* the lanes are numbered and counted separately */
+  fatal_assert( sent.get_end_num() == 150 );
+  fatal_assert( sent.get_end_num( Term::HighPriority ) == 2 );
+  fatal_assert( sent.get_bytes( Term::HighPriority ) == 7 );
+  fatal_assert( !(sent == bulk_only) );
+
+  /* high-priority instructions lead the diff */
+  std::string diff = sent.diff_from( acked );
+  fatal_assert( diff[ 0 ] == char( (TermBuffers::CommandMessage::kPriorityInstructionFieldNumber << 3) | 2 ) );
+
+  TermBuffers::CommandMessage parsed;
+  fatal_assert( parsed.ParseFromString( diff ) );
+  fatal_assert( parsed.priority_instruction_size() == 2 );
+  fatal_assert( parsed.priority_instruction( 0 ).HasExtension( TermBuffers::signal ) );
+  fatal_assert( parsed.priority_instruction( 1 ).HasExtension( TermBuffers::general ) );
+
+  CommandStream received( acked );
+  received.apply_string( diff );
+  fatal_assert( received == sent );
+  fatal_assert( received.get_action( 0, Term::HighPriority )->type == Term::SignalType );
+  fatal_assert( received.get_action( 0, Term::HighPriority )->str() == "2" );
+  fatal_assert( received.get_action( 1, Term::HighPriority )->str() == "urgent" );
+  fatal_assert( received.get_action( 99 )->str() == command( 99 ) );
+  fatal_assert( received.get_action( 149 )->str() == std::string( 1000, char( 49 ) ) );
+
+  /* a diff of just the high-priority lane */
+  std::string urgent_only = sent.diff_from( bulk_only );
+  fatal_assert( urgent_only.size() < 32 );
+
+  /* acknowledging cuts both lanes */
+  CommandStream snapshot( sent );
+  sent.push_back( command( 150 ) );
+  sent.subtract( &snapshot );
+  fatal_assert( sent.size() == 1 );
+  fatal_assert( sent.empty( Term::HighPriority ) );
+  fatal_assert( sent.get_begin_num( Term::HighPriority ) == 2 );
+}
+
+/* A copy has the version of what it was copied from until either
+   changes; cutting off what the other side has is not a change. */
+static void test_versions( void )
+{
+  CommandStream sent;
+  sent.push_back( command( 0 ) );
+
+  CommandStream copy( sent );
+  fatal_assert( copy.get_version() == sent.get_version() );
+
+  sent.push_back( command( 1 ) );
+  fatal_assert( copy.get_version() != sent.get_version() );
+
+  CommandStream acked( sent );
+  sent.subtract( &copy );
+  sent.compact();
+  fatal_assert( sent.get_version() == acked.get_version() );
+
+  sent.push_back( Term::SignalType, "2", Term::HighPriority );
+  fatal_assert( sent.get_version() != acked.get_version() );
+
+  /* a receiver's copy has a version of its own, however equal */
+  CommandStream received;
+  received.apply_string( acked.diff_from( CommandStream() ) );
+  fatal_assert( received == acked && received.get_version() != acked.get_version() );
+  CommandStream unchanged( received );
+  received.apply_string( received.diff_from( unchanged ) );
+  fatal_assert( received.get_version() == unchanged.get_version() );
+}
+
+int main( int argc, char *argv[] )
+{
+  if ( argc >= 2 && strcmp( argv[ 1 ], "-v" ) == 0 ) {
+    verbose = true;
+  }
+
+  test_sharing();
+  test_branch();
+  test_diff_apply();
+  test_wire_format();
+  test_coalescing();
+  test_repeats();
+  test_compact();
+  test_save();
+  test_priorities();
+  test_versions();
+
+  if ( verbose ) {
+    printf( "command-stream: all tests passed\n" );
+  }
+
+  return 0;
+}
@@ -0,0 +1,157 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+
+
+/* Tests EventLoop with each backend: level- and edge-triggered fds,
+   removing fds, signals, timeouts and regular files. */
+
+#include "config.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "eventloop.h"
+#include "fatal_assert.h"
+
+bool verbose = false;
+
+static void make_pipe( int fds[ 2 ] )
+{
+  fatal_assert( pipe( fds ) == 0 );
+  fatal_assert( fcntl( fds[ 0 ], F_SETFL, O_NONBLOCK ) == 0 );
+}
+
+static void test_fds( bool use_epoll )
+{
+  EventLoop loop( use_epoll );
+  int level[ 2 ], edge[ 2 ];
+  make_pipe( level );
+  make_pipe( edge );
+  loop.add_fd( level[ 0 ] );
+  loop.add_fd( edge[ 0 ], true );
+
+  /* nothing ready: times out */
+  fatal_assert( loop.wait( 0 ) == 0 );
+  fatal_assert( !loop.read( level[ 0 ] ) && !loop.read( edge[ 0 ] ) );
+
+  fatal_assert( write( level[ 1 ], "ab", 2 ) == 2 );
+  fatal_assert( write( edge[ 1 ], "ab", 2 ) == 2 );
+  fatal_assert( loop.wait( 1000 ) == 2 );
+  fatal_assert( loop.read( level[ 0 ] ) && loop.read( edge[ 0 ] ) );
+  fatal_assert( !loop.error( level[ 0 ] ) );
+
+  /* a level-triggered fd is reported until it is drained; an
+     edge-triggered one, with epoll, only once */
+  char buf[ 2 ];
+  fatal_assert( read( level[ 0 ], buf, 1 ) == 1 );
+  fatal_assert( read( edge[ 0 ], buf, 1 ) == 1 );
+  loop.wait( 0 );
+  fatal_assert( loop.read( level[ 0 ] ) );
+  if ( use_epoll && strcmp( loop.backend(), "epoll" ) == 0 ) {
+    fatal_assert( !loop.read( edge[ 0 ] ) );
+  }
+
+  /* a removed fd is not reported */
+  loop.remove_fd( level[ 0 ] );
+  fatal_assert( !loop.has_fd( level[ 0 ] ) );
+  loop.wait( 0 );
+  fatal_assert( !loop.read( level[ 0 ] ) );
+
+  /* the writer going away makes the reader readable, as with select() */
+  fatal_assert( read( level[ 0 ], buf, 2 ) == 1 );
+  close( level[ 1 ] );
+  loop.add_fd( level[ 0 ] );
+  fatal_assert( loop.wait( 1000 ) >= 1 );
+  fatal_assert( loop.read( level[ 0 ] ) );
+
+  close( level[ 0 ] );
+  close( edge[ 0 ] );
+  close( edge[ 1 ] );
+}
+
+static void test_regular_file( bool use_epoll )
+{
+  EventLoop loop( use_epoll );
+  char name[] = "/tmp/event-loop.XXXXXX";
+  int file = mkstemp( name );
+  fatal_assert( file >= 0 );
+  unlink( name );
+
+  /* epoll refuses regular files, which select() always reports */
+  loop.add_fd( file );
+  fatal_assert( loop.wait( 1000 ) == 1 );
+  fatal_assert( loop.read( file ) );
+  loop.remove_fd( file );
+  fatal_assert( loop.wait( 0 ) == 0 );
+
+  close( file );
+}
+
+static void test_signals( bool use_epoll )
+{
+  EventLoop loop( use_epoll );
+  loop.add_signal( SIGUSR1 );
+  loop.add_signal( SIGUSR2 );
+
+  /* blocked until wait() */
+  fatal_assert( kill( getpid(), SIGUSR2 ) == 0 );
+  fatal_assert( !loop.any_signal() );
+  loop.wait( 1000 );
+  fatal_assert( loop.any_signal() );
+  fatal_assert( loop.signal( SIGUSR2 ) && !loop.signal( SIGUSR1 ) );
+
+  loop.wait( 0 );
+  fatal_assert( !loop.any_signal() );
+}
+
+int main( int argc, char *argv[] )
+{
+  if ( argc >= 2 && strcmp( argv[ 1 ], "-v" ) == 0 ) {
+    verbose = true;
+  }
+
+  for ( int use_epoll = 0; use_epoll < 2; use_epoll++ ) {
+    test_fds( use_epoll );
+    test_regular_file( use_epoll );
+    test_signals( use_epoll );
+
+    if ( verbose ) {
+      printf( "event-loop: %s backend passed\n", EventLoop( use_epoll ).backend() );
+    }
+  }
+
+  return 0;
+}
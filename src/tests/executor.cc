@@ -0,0 +1,106 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Tests Executor's cancel() against a worker taking the same session's
+   command off the queue: wherever it lands, the command is killed or
+   never started, and its worker is free again without the output
+   ever being acknowledged. */
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "executor.h"
+#include "fatal_assert.h"
+
+bool verbose = false;
+
+static const int ROUNDS = 500;
+static const int TIMEOUT_MS = 10000;
+
+/* far more than Executor::OUTPUT_WINDOW, and never acknowledged */
+static const char FLOOD[] = "exec head -c 4000000 /dev/zero";
+
+/* Collect until session's command finishes, and return its
+   output. Fails if the pool has no worker left to run it. */
+static std::string wait_for( Executor &executor, uint64_t session )
+{
+  std::string output;
+  while ( true ) {
+    Executor::Result result;
+    while ( executor.collect( result ) ) {
+      if ( result.session != session ) {
+        continue; /* from a cancelled session */
+      }
+      if ( result.finished ) {
+        fatal_assert( result.exit_status == 0 );
+        return output;
+      }
+      output += result.output;
+    }
+
+    struct pollfd pfd = { executor.fd(), POLLIN, 0 };
+    fatal_assert( poll( &pfd, 1, TIMEOUT_MS ) == 1 );
+  }
+}
+
+int main( int argc, char *argv[] )
+{
+  if ( argc >= 2 && strcmp( argv[ 1 ], "-v" ) == 0 ) {
+    verbose = true;
+  }
+
+  srandom( getpid() );
+
+  /* one worker, so a stuck one fails the next probe */
+  Executor executor( 1 );
+  for ( int i = 0; i < ROUNDS; i++ ) {
+    const uint64_t doomed = 2 * i + 1;
+    const uint64_t probe = 2 * i + 2;
+
+    executor.submit( doomed, 0, FLOOD );
+    /* anywhere from before the worker wakes to after the fork */
+    usleep( random() % 500 );
+    executor.cancel( doomed );
+
+    executor.submit( probe, 0, "echo ok" );
+    fatal_assert( wait_for( executor, probe ) == "ok\n" );
+  }
+
+  if ( verbose ) {
+    printf( "executor: all tests passed\n" );
+  }
+
+  return 0;
+}
@@ -0,0 +1,99 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+
+/* Tests MPSCQueue with several producer threads: every item arrives
+   exactly once, and each producer's items arrive in order. */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "mpscqueue.h"
+#include "fatal_assert.h"
+
+bool verbose = false;
+
+static const int PRODUCERS = 4;
+static const int ITEMS = 200000;
+
+static MPSCQueue< std::pair< int, int > > queue;
+
+static void *produce( void *arg )
+{
+  int producer = *static_cast< int * >( arg );
+  for ( int i = 0; i < ITEMS; i++ ) {
+    queue.push( std::make_pair( producer, i ) );
+  }
+  return NULL;
+}
+
+int main( int argc, char *argv[] )
+{
+  if ( argc >= 2 && strcmp( argv[ 1 ], "-v" ) == 0 ) {
+    verbose = true;
+  }
+
+  std::pair< int, int > item;
+  fatal_assert( !queue.pop( item ) );
+
+  pthread_t threads[ PRODUCERS ];
+  int ids[ PRODUCERS ];
+  for ( int i = 0; i < PRODUCERS; i++ ) {
+    ids[ i ] = i;
+    fatal_assert( pthread_create( &threads[ i ], NULL, produce, &ids[ i ] ) == 0 );
+  }
+
+  std::vector< int > next( PRODUCERS, 0 );
+  int received = 0;
+  while ( received < PRODUCERS * ITEMS ) {
+    if ( !queue.pop( item ) ) {
+      continue;
+    }
+    fatal_assert( item.first >= 0 && item.first < PRODUCERS );
+    fatal_assert( item.second == next[ item.first ] );
+    next[ item.first ]++;
+    received++;
+  }
+
+  for ( int i = 0; i < PRODUCERS; i++ ) {
+    fatal_assert( pthread_join( threads[ i ], NULL ) == 0 );
+  }
+  fatal_assert( !queue.pop( item ) );
+
+  if ( verbose ) {
+    printf( "mpsc-queue: all tests passed\n" );
+  }
+
+  return 0;
+}
@@ -0,0 +1,142 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Tests that datagrams too big to be ours are dropped without harm:
+   a Connection throws for a read that got nothing else, and reads the
+   next datagram as usual; a SharedPort skips them, even a batch's
+   worth, to get to the datagrams behind them. */
+
+#include "config.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "byteorder.h"
+#include "network.h"
+#include "fatal_assert.h"
+
+using namespace Network;
+
+bool verbose = false;
+
+/* one more than Session::RECEIVE_MTU */
+static const size_t OVERSIZE = 2049;
+
+static void send_raw( int port, const std::string &datagram )
+{
+  int fd = socket( AF_INET, SOCK_DGRAM, 0 );
+  fatal_assert( fd >= 0 );
+
+  struct sockaddr_in to;
+  memset( &to, 0, sizeof( to ) );
+  to.sin_family = AF_INET;
+  to.sin_port = htons( port );
+  fatal_assert( inet_aton( "127.0.0.1", &to.sin_addr ) );
+
+  fatal_assert( sendto( fd, datagram.data(), datagram.size(), 0,
+                        (const sockaddr *)&to, sizeof( to ) ) == ssize_t( datagram.size() ) );
+  close( fd );
+}
+
+static void test_connection( void )
+{
+  Connection server( "127.0.0.1", NULL );
+  Connection client( server.get_key().c_str(), "127.0.0.1", server.port() );
+
+  /* alone, it is all the read gets */
+  send_raw( server.port(), std::string( OVERSIZE, 'x' ) );
+  bool threw = false;
+  try {
+    server.recv();
+  } catch ( const NetworkException &e ) {
+    fatal_assert( e.the_errno == EMSGSIZE );
+    threw = true;
+  }
+  fatal_assert( threw );
+  fatal_assert( !server.pending() );
+
+  client.send( "hello" );
+  fatal_assert( server.recv() == "hello" );
+
+  /* ahead of a good one, it is skipped */
+  send_raw( server.port(), std::string( OVERSIZE, 'x' ) );
+  client.send( "again" );
+  fatal_assert( server.recv() == "again" );
+  fatal_assert( !server.pending() );
+}
+
+static void test_shared_port( void )
+{
+  SharedPort port( "127.0.0.1", "20000:59999" );
+
+  for ( int i = 0; i <= Connection::RECV_BATCH; i++ ) {
+    send_raw( port.port(), std::string( OVERSIZE, 'x' ) );
+  }
+  uint64_t id_net = htobe64( 7 );
+  send_raw( port.port(), std::string( (const char *)&id_net, sizeof( id_net ) ) + "hello" );
+
+  /* loopback delivers before sendto() returns */
+  Datagram datagram;
+  fatal_assert( port.recv( datagram ) );
+  fatal_assert( datagram.session_id == 7 && datagram.payload == "hello" );
+  fatal_assert( !port.recv( datagram ) );
+
+  /* nothing but oversize ones */
+  send_raw( port.port(), std::string( OVERSIZE, 'x' ) );
+  fatal_assert( !port.recv( datagram ) );
+}
+
+int main( int argc, char *argv[] )
+{
+  if ( argc >= 2 && strcmp( argv[ 1 ], "-v" ) == 0 ) {
+    verbose = true;
+  }
+
+  try {
+    test_connection();
+    test_shared_port();
+  } catch ( const NetworkException &e ) {
+    fprintf( stderr, "%s: %s\n", e.function.c_str(), strerror( e.the_errno ) );
+    return 1;
+  }
+
+  if ( verbose ) {
+    printf( "oversize-datagram: all tests passed\n" );
+  }
+
+  return 0;
+}
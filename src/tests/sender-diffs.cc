@@ -0,0 +1,185 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Tests the diffs a TransportSender sends, cached or not, through
+   ticks with nothing new, retransmissions to a receiver that has gone
+   quiet, and the shutdown sequence. Each diff names the state it was
+   made from, so the receiver checks it against the state it is
+   applied to, and that it is what an uncached diff_from() would make
+   of that state. */
+
+#include "config.h"
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#include "networktransport.cc"
+#include "stateversion.h"
+#include "timestamp.h"
+#include "fatal_assert.h"
+
+using namespace Network;
+
+bool verbose = false;
+
+/* A state that only grows. Its diffs carry the whole of both states. */
+class Log {
+private:
+  std::string text;
+  StateVersion version;
+
+public:
+  Log() : text(), version() {}
+
+  void append( const std::string &s ) { version.bump(); text += s; }
+  const std::string &get_text( void ) const { return text; }
+
+  /* interface for Network::Transport */
+  uint64_t get_version( void ) const { return version.get(); }
+  void subtract( const Log * ) {}
+  std::string diff_from( const Log &existing ) const
+  {
+    if ( existing.text == text ) {
+      return std::string();
+    }
+    char length[ 32 ];
+    snprintf( length, sizeof( length ), "%lu:", (unsigned long)existing.text.size() );
+    return length + existing.text + text;
+  }
+  void apply_string( std::string diff )
+  {
+    if ( diff.empty() ) {
+      return;
+    }
+    size_t colon = diff.find( ':' );
+    fatal_assert( colon != std::string::npos );
+    size_t from_length = strtoul( diff.substr( 0, colon ).c_str(), NULL, 10 );
+    fatal_assert( diff.compare( colon + 1, from_length, text ) == 0 ); /* made from us */
+
+    Log from( *this );
+    version.bump();
+    text = diff.substr( colon + 1 + from_length );
+    fatal_assert( diff_from( from ) == diff ); /* as if uncached */
+  }
+  bool operator==( const Log &x ) const { return text == x.text; }
+  bool compare( const Log &x ) const { return text != x.text; }
+};
+
+typedef Transport< Log, Log > LogTransport;
+
+/* Read whatever has arrived for t. */
+static void drain( LogTransport &t )
+{
+  while ( true ) {
+    std::vector< int > fds = t.fds();
+    std::vector< struct pollfd > pfds;
+    for ( std::vector< int >::const_iterator i = fds.begin(); i != fds.end(); i++ ) {
+      struct pollfd pfd = { *i, POLLIN, 0 };
+      pfds.push_back( pfd );
+    }
+    if ( poll( &pfds[ 0 ], pfds.size(), 0 ) <= 0 ) {
+      return;
+    }
+    t.recv();
+  }
+}
+
+/* One round of both sides, after a pause long enough that the sender
+   has something to do; the client only reads if it is listening. */
+static void step( LogTransport &server, LogTransport &client, bool listening )
+{
+  usleep( 20000 );
+  freeze_timestamp();
+  server.tick();
+  client.tick();
+  drain( server );
+  if ( listening ) {
+    drain( client );
+  }
+}
+
+int main( int argc, char *argv[] )
+{
+  if ( argc >= 2 && strcmp( argv[ 1 ], "-v" ) == 0 ) {
+    verbose = true;
+  }
+
+  freeze_timestamp();
+  Log blank;
+  LogTransport server( blank, blank, "127.0.0.1", NULL );
+  LogTransport client( blank, blank, server.get_key().c_str(), "127.0.0.1", server.port() );
+  if ( verbose ) {
+    server.set_verbose();
+  }
+  std::string expected;
+
+  /* new output now and then, with ticks that have nothing new between */
+  for ( int i = 0; i < 60; i++ ) {
+    if ( i % 3 == 0 ) {
+      char line[ 32 ];
+      snprintf( line, sizeof( line ), "line %d\n", i );
+      server.get_current_state().append( line );
+      expected += line;
+    }
+    step( server, client, true );
+  }
+
+  /* the client goes quiet while output continues, so the server sends
+     diffs from states the client never saw and then falls back to
+     the one it acknowledged */
+  for ( int i = 0; i < 60; i++ ) {
+    if ( i % 4 == 0 ) {
+      char line[ 32 ];
+      snprintf( line, sizeof( line ), "unheard %d\n", i );
+      server.get_current_state().append( line );
+      expected += line;
+    }
+    step( server, client, i >= 40 );
+  }
+
+  server.start_shutdown();
+  for ( int i = 0; i < 200 && !server.shutdown_acknowledged(); i++ ) {
+    step( server, client, true );
+  }
+  fatal_assert( server.shutdown_acknowledged() );
+  fatal_assert( client.get_latest_remote_state().state->get_text() == expected );
+
+  if ( verbose ) {
+    printf( "sender-diffs: all tests passed\n" );
+  }
+
+  return 0;
+}
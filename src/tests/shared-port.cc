@@ -0,0 +1,169 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+
+/* Tests SharedPort: taking the session id off each datagram, skipping
+   datagrams too short to have one, and, where the system can, steering
+   each datagram of a group to the socket steer() picks. */
+
+#include "config.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <vector>
+
+#include "byteorder.h"
+#include "network.h"
+#include "fatal_assert.h"
+
+using namespace Network;
+
+bool verbose = false;
+
+class Client {
+private:
+  int fd;
+  struct sockaddr_in to;
+
+public:
+  Client( int port ) : fd( socket( AF_INET, SOCK_DGRAM, 0 ) ), to()
+  {
+    fatal_assert( fd >= 0 );
+    to.sin_family = AF_INET;
+    to.sin_port = htons( port );
+    fatal_assert( inet_aton( "127.0.0.1", &to.sin_addr ) );
+  }
+
+  ~Client() { close( fd ); }
+
+  void send_raw( const std::string &datagram )
+  {
+    fatal_assert( sendto( fd, datagram.data(), datagram.size(), 0,
+                          (const sockaddr *)&to, sizeof( to ) ) == ssize_t( datagram.size() ) );
+  }
+
+  void send( uint64_t session_id, const std::string &payload )
+  {
+    uint64_t id_net = htobe64( session_id );
+    send_raw( std::string( (const char *)&id_net, sizeof( id_net ) ) + payload );
+  }
+};
+
+static void test_single( void )
+{
+  SharedPort port( "127.0.0.1", "20000:59999" );
+  Client client( port.port() );
+
+  client.send_raw( "abc" );
+  client.send( 0x0123456789abcdefULL, "hello" );
+  client.send( 7, "" );
+
+  /* loopback delivers before sendto() returns */
+  Datagram datagram;
+  fatal_assert( port.recv( datagram ) );
+  fatal_assert( datagram.session_id == 0x0123456789abcdefULL );
+  fatal_assert( datagram.payload == "hello" );
+  fatal_assert( datagram.from.sin_addr.s_addr == htonl( INADDR_LOOPBACK ) );
+
+  fatal_assert( port.recv( datagram ) );
+  fatal_assert( datagram.session_id == 7 && datagram.payload.empty() );
+
+  fatal_assert( !port.recv( datagram ) );
+}
+
+static void test_group( void )
+{
+  const int count = 3;
+  std::vector< SharedPort * > group;
+  try {
+    group = SharedPort::open_group( "127.0.0.1", "20000:59999", count );
+  } catch ( const NetworkException &e ) {
+    if ( e.the_errno == EOPNOTSUPP ) {
+      if ( verbose ) {
+        printf( "shared-port: no steering on this system\n" );
+      }
+      return;
+    }
+    throw;
+  }
+  for ( int i = 1; i < count; i++ ) {
+    fatal_assert( group[ i ]->port() == group[ 0 ]->port() );
+  }
+
+  Client client( group[ 0 ]->port() );
+  const int sessions = 60;
+  for ( int i = 0; i < sessions; i++ ) {
+    uint64_t session_id = (uint64_t( i ) << 40) | (i * 0x9e3779b1U);
+    client.send( session_id, "x" );
+  }
+
+  int received = 0;
+  for ( int i = 0; i < count; i++ ) {
+    Datagram datagram;
+    int here = 0;
+    while ( group[ i ]->recv( datagram ) ) {
+      fatal_assert( SharedPort::steer( datagram.session_id, count ) == i );
+      here++;
+    }
+    if ( verbose ) {
+      printf( "shared-port: socket %d got %d datagrams\n", i, here );
+    }
+    received += here;
+  }
+  fatal_assert( received == sessions );
+
+  for ( int i = 0; i < count; i++ ) {
+    delete group[ i ];
+  }
+}
+
+int main( int argc, char *argv[] )
+{
+  if ( argc >= 2 && strcmp( argv[ 1 ], "-v" ) == 0 ) {
+    verbose = true;
+  }
+
+  try {
+    test_single();
+    test_group();
+  } catch ( const NetworkException &e ) {
+    fprintf( stderr, "%s: %s\n", e.function.c_str(), strerror( e.the_errno ) );
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,245 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Tests StateRing against a plain deque of entries: the same states in
+   the same order after every push, insert, erase and cut, find()
+   agrees with a linear search, an equal state pushed shares the last
+   one's object instead of being copied, the sharers of an object are
+   always neighbours, and subtract_front() reaches every object once. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <deque>
+
+#include "transportstate.h"
+#include "fatal_assert.h"
+
+using namespace Network;
+
+bool verbose = false;
+
+/* a state that counts how often it is copied and cut */
+class Counter {
+public:
+  static size_t copies;
+  int value;
+  int cuts;
+
+  explicit Counter( int s_value = 0 ) : value( s_value ), cuts( 0 ) {}
+  Counter( const Counter &other ) : value( other.value ), cuts( 0 ) { copies++; }
+  Counter &operator=( const Counter &other ) { value = other.value; copies++; return *this; }
+  bool operator==( const Counter &other ) const { return value == other.value; }
+  /* the value is all there is to a Counter */
+  uint64_t get_version( void ) const { return value; }
+
+  void subtract( const Counter * ) { cuts++; }
+};
+
+size_t Counter::copies = 0;
+
+typedef StateRing< Counter > Ring;
+
+static const size_t LIMIT = 100;
+
+struct Expected {
+  uint64_t timestamp;
+  uint64_t num;
+  int value;
+};
+
+static void check( const Ring &ring, const std::deque< Expected > &expected )
+{
+  fatal_assert( ring.size() == expected.size() );
+  for ( size_t i = 0; i < expected.size(); i++ ) {
+    fatal_assert( ring[ i ].timestamp == expected[ i ].timestamp );
+    fatal_assert( ring[ i ].num == expected[ i ].num );
+    fatal_assert( ring[ i ].state->value == expected[ i ].value );
+    /* once a run of sharers ends, its object is not seen again */
+    for ( size_t j = i + 2; j < expected.size(); j++ ) {
+      fatal_assert( ring[ j ].state != ring[ i ].state || ring[ j - 1 ].state == ring[ i ].state );
+    }
+  }
+}
+
+static size_t linear_find( const std::deque< Expected > &expected, uint64_t num )
+{
+  for ( size_t i = 0; i < expected.size(); i++ ) {
+    if ( expected[ i ].num == num ) {
+      return i;
+    }
+  }
+  return expected.size();
+}
+
+static void test_random( void )
+{
+  Ring ring( LIMIT );
+  std::deque< Expected > expected;
+  uint64_t num = 0;
+  int value = 0;
+  size_t pushes = 0, shared = 0, inserts = 0;
+
+  for ( int round = 0; round < 100000; round++ ) {
+    switch ( rand() % 10 ) {
+    case 0: case 1: case 2: case 3:
+      if ( !ring.full() ) {
+        /* sometimes the same state again, as with an empty ack */
+        if ( expected.empty() || rand() % 3 != 0 ) {
+          value++;
+        }
+        bool same = !expected.empty() && expected.back().value == value;
+        num += 1 + rand() % 3 * (rand() % 4 == 0);
+        Expected entry = { uint64_t( round ), num, value };
+
+        size_t copies_before = Counter::copies;
+        ring.push_back( entry.timestamp, entry.num, Counter( entry.value ) );
+        fatal_assert( Counter::copies - copies_before == (same ? 0 : 1) );
+
+        expected.push_back( entry );
+        pushes++;
+        shared += same;
+      }
+      break;
+    case 4:
+      /* a late arrival, into a gap, with a state of its own or a
+         neighbour's */
+      if ( !ring.full() && !expected.empty() ) {
+        uint64_t late = expected.front().num + rand() % (num - expected.front().num + 1);
+        if ( linear_find( expected, late ) != expected.size() ) {
+          break;
+        }
+        size_t place = ring.place_for( late );
+        Expected entry = { uint64_t( round ), late, ++value };
+        shared::shared_ptr< Counter > state( new Counter( entry.value ) );
+        if ( rand() % 2 && place > 0 ) {
+          state = ring[ place - 1 ].state;
+          entry.value = state->value;
+        }
+        fatal_assert( ring.insert( entry.timestamp, entry.num, state ) == place );
+        expected.insert( expected.begin() + place, entry );
+        inserts++;
+      }
+      break;
+    case 5: case 6:
+      if ( !expected.empty() ) {
+        size_t i = rand() % expected.size();
+        ring.erase( i );
+        expected.erase( expected.begin() + i );
+      }
+      break;
+    case 7:
+      if ( !expected.empty() ) {
+        uint64_t below = expected.front().num + rand() % 8;
+        size_t dropped = 0;
+        while ( !expected.empty() && expected.front().num < below ) {
+          expected.pop_front();
+          dropped++;
+        }
+        fatal_assert( ring.cut( below ) == dropped );
+      }
+      break;
+    case 8:
+      if ( !expected.empty() ) {
+        for ( size_t i = 0; i < ring.size(); i++ ) {
+          ring[ i ].state->cuts = 0;
+        }
+        ring.subtract_front();
+        for ( size_t i = 0; i < ring.size(); i++ ) {
+          fatal_assert( ring[ i ].state->cuts == 1 );
+        }
+      }
+      break;
+    default: {
+      /* a number that is there, or one that is not */
+      uint64_t wanted = num - rand() % 40;
+      fatal_assert( ring.find( wanted ) == linear_find( expected, wanted ) );
+      break;
+    }
+    }
+
+    check( ring, expected );
+  }
+
+  if ( verbose ) {
+    printf( "state-ring: %lu pushes, %lu shared, %lu inserted late\n",
+            (unsigned long)pushes, (unsigned long)shared, (unsigned long)inserts );
+  }
+}
+
+/* the shutdown number may be pushed again and again */
+static void test_repeated_num( void )
+{
+  Ring ring( LIMIT );
+  ring.push_back( 0, 5, Counter( 1 ) );
+  for ( int i = 0; i < 3; i++ ) {
+    ring.push_back( i + 1, uint64_t( -1 ), Counter( 2 ) );
+  }
+  fatal_assert( ring.size() == 4 );
+  fatal_assert( ring.find( uint64_t( -1 ) ) == 1 );
+  fatal_assert( ring.find( 5 ) == 0 );
+  fatal_assert( ring.find( 6 ) == ring.size() );
+}
+
+/* A state handed over is kept, not copied, unless it is equal to the
+   last one, whose object it then shares. */
+static void test_hand_over( void )
+{
+  Ring ring( LIMIT );
+  size_t copies = Counter::copies;
+
+  shared::shared_ptr< Counter > first( new Counter( 1 ) );
+  ring.push_back( 0, 0, first );
+  fatal_assert( ring.back().state == first );
+
+  ring.push_back( 1, 1, shared::shared_ptr< Counter >( new Counter( 1 ) ) );
+  fatal_assert( ring.back().state == first );
+
+  shared::shared_ptr< Counter > second( new Counter( 2 ) );
+  ring.push_back( 2, 2, second );
+  fatal_assert( ring.back().state == second && ring.size() == 3 );
+  fatal_assert( Counter::copies == copies );
+}
+
+int main( int argc, char *argv[] )
+{
+  if ( argc >= 2 && strcmp( argv[ 1 ], "-v" ) == 0 ) {
+    verbose = true;
+  }
+
+  srand( 1 );
+  test_random();
+  test_repeated_num();
+  test_hand_over();
+
+  return 0;
+}
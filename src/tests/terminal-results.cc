@@ -0,0 +1,242 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+
+/* Tests Term::TerminalResults: incremental diffs of command output and
+   exit statuses, and agreement with the generated protobuf code. */
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "terminalresults.h"
+#include "terminalresults.pb.h"
+#include "fatal_assert.h"
+
+using Term::TerminalResults;
+using Term::ResultEvent;
+
+bool verbose = false;
+
+/* Diffs carry only the new events, however much came before them. */
+static void test_incremental( void )
+{
+  TerminalResults sent, received;
+  const std::string big( 1 << 20, 'o' );
+
+  sent.append_output( 0, big );
+  received.apply_string( sent.diff_from( TerminalResults() ) );
+  fatal_assert( received == sent );
+  fatal_assert( received.get_event( 0 )->size() == big.size() );
+
+  TerminalResults acked( sent );
+  sent.append_output( 0, "tail" );
+  sent.finish( 0, 0 );
+  sent.append_output( 1, std::string( "\0\xff", 2 ) );
+  sent.finish( 1, -3 );
+
+  std::string diff = sent.diff_from( acked );
+  fatal_assert( diff.size() < 64 );
+
+  received.apply_string( diff );
+  fatal_assert( received == sent );
+  received.subtract( &acked );
+  sent.subtract( &acked );
+  fatal_assert( received.size() == 4 );
+
+  const ResultEvent *e = received.get_event( 0 );
+  fatal_assert( e->command == 0 && !e->finished && e->str() == "tail" );
+  e = received.get_event( 1 );
+  fatal_assert( e->command == 0 && e->finished && e->exit_status == 0 );
+  e = received.get_event( 2 );
+  fatal_assert( e->command == 1 && e->str() == std::string( "\0\xff", 2 ) );
+  e = received.get_event( 3 );
+  fatal_assert( e->command == 1 && e->finished && e->exit_status == -3 );
+}
+
+/* The hand-written encoder and decoder agree with the generated code. */
+static void test_wire_format( void )
+{
+  TerminalResults sent;
+  sent.append_output( 7, "hello\n" );
+  sent.append_output( 300, std::string() );
+  sent.finish( uint64_t( 1 ) << 40, 255 );
+
+  TermBuffers::ResultMessage parsed;
+  fatal_assert( parsed.ParseFromString( sent.diff_from( TerminalResults() ) ) );
+  fatal_assert( parsed.event_size() == 3 );
+  fatal_assert( parsed.event( 0 ).command() == 7 );
+  fatal_assert( parsed.event( 0 ).output() == "hello\n" );
+  fatal_assert( !parsed.event( 0 ).has_exit_status() );
+  fatal_assert( parsed.event( 1 ).has_output() && parsed.event( 1 ).output().empty() );
+  fatal_assert( parsed.event( 2 ).command() == uint64_t( 1 ) << 40 );
+  fatal_assert( parsed.event( 2 ).exit_status() == 255 );
+
+  parsed.mutable_event( 2 )->set_exit_status( -1 );
+  TerminalResults received;
+  received.apply_string( parsed.SerializeAsString() );
+  fatal_assert( received.size() == 3 );
+  fatal_assert( received.get_event( 0 )->str() == "hello\n" );
+  fatal_assert( received.get_event( 1 )->command == 300 );
+  fatal_assert( received.get_event( 2 )->finished );
+  fatal_assert( received.get_event( 2 )->exit_status == -1 );
+}
+
+/* Credit travels with the events, but only when it changes. */
+static void test_credit( void )
+{
+  TerminalResults sent, received;
+  fatal_assert( sent.get_credit() == TerminalResults::INITIAL_CREDIT );
+
+  TerminalResults acked( sent );
+  sent.set_credit( 5000000000ULL );
+  fatal_assert( !(sent == acked) );
+
+  std::string diff = sent.diff_from( acked );
+  TermBuffers::ResultMessage parsed;
+  fatal_assert( parsed.ParseFromString( diff ) );
+  fatal_assert( parsed.event_size() == 0 );
+  fatal_assert( parsed.credit() == 5000000000ULL );
+
+  received.apply_string( diff );
+  fatal_assert( received == sent );
+  fatal_assert( received.get_credit() == 5000000000ULL );
+
+  /* unchanged credit is not repeated, and survives an applied diff */
+  acked = sent;
+  sent.append_output( 0, "x" );
+  diff = sent.diff_from( acked );
+  fatal_assert( parsed.ParseFromString( diff ) );
+  fatal_assert( !parsed.has_credit() );
+  received.apply_string( diff );
+  fatal_assert( received == sent );
+}
+
+/* A saved state restores with its numbering, credit and events, and
+   later diffs apply to it. */
+static void test_save( void )
+{
+  TerminalResults sent;
+  for ( int i = 0; i < 100; i++ ) {
+    sent.append_output( i, "output" );
+    sent.finish( i, i % 3 );
+  }
+  TerminalResults acked( sent );
+  sent.append_output( 100, "more" );
+  sent.set_credit( 5000000000ULL );
+  sent.subtract( &acked );
+
+  TerminalResults restored;
+  restored.restore( sent.save() );
+  fatal_assert( restored == sent );
+  fatal_assert( restored.get_begin_num() == 200 && restored.size() == 1 );
+  fatal_assert( restored.get_credit() == 5000000000ULL );
+  fatal_assert( restored.get_event( 0 )->command == 100 );
+  fatal_assert( restored.get_event( 0 )->str() == "more" );
+
+  TerminalResults before( sent );
+  sent.finish( 100, 0 );
+  restored.apply_string( sent.diff_from( before ) );
+  fatal_assert( restored == sent && restored.size() == 2 );
+  fatal_assert( restored.get_event( 1 )->finished );
+}
+
+/* The output held, which on the sending side is what the other side
+   has yet to acknowledge. */
+static void test_bytes( void )
+{
+  TerminalResults sent, received;
+  sent.append_output( 0, "hello" );
+  sent.append_output( 0, "world!" );
+  sent.finish( 0, 0 );
+  fatal_assert( sent.get_bytes() == 11 );
+
+  TerminalResults acked( sent );
+  sent.append_output( 1, "more" );
+  received.apply_string( sent.diff_from( TerminalResults() ) );
+  fatal_assert( received.get_bytes() == 15 );
+
+  sent.subtract( &acked );
+  fatal_assert( sent.get_bytes() == 4 );
+
+  /* an older prefix changes nothing */
+  TerminalResults blank;
+  sent.subtract( &acked );
+  sent.subtract( &blank );
+  fatal_assert( sent.get_bytes() == 4 );
+
+  sent.subtract( &sent );
+  fatal_assert( sent.get_bytes() == 0 && sent.empty() );
+}
+
+/* The sender's round-trip check sees a diff that came out wrong, even
+   where the two states end in the same place. */
+static void test_compare( void )
+{
+  TerminalResults sent;
+  sent.append_output( 0, "hello" );
+  sent.finish( 0, 0 );
+
+  TerminalResults received;
+  received.apply_string( sent.diff_from( TerminalResults() ) );
+  fatal_assert( !sent.compare( received ) );
+
+  TerminalResults wrong;
+  wrong.append_output( 0, "jello" );
+  wrong.finish( 0, 0 );
+  fatal_assert( sent == wrong );
+  fatal_assert( sent.compare( wrong ) );
+
+  received.set_credit( sent.get_credit() + 1 );
+  fatal_assert( sent.compare( received ) );
+}
+
+int main( int argc, char *argv[] )
+{
+  if ( argc >= 2 && strcmp( argv[ 1 ], "-v" ) == 0 ) {
+    verbose = true;
+  }
+
+  test_incremental();
+  test_wire_format();
+  test_credit();
+  test_save();
+  test_bytes();
+  test_compare();
+
+  if ( verbose ) {
+    printf( "terminal-results: all tests passed\n" );
+  }
+
+  return 0;
+}
@@ -0,0 +1,177 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+
+/* Tests TimerWheel against a plain list of deadlines: each timer
+   expires at the first advance() that reaches its deadline, and
+   next_deadline() is never later than the earliest one. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "timerwheel.h"
+#include "fatal_assert.h"
+
+bool verbose = false;
+
+static const uint64_t NEVER = uint64_t( -1 );
+
+struct Owner {
+  uint64_t deadline; /* NEVER if not scheduled */
+  TimerWheel< Owner >::Timer timer;
+
+  Owner() : deadline( NEVER ), timer( this ) {}
+};
+
+/* near deadlines mostly, as with sessions, but some in every level,
+   some past the last and some already past */
+static uint64_t random_deadline( uint64_t now )
+{
+  switch ( rand() % 6 ) {
+  case 0: return now - rand() % 10;
+  case 1: return now + rand() % 64;
+  case 2: return now + rand() % 5000;
+  case 3: return now + rand() % 300000;
+  case 4: return now + rand() % 20000000;
+  default: return now + (uint64_t( rand() ) << 10);
+  }
+}
+
+static void check( const TimerWheel< Owner > &wheel, const std::vector< Owner * > &owners )
+{
+  uint64_t earliest = NEVER;
+  for ( size_t i = 0; i < owners.size(); i++ ) {
+    fatal_assert( owners[ i ]->timer.scheduled() == (owners[ i ]->deadline != NEVER) );
+    earliest = std::min( earliest, owners[ i ]->deadline );
+  }
+  uint64_t next = wheel.next_deadline();
+  fatal_assert( next <= std::max( earliest, wheel.now() + 1 ) );
+  fatal_assert( next > wheel.now() );
+  fatal_assert( (next == NEVER) == (earliest == NEVER) );
+}
+
+static void test_random( uint64_t start )
+{
+  TimerWheel< Owner > wheel( start );
+  std::vector< Owner * > owners;
+  for ( int i = 0; i < 300; i++ ) {
+    owners.push_back( new Owner );
+  }
+
+  uint64_t now = start;
+  size_t expirations = 0;
+  for ( int round = 0; round < 20000; round++ ) {
+    /* reschedule or cancel a few */
+    for ( int i = rand() % 4; i > 0; i-- ) {
+      Owner *owner = owners[ rand() % owners.size() ];
+      if ( rand() % 8 == 0 ) {
+        wheel.cancel( owner->timer );
+        owner->deadline = NEVER;
+      } else {
+        uint64_t deadline = random_deadline( now );
+        wheel.schedule( owner->timer, deadline );
+        owner->deadline = std::max( deadline, now + 1 );
+      }
+    }
+    /* and now and then let one go while scheduled */
+    if ( round % 1000 == 0 ) {
+      size_t i = rand() % owners.size();
+      delete owners[ i ];
+      owners[ i ] = new Owner;
+    }
+    check( wheel, owners );
+
+    /* to the next deadline, or a little or a long way on */
+    switch ( rand() % 3 ) {
+    case 0: now = std::min( wheel.next_deadline(), now + 1000000 ); break;
+    case 1: now += rand() % 100; break;
+    default: now += rand() % 100000; break;
+    }
+
+    std::vector< Owner * > expired;
+    wheel.advance( now, expired );
+    fatal_assert( wheel.now() == now );
+
+    std::vector< Owner * > expected;
+    for ( size_t i = 0; i < owners.size(); i++ ) {
+      if ( owners[ i ]->deadline <= now ) {
+        expected.push_back( owners[ i ] );
+        owners[ i ]->deadline = NEVER;
+      }
+    }
+    std::sort( expired.begin(), expired.end() );
+    std::sort( expected.begin(), expected.end() );
+    fatal_assert( expired == expected );
+    expirations += expired.size();
+  }
+
+  /* the wheel goes before the timers here */
+  for ( size_t i = 0; i < owners.size(); i++ ) {
+    delete owners[ i ];
+  }
+
+  if ( verbose ) {
+    printf( "timer-wheel: from %llu, %lu expirations\n",
+            (unsigned long long)start, (unsigned long)expirations );
+  }
+}
+
+static void test_destroyed_wheel( void )
+{
+  Owner owner;
+  {
+    TimerWheel< Owner > wheel( 0 );
+    wheel.schedule( owner.timer, 100 );
+    fatal_assert( owner.timer.scheduled() );
+  }
+  fatal_assert( !owner.timer.scheduled() );
+}
+
+int main( int argc, char *argv[] )
+{
+  if ( argc >= 2 && strcmp( argv[ 1 ], "-v" ) == 0 ) {
+    verbose = true;
+  }
+
+  srand( 1 );
+  test_random( 0 );
+  /* just short of where every level wraps at once */
+  test_random( (uint64_t( 1 ) << 24) - 1000 );
+  /* a timestamp as Network::timestamp() gives */
+  test_random( 1234567890123ULL );
+  test_destroyed_wheel();
+
+  return 0;
+}
@@ -0,0 +1,348 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+
+#include "config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#endif
+
+#include "eventloop.h"
+#include "fatal_assert.h"
+#include "timestamp.h"
+
+volatile sig_atomic_t EventLoop::pending_signals[ MAX_SIGNAL_NUMBER + 1 ];
+
+void EventLoop::handle_signal( int signum )
+{
+  if ( signum > 0 && signum <= MAX_SIGNAL_NUMBER ) {
+    pending_signals[ signum ] = 1;
+  }
+}
+
+EventLoop::EventLoop( bool use_epoll )
+  : fds(), ready(), got_any_signal( false ), signals(),
+    epoll_fd( -1 ), signal_fd( -1 ), max_fd( -1 ), all_fds()
+{
+  clear_events();
+  fatal_assert( 0 == sigemptyset( &signals ) );
+  FD_ZERO( &all_fds );
+
+#ifdef HAVE_EPOLL
+  if ( use_epoll ) {
+    /* on failure, e.g. ENOSYS, use pselect() */
+    epoll_fd = epoll_create1( EPOLL_CLOEXEC );
+  }
+#endif
+}
+
+EventLoop::~EventLoop()
+{
+  if ( signal_fd >= 0 ) {
+    close( signal_fd );
+  }
+  if ( epoll_fd >= 0 ) {
+    close( epoll_fd );
+  }
+}
+
+void EventLoop::add_fd( int fd, bool edge_triggered )
+{
+  fatal_assert( fd >= 0 );
+
+  std::map< int, bool >::iterator i = fds.find( fd );
+  if ( i != fds.end() && i->second == edge_triggered ) {
+    return;
+  }
+
+#ifdef HAVE_EPOLL
+  if ( epoll_fd >= 0 ) {
+    struct epoll_event event;
+    memset( &event, 0, sizeof( event ) );
+    event.events = EPOLLIN | EPOLLPRI;
+    if ( edge_triggered ) {
+      event.events |= EPOLLET;
+    }
+    event.data.fd = fd;
+    if ( 0 != epoll_ctl( epoll_fd, i == fds.end() ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+                         fd, &event ) ) {
+      fatal_assert( errno == EPERM );
+      if ( i == fds.end() ) {
+        always_ready.push_back( fd );
+      }
+    }
+    fds[ fd ] = edge_triggered;
+    return;
+  }
+#endif
+
+  /* no edges here, but reporting an fd more often does no harm */
+  fatal_assert( fd < FD_SETSIZE );
+  FD_SET( fd, &all_fds );
+  if ( fd > max_fd ) {
+    max_fd = fd;
+  }
+
+  fds[ fd ] = edge_triggered;
+}
+
+void EventLoop::remove_fd( int fd )
+{
+  if ( fds.erase( fd ) == 0 ) {
+    return;
+  }
+
+#ifdef HAVE_EPOLL
+  if ( epoll_fd >= 0 ) {
+    always_ready.erase( std::remove( always_ready.begin(), always_ready.end(), fd ),
+                        always_ready.end() );
+
+    /* fails harmlessly if fd has been closed, which removed it already */
+    struct epoll_event event;
+    epoll_ctl( epoll_fd, EPOLL_CTL_DEL, fd, &event );
+    return;
+  }
+#endif
+
+  FD_CLR( fd, &all_fds );
+  max_fd = fds.empty() ? -1 : fds.rbegin()->first;
+}
+
+void EventLoop::add_signal( int signum )
+{
+  fatal_assert( signum > 0 );
+  fatal_assert( signum <= MAX_SIGNAL_NUMBER );
+
+  /* Block the signal so we don't get it outside of wait(). */
+  fatal_assert( 0 == sigaddset( &signals, signum ) );
+  sigset_t to_block;
+  fatal_assert( 0 == sigemptyset( &to_block ) );
+  fatal_assert( 0 == sigaddset( &to_block, signum ) );
+  fatal_assert( 0 == sigprocmask( SIG_BLOCK, &to_block, NULL ) );
+
+#ifdef HAVE_EPOLL
+  if ( epoll_fd >= 0 ) {
+    bool first = signal_fd < 0;
+    signal_fd = signalfd( signal_fd, &signals, SFD_NONBLOCK | SFD_CLOEXEC );
+    fatal_assert( signal_fd >= 0 );
+    if ( first ) {
+      struct epoll_event event;
+      memset( &event, 0, sizeof( event ) );
+      event.events = EPOLLIN;
+      event.data.fd = signal_fd;
+      fatal_assert( 0 == epoll_ctl( epoll_fd, EPOLL_CTL_ADD, signal_fd, &event ) );
+    }
+    return;
+  }
+#endif
+
+  /* Register a handler, which will only be called when pselect()
+     is interrupted by a (possibly queued) signal. */
+  struct sigaction sa;
+  sa.sa_flags = 0;
+  sa.sa_handler = &handle_signal;
+  fatal_assert( 0 == sigfillset( &sa.sa_mask ) );
+  fatal_assert( 0 == sigaction( signum, &sa, NULL ) );
+}
+
+bool EventLoop::signal( int signum ) const
+{
+  fatal_assert( signum > 0 );
+  fatal_assert( signum <= MAX_SIGNAL_NUMBER );
+  return got_signal[ signum ];
+}
+
+unsigned int EventLoop::ready_events( int fd ) const
+{
+  for ( std::vector< std::pair< int, unsigned int > >::const_iterator i = ready.begin();
+        i != ready.end();
+        i++ ) {
+    if ( i->first == fd ) {
+      return i->second;
+    }
+  }
+  return 0;
+}
+
+std::vector< int > EventLoop::active( void ) const
+{
+  std::vector< int > fds_active;
+  for ( std::vector< std::pair< int, unsigned int > >::const_iterator i = ready.begin();
+        i != ready.end();
+        i++ ) {
+    if ( i->second ) {
+      fds_active.push_back( i->first );
+    }
+  }
+  return fds_active;
+}
+
+void EventLoop::clear_events( void )
+{
+  ready.clear();
+  got_any_signal = false;
+  memset( got_signal, 0, sizeof( got_signal ) );
+}
+
+int EventLoop::wait( int timeout )
+{
+  clear_events();
+
+#ifdef HAVE_EPOLL
+  int ret = epoll_fd >= 0 ? wait_epoll( timeout ) : wait_pselect( timeout );
+#else
+  int ret = wait_pselect( timeout );
+#endif
+
+  freeze_timestamp();
+
+  return ret;
+}
+
+#ifdef HAVE_EPOLL
+int EventLoop::wait_epoll( int timeout )
+{
+  static const int MAX_EVENTS = 64;
+  struct epoll_event events[ MAX_EVENTS ];
+
+  for ( std::vector< int >::const_iterator i = always_ready.begin();
+        i != always_ready.end();
+        i++ ) {
+    ready.push_back( std::make_pair( *i, READABLE ) );
+  }
+
+  int count = epoll_wait( epoll_fd, events, MAX_EVENTS, ready.empty() ? timeout : 0 );
+  if ( count < 0 ) {
+    /* The user should process events as usual. */
+    return errno == EINTR ? int( ready.size() ) : -1;
+  }
+
+  for ( int i = 0; i < count; i++ ) {
+    const int fd = events[ i ].data.fd;
+    if ( fd == signal_fd ) {
+      struct signalfd_siginfo info;
+      while ( ::read( signal_fd, &info, sizeof( info ) ) == ssize_t( sizeof( info ) ) ) {
+        if ( info.ssi_signo <= unsigned( MAX_SIGNAL_NUMBER ) ) {
+          got_signal[ info.ssi_signo ] = true;
+          got_any_signal = true;
+        }
+      }
+      continue;
+    }
+
+    /* as select() would report them */
+    unsigned int flags = 0;
+    if ( events[ i ].events & (EPOLLIN | EPOLLHUP | EPOLLERR) ) {
+      flags |= READABLE;
+    }
+    if ( events[ i ].events & EPOLLPRI ) {
+      flags |= EXCEPTION;
+    }
+    ready.push_back( std::make_pair( fd, flags ) );
+  }
+
+  return count + always_ready.size();
+}
+#endif
+
+int EventLoop::wait_pselect( int timeout )
+{
+  fd_set read_fds, error_fds;
+  memcpy( &read_fds, &all_fds, sizeof( read_fds ) );
+  memcpy( &error_fds, &all_fds, sizeof( error_fds ) );
+
+  sigset_t empty_sigset;
+  fatal_assert( 0 == sigemptyset( &empty_sigset ) );
+
+#ifdef HAVE_PSELECT
+  struct timespec ts;
+  struct timespec *tsp = NULL;
+
+  if ( timeout >= 0 ) {
+    ts.tv_sec  = timeout / 1000;
+    ts.tv_nsec = 1000000 * (long( timeout ) % 1000);
+    tsp = &ts;
+  }
+
+  int ret = ::pselect( max_fd + 1, &read_fds, NULL, &error_fds, tsp, &empty_sigset );
+#else
+  struct timeval tv;
+  struct timeval *tvp = NULL;
+  sigset_t old_sigset;
+
+  if ( timeout >= 0 ) {
+    tv.tv_sec  = timeout / 1000;
+    tv.tv_usec = 1000 * (long( timeout ) % 1000);
+    tvp = &tv;
+  }
+
+  int ret = sigprocmask( SIG_SETMASK, &empty_sigset, &old_sigset );
+  if ( ret != -1 ) {
+    ret = ::select( max_fd + 1, &read_fds, NULL, &error_fds, tvp );
+    sigprocmask( SIG_SETMASK, &old_sigset, NULL );
+  }
+#endif
+
+  for ( int signum = 1; signum <= MAX_SIGNAL_NUMBER; signum++ ) {
+    if ( pending_signals[ signum ] ) {
+      pending_signals[ signum ] = 0;
+      got_signal[ signum ] = true;
+      got_any_signal = true;
+    }
+  }
+
+  if ( ret == -1 ) {
+    /* The user should process events as usual. */
+    return errno == EINTR ? 0 : -1;
+  }
+
+  for ( std::map< int, bool >::const_iterator i = fds.begin(); i != fds.end(); i++ ) {
+    unsigned int flags = 0;
+    if ( FD_ISSET( i->first, &read_fds ) ) {
+      flags |= READABLE;
+    }
+    if ( FD_ISSET( i->first, &error_fds ) ) {
+      flags |= EXCEPTION;
+    }
+    if ( flags ) {
+      ready.push_back( std::make_pair( i->first, flags ) );
+    }
+  }
+
+  return ret;
+}
@@ -0,0 +1,130 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+
+#ifndef EVENTLOOP_HPP
+#define EVENTLOOP_HPP
+
+#include <signal.h>
+#include <sys/select.h>
+#include <algorithm>
+#include <map>
+#include <vector>
+
+/* Waits for file descriptors to become readable and for signals.
+
+   Unlike Select, file descriptors stay registered from add_fd() until
+   remove_fd(), so a loop whose fds don't change registers them once.
+   Where epoll is available, a wakeup then costs time in the number of
+   ready fds, not in the highest fd number, and signals arrive through
+   a signalfd. Elsewhere, or if asked to, it falls back to pselect(),
+   as Select does.
+
+   A level-triggered fd is reported for as long as it is readable. An
+   edge-triggered one only when it becomes readable, so its owner must
+   read it until EAGAIN each time.
+
+   Signals given to add_signal() are blocked, and only reported by
+   wait(). Any thread started after that inherits the mask and so
+   never takes them. */
+class EventLoop {
+public:
+  EventLoop( bool use_epoll = true );
+  ~EventLoop();
+
+  void add_fd( int fd, bool edge_triggered = false );
+  void remove_fd( int fd );
+  bool has_fd( int fd ) const { return fds.find( fd ) != fds.end(); }
+
+  void add_signal( int signum );
+
+  /* timeout unit: milliseconds; negative timeout means wait forever.
+     Returns the number of ready fds and signals, or -1 on error. */
+  int wait( int timeout );
+
+  /* results of the last wait() */
+  bool read( int fd ) const { return ready_events( fd ) & READABLE; }
+  bool error( int fd ) const { return ready_events( fd ) & EXCEPTION; }
+  bool signal( int signum ) const;
+  bool any_signal( void ) const { return got_any_signal; }
+
+  /* the fds with any event, without asking about each one */
+  std::vector< int > active( void ) const;
+
+  /* "epoll" or "pselect" */
+  const char *backend( void ) const { return epoll_fd >= 0 ? "epoll" : "pselect"; }
+
+private:
+  static const int MAX_SIGNAL_NUMBER = 64;
+
+  /* set by the pselect backend's handler, which only runs while wait()
+     has the signals unblocked */
+  static volatile sig_atomic_t pending_signals[ MAX_SIGNAL_NUMBER + 1 ];
+  static void handle_signal( int signum );
+
+  /* as readable and as an exception by select() */
+  static const unsigned int READABLE = 1;
+  static const unsigned int EXCEPTION = 2;
+
+  /* registered fds, and whether each is edge-triggered */
+  std::map< int, bool > fds;
+
+  /* fds epoll will not take, such as regular files; like select(),
+     we report them readable every time */
+  std::vector< int > always_ready;
+
+  /* fds with events from the last wait(), and the events */
+  std::vector< std::pair< int, unsigned int > > ready;
+
+  bool got_any_signal;
+  bool got_signal[ MAX_SIGNAL_NUMBER + 1 ];
+  sigset_t signals;
+
+  /* epoll backend, if epoll_fd is valid */
+  int epoll_fd;
+  int signal_fd;
+
+  /* pselect backend */
+  int max_fd;
+  fd_set all_fds;
+
+  unsigned int ready_events( int fd ) const;
+  void clear_events( void );
+  int wait_epoll( int timeout );
+  int wait_pselect( int timeout );
+
+  /* not implemented */
+  EventLoop( const EventLoop & );
+  EventLoop &operator=( const EventLoop & );
+};
+
+#endif
@@ -0,0 +1,100 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+#ifndef MPSCQUEUE_HPP
+#define MPSCQUEUE_HPP
+
+#include <stddef.h>
+#include <algorithm>
+
+/* Unbounded lock-free queue for any number of producer threads and a
+   single consumer (D. Vyukov's intrusive MPSC design).
+
+   push() never blocks or takes a lock. pop() may briefly miss an item
+   whose producer is between its two steps; producers should therefore
+   wake the consumer after pushing, not before. */
+
+template <class T>
+class MPSCQueue {
+private:
+  class Node {
+  public:
+    Node * volatile next;
+    T value;
+
+    Node() : next( NULL ), value() {}
+    Node( const T &s_value ) : next( NULL ), value( s_value ) {}
+  };
+
+  Node * volatile head; /* most recently pushed; producers only */
+  Node *tail; /* already consumed; its next is the oldest item */
+
+  /* not implemented */
+  MPSCQueue( const MPSCQueue & );
+  MPSCQueue &operator=( const MPSCQueue & );
+
+public:
+  MPSCQueue() : head( new Node ), tail( head ) {}
+
+  ~MPSCQueue()
+  {
+    T dummy;
+    while ( pop( dummy ) ) {}
+    delete tail;
+  }
+
+  void push( const T &value )
+  {
+    Node *node = new Node( value );
+    Node *prev = __sync_lock_test_and_set( &head, node );
+    /* make node's contents visible before linking it in */
+    __sync_synchronize();
+    prev->next = node;
+  }
+
+  /* Moves the oldest item into value. Returns false if there is none. */
+  bool pop( T &value )
+  {
+    Node *next = tail->next;
+    if ( next == NULL ) {
+      return false;
+    }
+    __sync_synchronize();
+
+    std::swap( value, next->value );
+    delete tail;
+    tail = next;
+    return true;
+  }
+};
+
+#endif
@@ -0,0 +1,58 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+#ifndef SHARED_HPP
+#define SHARED_HPP
+
+#include "config.h"
+
+#ifdef HAVE_MEMORY
+#include <memory>
+#endif
+
+#ifdef HAVE_TR1_MEMORY
+#include <tr1/memory>
+#endif
+
+/* Reference-counted pointers, from whichever library has them. */
+
+namespace shared {
+#if defined HAVE_STD_SHARED_PTR
+  using std::shared_ptr;
+#elif defined HAVE_STD_TR1_SHARED_PTR
+  using std::tr1::shared_ptr;
+#else
+#error "Need a shared_ptr class (C++11 or TR1)."
+#endif
+}
+
+#endif
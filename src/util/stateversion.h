@@ -0,0 +1,62 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+#ifndef STATEVERSION_HPP
+#define STATEVERSION_HPP
+
+#include <stdint.h>
+
+/* Which contents a state holds, so that the transport can tell an
+   unchanged copy of the current state without comparing the two.
+
+   Every change to a state takes a number never handed out before in
+   this process, and a copy keeps the number of what it was copied
+   from. Equal versions therefore mean equal states; different ones
+   only that the states may differ. */
+class StateVersion {
+private:
+  uint64_t value;
+
+  static uint64_t fresh( void )
+  {
+    static uint64_t last = 0;
+    return __sync_add_and_fetch( &last, 1 );
+  }
+
+public:
+  StateVersion() : value( fresh() ) {}
+
+  void bump( void ) { value = fresh(); }
+  uint64_t get( void ) const { return value; }
+};
+
+#endif
@@ -0,0 +1,86 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+#ifndef THREADLOCAL_HPP
+#define THREADLOCAL_HPP
+
+#include <pthread.h>
+
+#include "fatal_assert.h"
+
+/* One T for each thread, made the first time that thread asks for it
+   and deleted when the thread exits (but not when the process does).
+
+   For state that used to be one per process, such as scratch buffers,
+   and that threads each serving their own sessions must not share. */
+
+/* the untyped part, kept out of the template */
+class ThreadLocalKey {
+private:
+  pthread_key_t key;
+
+  /* not implemented */
+  ThreadLocalKey( const ThreadLocalKey & );
+  ThreadLocalKey &operator=( const ThreadLocalKey & );
+
+public:
+  ThreadLocalKey( void (*destroy)( void * ) ) : key()
+  {
+    fatal_assert( 0 == pthread_key_create( &key, destroy ) );
+  }
+
+  void *get( void ) const { return pthread_getspecific( key ); }
+  void set( void *value ) { fatal_assert( 0 == pthread_setspecific( key, value ) ); }
+};
+
+template <class T>
+class ThreadLocal {
+private:
+  ThreadLocalKey key;
+
+  static void destroy( void *value ) { delete static_cast< T * >( value ); }
+
+public:
+  ThreadLocal() : key( destroy ) {}
+
+  T &get( void )
+  {
+    T *value = static_cast< T * >( key.get() );
+    if ( value == NULL ) {
+      value = new T;
+      key.set( value );
+    }
+    return *value;
+  }
+};
+
+#endif
@@ -0,0 +1,236 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+#ifndef TIMERWHEEL_HPP
+#define TIMERWHEEL_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+/* Deadlines for any number of owners, in ms, kept in a hierarchical
+   timing wheel: 64 slots of 1 ms, then 64 of 64 ms, and so on for
+   LEVELS levels, with anything later in the last level's farthest slot.
+
+   Scheduling and cancelling a timer take constant time. Advancing to
+   a new time visits only the timers that expire, plus, once per slot
+   of an upper level, the timers that move down from it. So an owner
+   is only looked at when its deadline is up, however many others
+   are waiting.
+
+   A Timer unlinks itself when it is destroyed, so an owner may simply
+   be deleted. Not thread-safe. */
+
+template <class T>
+class TimerWheel {
+public:
+  class Timer {
+    friend class TimerWheel;
+
+  private:
+    T *owner;
+    uint64_t deadline;
+    Timer *prev, *next; /* NULL if not scheduled */
+
+    void unlink( void )
+    {
+      if ( prev ) {
+        prev->next = next;
+        next->prev = prev;
+        prev = next = NULL;
+      }
+    }
+
+    /* not implemented */
+    Timer( const Timer & );
+    Timer &operator=( const Timer & );
+
+  public:
+    Timer( T *s_owner = NULL ) : owner( s_owner ), deadline( 0 ), prev( NULL ), next( NULL ) {}
+    ~Timer() { unlink(); }
+
+    bool scheduled( void ) const { return prev != NULL; }
+    uint64_t get_deadline( void ) const { return deadline; }
+  };
+
+private:
+  static const int LEVELS = 4;
+  static const int SLOT_BITS = 6;
+  static const int SLOTS = 1 << SLOT_BITS;
+  static const uint64_t SLOT_MASK = SLOTS - 1;
+
+  /* each slot is a circular list through its sentinel */
+  Timer slots[ LEVELS ][ SLOTS ];
+
+  /* the time we have advanced to */
+  uint64_t current;
+
+  static bool empty( const Timer &slot ) { return slot.next == &slot; }
+
+  /* put timer in the slot for when, which is no earlier than current */
+  void place( Timer &timer, uint64_t when )
+  {
+    uint64_t delta = when - current;
+    int level = 0;
+    while ( level < LEVELS - 1 && (delta >> (SLOT_BITS * (level + 1))) != 0 ) {
+      level++;
+    }
+    if ( (delta >> (SLOT_BITS * LEVELS)) != 0 ) {
+      /* past the end: the farthest slot, from where it moves down again */
+      when = current + (uint64_t( 1 ) << (SLOT_BITS * LEVELS)) - 1;
+    }
+
+    Timer &slot = slots[ level ][ (when >> (SLOT_BITS * level)) & SLOT_MASK ];
+    timer.prev = slot.prev;
+    timer.next = &slot;
+    slot.prev->next = &timer;
+    slot.prev = &timer;
+  }
+
+  /* move the timers of a slot down to where they now belong */
+  void cascade( int level, uint64_t index )
+  {
+    Timer &slot = slots[ level ][ index ];
+    Timer *first = slot.next;
+    Timer *end = &slot;
+    /* detach the whole list, so that re-placing into it is safe */
+    slot.prev->next = NULL;
+    slot.next = slot.prev = &slot;
+
+    for ( Timer *timer = first; timer != end && timer != NULL; ) {
+      Timer *next = timer->next;
+      place( *timer, timer->deadline );
+      timer = next;
+    }
+  }
+
+  /* advance current by one ms, collecting what expires */
+  void step( std::vector< T * > &expired )
+  {
+    current++;
+
+    /* on the boundary of a slot of a higher level, bring it down */
+    for ( int level = 1; level < LEVELS; level++ ) {
+      if ( ((current >> (SLOT_BITS * (level - 1))) & SLOT_MASK) != 0 ) {
+        break;
+      }
+      cascade( level, (current >> (SLOT_BITS * level)) & SLOT_MASK );
+    }
+
+    Timer &slot = slots[ 0 ][ current & SLOT_MASK ];
+    while ( !empty( slot ) ) {
+      Timer *timer = slot.next;
+      timer->unlink();
+      expired.push_back( timer->owner );
+    }
+  }
+
+  /* not implemented */
+  TimerWheel( const TimerWheel & );
+  TimerWheel &operator=( const TimerWheel & );
+
+public:
+  TimerWheel( uint64_t now ) : current( now )
+  {
+    for ( int level = 0; level < LEVELS; level++ ) {
+      for ( int i = 0; i < SLOTS; i++ ) {
+        slots[ level ][ i ].prev = slots[ level ][ i ].next = &slots[ level ][ i ];
+      }
+    }
+  }
+
+  ~TimerWheel()
+  {
+    /* leave the timers unscheduled rather than pointing at us */
+    for ( int level = 0; level < LEVELS; level++ ) {
+      for ( int i = 0; i < SLOTS; i++ ) {
+        while ( !empty( slots[ level ][ i ] ) ) {
+          slots[ level ][ i ].next->unlink();
+        }
+        slots[ level ][ i ].prev = slots[ level ][ i ].next = NULL;
+      }
+    }
+  }
+
+  /* Set timer to expire at deadline, or at the next advance() if that
+     is already past. Replaces any deadline it had. */
+  void schedule( Timer &timer, uint64_t deadline )
+  {
+    timer.unlink();
+    timer.deadline = deadline;
+    place( timer, deadline > current ? deadline : current + 1 );
+  }
+
+  void cancel( Timer &timer ) { timer.unlink(); }
+
+  /* Move the time on to now, and append the owner of each timer that
+     has expired to expired, unscheduling it. */
+  void advance( uint64_t now, std::vector< T * > &expired )
+  {
+    while ( current < now ) {
+      uint64_t next = next_deadline();
+      if ( next > now ) {
+        /* nothing to do on the way, not even moving timers down */
+        current = now;
+        return;
+      }
+      current = next - 1;
+      step( expired );
+    }
+  }
+
+  /* A time no later than the earliest deadline, and later than the
+     time we have advanced to, at which to call advance(); or
+     uint64_t( -1 ) if no timer is scheduled. It is the deadline
+     itself if that is within the first level. */
+  uint64_t next_deadline( void ) const
+  {
+    uint64_t earliest = uint64_t( -1 );
+    for ( int level = 0; level < LEVELS; level++ ) {
+      const int shift = SLOT_BITS * level;
+      for ( uint64_t block = (current >> shift) + 1; block <= (current >> shift) + SLOTS; block++ ) {
+        if ( !empty( slots[ level ][ block & SLOT_MASK ] ) ) {
+          uint64_t start = block << shift;
+          if ( start < earliest ) {
+            earliest = start;
+          }
+          break;
+        }
+      }
+    }
+    return earliest;
+  }
+
+  uint64_t now( void ) const { return current; }
+};
+
+#endif
@@ -45,7 +45,8 @@
  #include <stdio.h>
 #endif
 
-static uint64_t millis_cache = -1;
+/* each thread freezes its own time */
+static __thread uint64_t millis_cache = -1;
 
 uint64_t frozen_timestamp( void )
 {